@@ -0,0 +1,178 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+
+#include "Allocations.hpp"
+
+#ifdef REPIX_TRACK_ALLOCATIONS
+
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+namespace {
+    typedef struct {
+        size_t count;
+        size_t bytes;
+        size_t held;
+        size_t peak;
+    } Record;
+    
+    typedef struct {
+        size_t size;
+        Record* site;
+        Record* stage;
+    } Block;
+    
+    std::mutex mutex;
+    
+    // Records are never erased, so pointers to them stay valid.
+    std::map<std::pair<std::string, std::string>, Record> siteRecords;
+    std::map<std::string, Record> stageRecords;
+    std::vector<std::string> stageOrder;
+    std::unordered_map<const void*, Block> blocks;
+    size_t held = 0, peakHeld = 0;
+    
+    thread_local const char* currentStage = nullptr;
+    
+    void hold(Record& record, size_t size) {
+        record.count++;
+        record.bytes += size;
+        record.held += size;
+        record.peak = std::max(record.peak, record.held);
+    }
+}
+
+Allocations::Stage::Stage(const char* name) : _previous(currentStage) {
+    currentStage = name;
+}
+
+Allocations::Stage::~Stage() {
+    currentStage = _previous;
+}
+
+const char* Allocations::Stage::current(void) {
+    return currentStage;
+}
+
+void Allocations::track(void* pointer, size_t size, const char* site) {
+    if (!pointer) return;
+    const char* stage = currentStage ? currentStage : "other";
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = stageRecords.find(stage);
+    if (found == stageRecords.end()) {
+        found = stageRecords.emplace(stage, Record{}).first;
+        stageOrder.push_back(stage);
+    }
+    Record& stageRecord = found->second;
+    Record& siteRecord = siteRecords[{stage, site}];
+    hold(stageRecord, size);
+    hold(siteRecord, size);
+    held += size;
+    peakHeld = std::max(peakHeld, held);
+    blocks[pointer] = {size, &siteRecord, &stageRecord};
+}
+
+void Allocations::forget(void* pointer) {
+    if (!pointer) return;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = blocks.find(pointer);
+    if (it == blocks.end()) return;
+    it->second.site->held -= it->second.size;
+    it->second.stage->held -= it->second.size;
+    held -= it->second.size;
+    blocks.erase(it);
+}
+
+void* Allocations::allocate(size_t size, const char* site) {
+    void* pointer = malloc(size);
+    track(pointer, size, site);
+    return pointer;
+}
+
+void* Allocations::allocateZeroed(size_t size, const char* site) {
+    void* pointer = calloc(1, size);
+    track(pointer, size, site);
+    return pointer;
+}
+
+void Allocations::release(void* pointer) {
+    forget(pointer);
+    free(pointer);
+}
+
+bool Allocations::isEnabled(void) {
+    return true;
+}
+
+std::vector<Allocations::Usage> Allocations::stages(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Usage> usage;
+    for (const std::string& stage : stageOrder) {
+        const Record& record = stageRecords[stage];
+        usage.push_back({stage, "", record.count, record.bytes, record.peak});
+    }
+    return usage;
+}
+
+std::vector<Allocations::Usage> Allocations::sites(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Usage> usage;
+    for (const std::string& stage : stageOrder) {
+        size_t first = usage.size();
+        for (auto it = siteRecords.lower_bound({stage, ""}); it != siteRecords.end() && it->first.first == stage; ++it) {
+            usage.push_back({stage, it->first.second, it->second.count, it->second.bytes, it->second.peak});
+        }
+        std::sort(usage.begin() + first, usage.end(), [](const Usage& a, const Usage& b) {
+            return a.bytes > b.bytes;
+        });
+    }
+    return usage;
+}
+
+size_t Allocations::peak(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peakHeld;
+}
+
+#else
+
+std::vector<Allocations::Usage> Allocations::stages(void) {
+    return {};
+}
+
+std::vector<Allocations::Usage> Allocations::sites(void) {
+    return {};
+}
+
+size_t Allocations::peak(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+
+#ifndef Allocations_hpp
+#define Allocations_hpp
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <stddef.h>
+
+/*
+ Tracks the image buffers, and those of libpng, by the stage of the thread
+ allocating them and the site they are allocated for, counting them along with
+ their bytes and the most of them held at once.
+ 
+ Tracking is built in only when REPIX_TRACK_ALLOCATIONS is defined, otherwise
+ allocating is plain malloc and free and nothing is recorded. The tracked
+ build serialises every allocation through a lock, so it is meant for
+ profiling rather than for production.
+ */
+class Allocations {
+public:
+    typedef struct {
+        std::string stage;
+        std::string site;       // Empty for the totals of a stage
+        size_t count;
+        size_t bytes;
+        size_t peak;            // The most bytes held at once
+    } Usage;
+    
+    // Attributes the allocations of the current thread to the stage while in scope.
+    class Stage {
+    public:
+        Stage(const char* name);
+        ~Stage();
+        
+        // The stage of the current thread, or nullptr, for the threads it starts to carry on in.
+        static const char* current(void);
+        
+    private:
+        const char* _previous;
+    };
+    
+    // Allocates through Allocations for the containers that are worth tracking.
+    template <typename T>
+    struct Allocator {
+        typedef T value_type;
+        const char* site;
+        
+        explicit Allocator(const char* site) noexcept : site(site) {}
+        template <typename U> Allocator(const Allocator<U>& other) noexcept : site(other.site) {}
+        
+        T* allocate(size_t n) {
+            T* p = (T *)Allocations::allocate(n * sizeof(T), site);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+        void deallocate(T* p, size_t) noexcept { Allocations::release(p); }
+        
+        template <typename U> bool operator==(const Allocator<U>&) const noexcept { return true; }
+        template <typename U> bool operator!=(const Allocator<U>&) const noexcept { return false; }
+    };
+    
+    template <typename T>
+    using Vector = std::vector<T, Allocator<T>>;
+    
+    static void* allocate(size_t size, const char* site);
+    static void* allocateZeroed(size_t size, const char* site);
+    
+    // Releases what either allocate or allocateZeroed returned.
+    static void release(void* pointer);
+    
+    // Records memory that is allocated otherwise, such as a mapping, until it is forgotten.
+    static void track(void* pointer, size_t size, const char* site);
+    static void forget(void* pointer);
+    
+    static bool isEnabled(void);
+    
+    // The totals of each stage, in the order they were first seen.
+    static std::vector<Usage> stages(void);
+    
+    // Every site of every stage, the largest by bytes first within each stage.
+    static std::vector<Usage> sites(void);
+    
+    // The most bytes held at once across every stage.
+    static size_t peak(void);
+};
+
+#ifndef REPIX_TRACK_ALLOCATIONS
+inline Allocations::Stage::Stage(const char*) : _previous(nullptr) {}
+inline Allocations::Stage::~Stage() {}
+inline const char* Allocations::Stage::current(void) { return nullptr; }
+
+inline void* Allocations::allocate(size_t size, const char*) { return malloc(size); }
+inline void* Allocations::allocateZeroed(size_t size, const char*) { return calloc(1, size); }
+inline void Allocations::release(void* pointer) { free(pointer); }
+inline void Allocations::track(void*, size_t, const char*) {}
+inline void Allocations::forget(void*) {}
+inline bool Allocations::isEnabled(void) { return false; }
+#endif
+
+#endif /* Allocations_hpp */
@@ -0,0 +1,482 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "AsyncIO.hpp"
+#include "Parallel.hpp"
+
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sched.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+// Kernel headers older than the open, stat and close operations are left to the threads.
+#ifdef IORING_FEAT_RW_CUR_POS
+#define REPIX_IO_URING 1
+#endif
+#endif
+
+// The most transferred by a single read or write, larger files take several.
+#define IO_CHUNK (1u << 30)
+
+//MARK: - io_uring
+
+#ifdef REPIX_IO_URING
+
+/*
+ The rings are driven through the system calls directly, rather than through
+ liburing, so nothing beyond the kernel headers is needed to build.
+ */
+struct AsyncIO::Ring {
+    int fd;
+    unsigned entries;
+    std::atomic<unsigned>* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    std::atomic<unsigned>* cqHead;
+    std::atomic<unsigned>* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    void* rings;
+    size_t ringsSize;
+    size_t sqesSize;
+    bool failed;                            // Refused a submission, leaving the rest to the threads
+};
+
+static void destroyRing(AsyncIO::Ring* ring);
+
+static AsyncIO::Ring* createRing(unsigned depth) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) return nullptr;
+    
+    // The open, stat and close operations arrived with the current file position feature.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return nullptr;
+    }
+    
+    AsyncIO::Ring* ring = new AsyncIO::Ring();
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->rings = mmap(nullptr, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->rings == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, ring->sqesSize);
+        if (ring->rings == MAP_FAILED) ring->rings = nullptr;
+        ring->sqes = nullptr;
+        destroyRing(ring);
+        return nullptr;
+    }
+    
+    uint8_t* base = (uint8_t *)ring->rings;
+    ring->sqTail = (std::atomic<unsigned> *)(base + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(base + params.sq_off.array);
+    ring->sqes = (io_uring_sqe *)sqes;
+    ring->cqHead = (std::atomic<unsigned> *)(base + params.cq_off.head);
+    ring->cqTail = (std::atomic<unsigned> *)(base + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+    return ring;
+}
+
+static void destroyRing(AsyncIO::Ring* ring) {
+    if (ring == nullptr) return;
+    if (ring->sqes != nullptr) munmap(ring->sqes, ring->sqesSize);
+    if (ring->rings != nullptr) munmap(ring->rings, ring->ringsSize);
+    close(ring->fd);
+    delete ring;
+}
+
+/*
+ Prepares count operations, submitting as many at a time as the ring holds
+ and waiting for them all with the one system call, returning the result of
+ each operation.
+ 
+ Should the kernel refuse to enter the ring, the operations it already took
+ are waited out, as they still use the buffers, and the ring is marked as
+ failed with the rest left at -EIO for the threads to redo.
+ */
+static std::vector<int> runOperations(AsyncIO::Ring* ring, size_t count, const std::function<void(size_t n, io_uring_sqe* sqe)>& prepare) {
+    std::vector<int> results(count, -EIO);
+    
+    auto reap = [&](void) {
+        unsigned reaped = 0;
+        unsigned head = ring->cqHead->load(std::memory_order_relaxed);
+        unsigned available = ring->cqTail->load(std::memory_order_acquire);
+        for (; head != available; ++head, ++reaped) {
+            const io_uring_cqe& cqe = ring->cqes[head & ring->cqMask];
+            if (cqe.user_data < count) results[cqe.user_data] = cqe.res;
+        }
+        ring->cqHead->store(head, std::memory_order_release);
+        return reaped;
+    };
+    
+    for (size_t first = 0; first < count && !ring->failed; first += ring->entries) {
+        unsigned submit = (unsigned)std::min<size_t>(ring->entries, count - first);
+        unsigned tail = ring->sqTail->load(std::memory_order_relaxed);
+        for (unsigned n = 0; n < submit; ++n) {
+            unsigned slot = (tail + n) & ring->sqMask;
+            io_uring_sqe* sqe = &ring->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            prepare(first + n, sqe);
+            sqe->user_data = first + n;
+            ring->sqArray[slot] = slot;
+        }
+        ring->sqTail->store(tail + submit, std::memory_order_release);
+        
+        unsigned reaped = 0;
+        unsigned toSubmit = submit;
+        while (reaped < submit) {
+            int entered = (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, submit - reaped, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (entered < 0 && errno != EINTR) {
+                ring->failed = true;
+                break;
+            }
+            if (entered > 0) toSubmit -= std::min<unsigned>(toSubmit, entered);
+            reaped += reap();
+        }
+        
+        // Those submitted complete into the ring whether or not the kernel can be entered to wait on them.
+        for (unsigned submitted = submit - toSubmit; ring->failed && reaped < submitted; reaped += reap()) {
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, submitted - reaped, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR) sched_yield();
+        }
+    }
+    return results;
+}
+
+static void closeFiles(AsyncIO::Ring* ring, const std::vector<int>& descriptors) {
+    std::vector<int> open;
+    for (int fd : descriptors) {
+        if (fd >= 0) open.push_back(fd);
+    }
+    std::vector<int> results = runOperations(ring, open.size(), [&](size_t n, io_uring_sqe* sqe) {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = open[n];
+    });
+    
+    // Those the ring failed to close are closed here instead.
+    for (size_t n = 0; n < open.size() && ring->failed; ++n) {
+        if (results[n] == -EIO) close(open[n]);
+    }
+}
+
+/*
+ Reads or writes the remainder of every file still pending, a whole file at a
+ time unless the kernel returns short, then resubmits what is left.
+ */
+static void transferFiles(AsyncIO::Ring* ring, uint8_t opcode, const std::vector<int>& descriptors, std::vector<uint8_t*> buffers, std::vector<size_t>& lengths, std::vector<int>& errors) {
+    std::vector<size_t> done(descriptors.size(), 0);
+    std::vector<size_t> pending;
+    for (size_t n = 0; n < descriptors.size(); ++n) {
+        if (descriptors[n] >= 0 && errors[n] == 0 && lengths[n] > 0) pending.push_back(n);
+    }
+    
+    while (!pending.empty()) {
+        std::vector<int> results = runOperations(ring, pending.size(), [&](size_t n, io_uring_sqe* sqe) {
+            size_t file = pending[n];
+            sqe->opcode = opcode;
+            sqe->fd = descriptors[file];
+            sqe->addr = (uint64_t)(uintptr_t)(buffers[file] + done[file]);
+            sqe->len = (unsigned)std::min<size_t>(lengths[file] - done[file], IO_CHUNK);
+            sqe->off = done[file];
+        });
+        
+        std::vector<size_t> remaining;
+        for (size_t n = 0; n < pending.size(); ++n) {
+            size_t file = pending[n];
+            if (results[n] < 0) {
+                errors[file] = -results[n];
+            } else if (results[n] == 0) {
+                // The file shrank since its size was taken.
+                lengths[file] = done[file];
+            } else {
+                done[file] += results[n];
+                if (done[file] < lengths[file]) remaining.push_back(file);
+            }
+        }
+        pending.swap(remaining);
+    }
+}
+
+static std::vector<int> readFilesWithRing(AsyncIO::Ring* ring, const std::vector<std::string>& filenames, std::vector<std::vector<uint8_t>>& contents) {
+    const size_t count = filenames.size();
+    std::vector<struct statx> stats(count);
+    
+    // Each file is opened and its size taken together.
+    std::vector<int> results = runOperations(ring, count * 2, [&](size_t n, io_uring_sqe* sqe) {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)filenames[n / 2].c_str();
+        if (n % 2 == 0) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        } else {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->len = STATX_SIZE;
+            sqe->off = (uint64_t)(uintptr_t)&stats[n / 2];
+        }
+    });
+    
+    std::vector<int> descriptors(count), errors(count, 0);
+    std::vector<uint8_t*> buffers(count, nullptr);
+    std::vector<size_t> lengths(count, 0);
+    for (size_t n = 0; n < count; ++n) {
+        descriptors[n] = results[n * 2];
+        if (descriptors[n] < 0) {
+            errors[n] = -descriptors[n];
+        } else if (results[n * 2 + 1] < 0) {
+            errors[n] = -results[n * 2 + 1];
+        } else {
+            contents[n].resize(stats[n].stx_size);
+            buffers[n] = contents[n].data();
+            lengths[n] = contents[n].size();
+        }
+    }
+    
+    transferFiles(ring, IORING_OP_READ, descriptors, buffers, lengths, errors);
+    closeFiles(ring, descriptors);
+    
+    for (size_t n = 0; n < count; ++n) {
+        if (errors[n] == 0) contents[n].resize(lengths[n]);
+    }
+    return errors;
+}
+
+static std::vector<int> writeFilesWithRing(AsyncIO::Ring* ring, const std::vector<std::string>& filenames, const std::vector<std::vector<uint8_t>>& contents) {
+    const size_t count = filenames.size();
+    std::vector<int> descriptors = runOperations(ring, count, [&](size_t n, io_uring_sqe* sqe) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)filenames[n].c_str();
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len = 0666;
+    });
+    
+    std::vector<int> errors(count, 0);
+    std::vector<uint8_t*> buffers(count);
+    std::vector<size_t> lengths(count);
+    for (size_t n = 0; n < count; ++n) {
+        if (descriptors[n] < 0) errors[n] = -descriptors[n];
+        buffers[n] = (uint8_t *)contents[n].data();
+        lengths[n] = contents[n].size();
+    }
+    
+    transferFiles(ring, IORING_OP_WRITE, descriptors, buffers, lengths, errors);
+    for (size_t n = 0; n < count; ++n) {
+        if (errors[n] == 0 && lengths[n] != contents[n].size()) errors[n] = EIO;
+    }
+    closeFiles(ring, descriptors);
+    return errors;
+}
+
+/*
+ Renames are submitted together where the headers know of the operation,
+ should the kernel not, each file is renamed with a system call of its own.
+ */
+static void renameFilesWithRing(AsyncIO::Ring* ring, const std::vector<std::string>& from, const std::vector<std::string>& to, std::vector<int>& errors) {
+    std::vector<size_t> pending;
+    for (size_t n = 0; n < from.size(); ++n) {
+        if (errors[n] == 0) pending.push_back(n);
+    }
+    
+#ifdef IORING_FEAT_NATIVE_WORKERS
+    std::vector<int> results = runOperations(ring, pending.size(), [&](size_t n, io_uring_sqe* sqe) {
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)from[pending[n]].c_str();
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uint64_t)(uintptr_t)to[pending[n]].c_str();
+    });
+#else
+    std::vector<int> results(pending.size(), -EINVAL);
+#endif
+    
+    for (size_t n = 0; n < pending.size(); ++n) {
+        size_t file = pending[n];
+        if (results[n] == -EINVAL) results[n] = rename(from[file].c_str(), to[file].c_str()) == 0 ? 0 : -errno;
+        if (results[n] < 0) errors[file] = -results[n];
+    }
+}
+
+#else
+
+struct AsyncIO::Ring {
+};
+
+static AsyncIO::Ring* createRing(unsigned depth) {
+    return nullptr;
+}
+
+static void destroyRing(AsyncIO::Ring* ring) {
+}
+
+#endif
+
+//MARK: - Threads
+
+// A hidden name alongside the file, unique to the process.
+static std::string temporaryFilename(const std::string& filename) {
+    size_t start = filename.find_last_of('/');
+    start = start == std::string::npos ? 0 : start + 1;
+    return filename.substr(0, start) + "." + filename.substr(start) + ".tmp" + std::to_string(getpid());
+}
+
+static int readFile(const std::string& filename, std::vector<uint8_t>& data) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno;
+    
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    
+    data.resize(status.st_size);
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t length = pread(fd, data.data() + done, std::min<size_t>(data.size() - done, IO_CHUNK), done);
+        if (length < 0 && errno == EINTR) continue;
+        if (length < 0) {
+            int error = errno;
+            close(fd);
+            return error;
+        }
+        if (length == 0) break;
+        done += length;
+    }
+    data.resize(done);
+    close(fd);
+    return 0;
+}
+
+static int writeFile(const std::string& filename, const std::vector<uint8_t>& data) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return errno;
+    
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t length = pwrite(fd, data.data() + done, std::min<size_t>(data.size() - done, IO_CHUNK), done);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) {
+            int error = length < 0 ? errno : EIO;
+            close(fd);
+            return error;
+        }
+        done += length;
+    }
+    return close(fd) == 0 ? 0 : errno;
+}
+
+//MARK: - AsyncIO
+
+AsyncIO::AsyncIO(unsigned depth) : _depth(depth < 1 ? 1 : depth) {
+    _ring = createRing(_depth);
+}
+
+AsyncIO::~AsyncIO() {
+    destroyRing(_ring);
+}
+
+const char* AsyncIO::backend(void) const {
+    return _ring != nullptr ? "io_uring" : "threads";
+}
+
+std::vector<int> AsyncIO::readFiles(const std::vector<std::string>& filenames, std::vector<std::vector<uint8_t>>& contents) {
+    contents.assign(filenames.size(), {});
+#ifdef REPIX_IO_URING
+    if (_ring != nullptr) {
+        std::vector<int> errors = readFilesWithRing(_ring, filenames, contents);
+        if (!_ring->failed) return errors;
+        
+        // Once the kernel refuses the ring every file is read again by the threads, as are those after.
+        destroyRing(_ring);
+        _ring = nullptr;
+        contents.assign(filenames.size(), {});
+    }
+#endif
+    
+    std::vector<int> errors(filenames.size(), 0);
+    Parallel::forRows((int)filenames.size(), 1, [&](int first, int last) {
+        for (int n = first; n < last; ++n) {
+            errors[n] = readFile(filenames[n], contents[n]);
+        }
+    });
+    return errors;
+}
+
+std::vector<int> AsyncIO::writeFiles(const std::vector<std::string>& filenames, const std::vector<std::vector<uint8_t>>& contents, bool atomically) {
+    std::vector<std::string> targets = filenames;
+    if (atomically) {
+        for (std::string& target : targets) {
+            target = temporaryFilename(target);
+        }
+    }
+    
+    std::vector<int> errors(filenames.size(), 0);
+#ifdef REPIX_IO_URING
+    if (_ring != nullptr) {
+        errors = writeFilesWithRing(_ring, targets, contents);
+        if (atomically) renameFilesWithRing(_ring, targets, filenames, errors);
+        
+        // Those already renamed are written again in full, which leaves the same contents.
+        if (_ring->failed) {
+            destroyRing(_ring);
+            _ring = nullptr;
+        }
+    }
+#endif
+    
+    if (_ring == nullptr) {
+        Parallel::forRows((int)filenames.size(), 1, [&](int first, int last) {
+            for (int n = first; n < last; ++n) {
+                errors[n] = writeFile(targets[n], contents[n]);
+                if (atomically && errors[n] == 0 && rename(targets[n].c_str(), filenames[n].c_str()) != 0) errors[n] = errno;
+            }
+        });
+    }
+    
+    // A failed write leaves nothing behind, not even a partial temporary file.
+    for (size_t n = 0; n < filenames.size() && atomically; ++n) {
+        if (errors[n]) unlink(targets[n].c_str());
+    }
+    return errors;
+}
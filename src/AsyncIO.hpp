@@ -0,0 +1,79 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef AsyncIO_hpp
+#define AsyncIO_hpp
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ Reads and writes whole files in groups, so that a batch of small images
+ costs a few system calls rather than several for every file. On Linux the
+ opens, reads, writes and closes of a group are each submitted together
+ through io_uring, elsewhere, or should the kernel refuse io_uring, each file
+ is read or written with pread/pwrite by its own thread.
+ 
+ An instance is used by one thread at a time.
+ */
+class AsyncIO {
+public:
+    struct Ring;                                    // The io_uring queues, where supported
+    
+    explicit AsyncIO(unsigned depth = 64);
+    ~AsyncIO();
+    
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+    
+    // The backend in use, io_uring or threads.
+    const char* backend(void) const;
+    
+    /**
+     @brief    Reads each file in full.
+     @param    filenames The files to read.
+     @param    contents Receives the contents of each file.
+     @return   Zero for each file read, otherwise the error number.
+     */
+    std::vector<int> readFiles(const std::vector<std::string>& filenames, std::vector<std::vector<uint8_t>>& contents);
+    
+    /**
+     @brief    Writes each file, replacing any existing file.
+     @param    filenames The files to write.
+     @param    contents The contents of each file.
+     @param    atomically Write each to a hidden temporary file, renamed over the file once complete, so that the
+               file is never seen partly written.
+     @return   Zero for each file written, otherwise the error number.
+     */
+    std::vector<int> writeFiles(const std::vector<std::string>& filenames, const std::vector<std::vector<uint8_t>>& contents, bool atomically = false);
+    
+private:
+    Ring* _ring = nullptr;
+    unsigned _depth;
+};
+
+#endif /* AsyncIO_hpp */
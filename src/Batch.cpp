@@ -0,0 +1,467 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "Batch.hpp"
+#include "Parallel.hpp"
+#include "AsyncIO.hpp"
+#include "Metrics.hpp"
+#include "Allocations.hpp"
+
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+
+//MARK: - Bounded Queue
+
+/*
+ A queue between two stages that blocks the producer while it holds capacity
+ items, or while the bytes held would exceed the budget. An item larger than
+ the budget is still let through on its own, rather than stalling the batch.
+ An urgent item is let past the capacity while its bytes fit the budget, and
+ one urgent item at a time is let past the budget as well, so that it never
+ waits behind a full queue for long without the budget growing unbounded.
+ 
+ Items are taken in turn unless an order is given, in which case the first
+ item that no other is ordered before is taken.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    typedef std::function<bool(const T& a, const T& b)> Order;
+    typedef std::function<bool(const T& item)> Filter;
+    
+    BoundedQueue(size_t capacity, size_t budget, const std::string& name, const Order& before = nullptr) : _capacity(capacity < 1 ? 1 : capacity), _budget(budget), _labels("queue=\"" + name + "\""), _before(before) {
+    }
+    
+    void push(T item, size_t bytes, bool urgent = false) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        bool overBudget = false;
+        _notFull.wait(lock, [&] {
+            overBudget = false;
+            bool fits = _bytes + bytes <= _budget;
+            if (_items.empty() || (_items.size() < _capacity && fits)) return true;
+            if (urgent && fits) return true;
+            overBudget = urgent && !_overBudget;
+            return overBudget;
+        });
+        _items.push_back({std::move(item), bytes, overBudget});
+        _bytes += bytes;
+        _overBudget = _overBudget || overBudget;
+        Metrics::set("repix_queue_depth", _labels, (int64_t)_items.size());
+        
+        // Consumers taking only some items may pass this one by, so all of them are woken.
+        _notEmpty.notify_all();
+    }
+    
+    // Takes an item only if one is waiting.
+    bool tryPop(T& item) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_items.empty()) return false;
+        take(next(nullptr), item);
+        return true;
+    }
+    
+    // Waits for an item the filter accepts, if any, returning false once the queue is closed without one.
+    bool pop(T& item, const Filter& accept = nullptr) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [&] {
+            return next(accept) != _items.end() || _closed;
+        });
+        auto it = next(accept);
+        if (it == _items.end()) return false;
+        take(it, item);
+        return true;
+    }
+    
+    void close(void) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _notEmpty.notify_all();
+    }
+    
+private:
+    typedef struct {
+        T item;
+        size_t bytes;
+        bool overBudget;                    // An urgent item let past the budget
+    } Entry;
+    typedef std::deque<Entry> Items;
+    
+    std::mutex _mutex;
+    std::condition_variable _notFull;
+    std::condition_variable _notEmpty;
+    Items _items;
+    size_t _capacity;
+    size_t _budget;
+    size_t _bytes = 0;
+    bool _overBudget = false;
+    bool _closed = false;
+    std::string _labels;
+    Order _before;
+    
+    // The item to take next of those accepted, the queue being short enough to search.
+    typename Items::iterator next(const Filter& accept) {
+        auto best = _items.end();
+        for (auto it = _items.begin(); it != _items.end(); ++it) {
+            if (accept && !accept(it->item)) continue;
+            if (best == _items.end() || (_before && _before(it->item, best->item))) best = it;
+        }
+        return best;
+    }
+    
+    void take(typename Items::iterator it, T& item) {
+        item = std::move(it->item);
+        _bytes -= it->bytes;
+        if (it->overBudget) _overBudget = false;
+        _items.erase(it);
+        Metrics::set("repix_queue_depth", _labels, (int64_t)_items.size());
+        _notFull.notify_all();
+    }
+};
+
+//MARK: - Memory Budget
+
+/*
+ Admits jobs while the sum of their estimated peak memory stays within the
+ limit. A job larger than the limit on its own is still admitted once
+ nothing else is, rather than never.
+ */
+class MemoryBudget {
+public:
+    MemoryBudget(size_t limit, size_t reserved) : _limit(limit), _reserved(reserved), _used(reserved) {
+    }
+    
+    bool tryAcquire(size_t bytes) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!fits(bytes)) return false;
+        _used += bytes;
+        return true;
+    }
+    
+    void acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _released.wait(lock, [&] {
+            return fits(bytes);
+        });
+        _used += bytes;
+    }
+    
+    void release(size_t bytes) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _used -= bytes;
+        _released.notify_all();
+    }
+    
+private:
+    std::mutex _mutex;
+    std::condition_variable _released;
+    size_t _limit;
+    size_t _reserved;                       // Held for as long as the batch runs
+    size_t _used;
+    
+    bool fits(size_t bytes) const {
+        return _limit == 0 || _used == _reserved || _used + bytes <= _limit;
+    }
+};
+
+//MARK: - Job
+
+typedef struct {
+    Batch::Item item;
+    TImage* image;                          // Decoded, until handed over to the rePiX
+    CancellationToken cancellation;
+    std::unique_ptr<rePiX> repix;
+    std::unique_ptr<Pipeline> pipeline;
+    size_t bytes;                           // Decoded, held against the queue budgets
+    std::string error;
+    bool cancelled = false;                 // The error being the deadline passing
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+} Job;
+
+typedef std::unique_ptr<Job> JobPointer;
+
+// The most files read, or jobs written, with one submission.
+#define READ_GROUP 32
+#define WRITE_GROUP 16
+
+// The threads a stage is given, at least one.
+static unsigned stageThreads(unsigned count) {
+    return count < 1 ? 1 : count;
+}
+
+/*
+ Runs count threads of a stage, the queue that the stage feeds being closed
+ once the last of them finishes. When threads are pinned, the nth thread is
+ pinned as thread first + n of the affinity, a stage warning once should any
+ of its threads fail to be.
+ */
+static void startStage(std::vector<std::thread>& threads, const char* stage, unsigned count, unsigned first, std::atomic<unsigned>& running, const std::function<void(void)>& body, const std::function<void(void)>& finished) {
+    running = stageThreads(count);
+    std::shared_ptr<std::atomic<bool>> warned = std::make_shared<std::atomic<bool>>(false);
+    for (unsigned n = 0; n < stageThreads(count); ++n) {
+        threads.emplace_back([&running, stage, count, body, finished, first, n, warned] {
+            if (Parallel::hasAffinity() && !Parallel::pinThread(first + n) && !warned->exchange(true)) {
+                // Written in one go, as the threads of every stage start together.
+                std::cout << std::string(R"(\e[1;93mWarning\e[0m: )") + "Unable to pin the " + stage + " threads to CPUs " + Parallel::describeCPUs(first, stageThreads(count)) + ".\n" << std::flush;
+            }
+            body();
+            if (--running == 0) finished();
+        });
+    }
+}
+
+//MARK: - Batch
+
+Batch::Settings Batch::defaultSettings(void) {
+    unsigned threads = Parallel::threadCount();
+    unsigned io = threads / 4 ? threads / 4 : 1;
+    return {io, threads, io, (size_t)512 << 20, false, 0, 0, 0, false, 0};
+}
+
+std::string Batch::describeAffinity(const Settings& settings) {
+    unsigned workers = stageThreads(settings.workers), readers = stageThreads(settings.readers), writers = stageThreads(settings.writers);
+    return "compute threads to CPUs " + Parallel::describeCPUs(0, workers)
+    + ", reader threads to " + Parallel::describeCPUs(workers, readers)
+    + " and writer threads to " + Parallel::describeCPUs(workers + readers, writers);
+}
+
+unsigned Batch::run(const std::vector<Item>& items, const Settings& settings, const Configure& configure, const Completion& completion) {
+    size_t next = 0;
+    return run([&](std::vector<Item>& group, size_t most) {
+        group.assign(items.begin() + next, items.begin() + std::min(next + most, items.size()));
+        next += group.size();
+        return !group.empty();
+    }, settings, configure, completion);
+}
+
+unsigned Batch::run(const Source& source, const Settings& settings, const Configure& configure, const Completion& completion) {
+    auto before = [&settings](const JobPointer& a, const JobPointer& b) {
+        if (a->item.interactive != b->item.interactive) return a->item.interactive;
+        return settings.cheapestFirst && a->item.cost < b->item.cost;
+    };
+    
+    // Half the budget for the decoded images waiting on compute, half for the restored images waiting on output.
+    BoundedQueue<JobPointer> decoded(settings.workers * 2, settings.memoryBudget / 2, "decoded", before);
+    BoundedQueue<JobPointer> processed(settings.writers * 2, settings.memoryBudget / 2, "processed", before);
+    
+    MemoryBudget budget(settings.memoryLimit, settings.sharedMemory);
+    std::atomic<unsigned> readers(0), workers(0), failures(0);
+    std::mutex sourceMutex, completionMutex;
+    std::vector<std::thread> threads;
+    
+    startStage(threads, "reader", settings.readers, stageThreads(settings.workers), readers, [&] {
+        Allocations::Stage stage("decode");
+        AsyncIO io;
+        std::vector<Item> group;
+        std::vector<std::string> filenames;
+        std::vector<std::vector<uint8_t>> contents;
+        
+        // Reads and decodes the items admitted, handing each to the compute stage.
+        auto readAdmitted = [&](std::vector<Item>& admitted) {
+            filenames.clear();
+            for (const Item& item : admitted) {
+                if (!item.outOfCore) filenames.push_back(item.input);
+            }
+            std::vector<int> errors = io.readFiles(filenames, contents);
+            uint64_t read = 0;
+            for (const std::vector<uint8_t>& content : contents) read += content.size();
+            Metrics::add("repix_read_bytes_total", "", read);
+            
+            size_t n = 0;
+            for (const Item& item : admitted) {
+                JobPointer job(new Job{item, nullptr, {}, nullptr, nullptr, 0, ""});
+                if (item.outOfCore) {
+                    decoded.push(std::move(job), 0, item.interactive);
+                    continue;
+                }
+                
+                try {
+                    if (errors[n]) throw std::runtime_error("Failed to open file: " + filenames[n] + " (" + strerror(errors[n]) + ")");
+                    job->image = loadPNGGraphicData(contents[n].data(), contents[n].size());
+                    if (job->image == nullptr) throw std::runtime_error("Out of memory");
+                    job->bytes = (size_t)job->image->width * job->image->height * 4;
+                } catch (const std::exception& e) {
+                    job->error = e.what();
+                }
+                std::vector<uint8_t>().swap(contents[n++]);
+                
+                size_t bytes = job->bytes;
+                decoded.push(std::move(job), bytes, item.interactive);
+            }
+            admitted.clear();
+        };
+        
+        std::vector<Item> admitted;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(sourceMutex);
+                if (!source(group, READ_GROUP)) break;
+            }
+            
+            /*
+             An item held back by the memory limit waits until those already
+             admitted are on their way, so that there is always a job in
+             flight to free the memory it waits on.
+             */
+            for (const Item& item : group) {
+                if (!budget.tryAcquire(item.peakMemory)) {
+                    readAdmitted(admitted);
+                    budget.acquire(item.peakMemory);
+                }
+                admitted.push_back(item);
+            }
+            readAdmitted(admitted);
+        }
+    }, [&] {
+        decoded.close();
+    });
+    
+    // At least one compute thread takes any image.
+    const unsigned reserved = std::min(settings.reservedWorkers, stageThreads(settings.workers) - 1);
+    std::atomic<unsigned> started(0);
+    startStage(threads, "compute", settings.workers, 0, workers, [&] {
+        BoundedQueue<JobPointer>::Filter accept = nullptr;
+        if (started++ < reserved) {
+            accept = [](const JobPointer& job) {
+                return job->item.interactive;
+            };
+        }
+        
+        JobPointer job;
+        while (decoded.pop(job, accept)) {
+            if (job->error.empty()) {
+                try {
+                    job->cancellation.setTimeout(settings.timeout);
+                    job->repix.reset(new rePiX());
+                    job->repix->setCancellationToken(&job->cancellation);
+                    job->pipeline.reset(new Pipeline());
+                    if (job->item.outOfCore) {
+                        std::string input = job->item.input;
+                        job->repix->loadPixelatedImage(input);
+                        if (!job->repix->isPixelatedImageLoaded()) throw std::runtime_error("Failed to open file: " + input);
+                    } else {
+                        job->repix->setPixelatedImage(job->image, job->item.input);
+                        job->image = nullptr;
+                    }
+                    Pipeline::Options options = configure(*job->repix, job->item);
+                    if (job->item.outOfCore) job->repix->setOutOfCore(true);
+                    
+                    job->repix->restorePixelatedImage();
+                    job->pipeline->plan(*job->repix, options);
+                    job->pipeline->runProcessing(*job->repix);
+                    job->repix->releasePixelatedImage();
+                } catch (const CancellationToken::Cancelled& e) {
+                    job->error = e.what();
+                    job->cancelled = true;
+                } catch (const std::exception& e) {
+                    job->error = e.what();
+                }
+            }
+            size_t bytes = job->bytes;
+            bool urgent = job->item.interactive;
+            processed.push(std::move(job), bytes, urgent);
+        }
+    }, [&] {
+        processed.close();
+    });
+    
+    /*
+     Each writer takes whichever restored images are waiting, encodes them in
+     memory and writes all of their outputs with the one submission.
+     */
+    std::atomic<unsigned> writers(0);
+    startStage(threads, "writer", settings.writers, stageThreads(settings.workers) + stageThreads(settings.readers), writers, [&] {
+        AsyncIO io;
+        std::vector<JobPointer> group;
+        JobPointer job;
+        
+        while (processed.pop(job)) {
+            group.clear();
+            group.push_back(std::move(job));
+            while (group.size() < WRITE_GROUP && processed.tryPop(job)) {
+                group.push_back(std::move(job));
+            }
+            
+            std::mutex filesMutex;
+            std::vector<std::string> filenames;
+            std::vector<std::vector<uint8_t>> contents;
+            std::vector<size_t> owners;
+            for (size_t n = 0; n < group.size(); ++n) {
+                if (!group[n]->error.empty()) continue;
+                try {
+                    group[n]->repix->setOutputWriter([&, n](const std::string& filename, std::vector<uint8_t>& data) {
+                        std::lock_guard<std::mutex> lock(filesMutex);
+                        filenames.push_back(filename);
+                        contents.push_back(std::move(data));
+                        owners.push_back(n);
+                    });
+                    group[n]->pipeline->runOutput(*group[n]->repix);
+                } catch (const CancellationToken::Cancelled& e) {
+                    group[n]->error = e.what();
+                    group[n]->cancelled = true;
+                } catch (const std::exception& e) {
+                    group[n]->error = e.what();
+                }
+            }
+            
+            std::vector<int> errors = io.writeFiles(filenames, contents, settings.atomicWrites);
+            for (size_t n = 0; n < filenames.size(); ++n) {
+                if (errors[n]) {
+                    group[owners[n]]->error = "Unable to write " + filenames[n] + " (" + strerror(errors[n]) + ")";
+                    continue;
+                }
+                std::cout << "PNG file saved successfully: " + filenames[n] + "\n" << std::flush;
+                Metrics::add("repix_written_bytes_total", "", contents[n].size());
+            }
+            
+            std::lock_guard<std::mutex> lock(completionMutex);
+            for (JobPointer& done : group) {
+                if (!done->error.empty()) failures++;
+                reset(done->image);
+                if (done->repix == nullptr) done->repix.reset(new rePiX());
+                if (done->pipeline == nullptr) done->pipeline.reset(new Pipeline());
+                completion(done->item, *done->repix, *done->pipeline, done->error);
+                budget.release(done->item.peakMemory);
+                
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - done->started;
+                Metrics::observe("repix_image_seconds", "", elapsed.count());
+                Metrics::add("repix_images_total", done->error.empty() ? "status=\"done\"" : done->cancelled ? "status=\"timed_out\"" : "status=\"failed\"");
+            }
+        }
+    }, [] {
+    });
+    
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return failures;
+}
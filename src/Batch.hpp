@@ -0,0 +1,105 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef Batch_hpp
+#define Batch_hpp
+
+#include "rePiX.hpp"
+#include "Pipeline.hpp"
+
+#include <string>
+#include <vector>
+#include <functional>
+
+/*
+ Runs many images as a pipeline of three stages joined by bounded queues, a
+ reader stage that reads and decodes each file, a compute stage that restores
+ and processes it and a writer stage that encodes and saves it, so that the
+ decoding, processing and encoding of different images overlap. A stage is
+ held back once the images queued ahead of it exceed the memory budget.
+ 
+ Images waiting between the stages are taken interactive images first, and
+ then either in turn or the cheapest first. Interactive images are let past a
+ full queue, and some compute threads can be kept for them alone, so that a
+ small image never waits behind a large one.
+ 
+ Files are read and written in groups through AsyncIO, the decoding and
+ encoding being done in memory.
+ */
+class Batch {
+public:
+    typedef struct {
+        std::string input;
+        std::string output;                         // The output of a single scale
+        std::vector<rePiX::ScaledOutput> scales;    // Or several, each to their own file
+        size_t peakMemory = 0;                      // The estimated peak memory of restoring it, or 0
+        bool outOfCore = false;                     // Decoded a band of rows at a time while restoring, not by a reader
+        uint64_t cost = 0;                          // The estimated work, its pixels times the stages, or 0
+        bool interactive = false;                   // Taken ahead of the others, and by the reserved compute threads
+    } Item;
+    
+    typedef struct {
+        unsigned readers;
+        unsigned workers;
+        unsigned writers;
+        size_t memoryBudget;                        // Bytes of decoded images queued between the stages
+        bool atomicWrites;                          // Outputs appear only once complete
+        size_t memoryLimit;                         // Jobs are admitted while their peak memory fits, or 0 for no limit
+        size_t sharedMemory;                        // Held against the limit for the whole batch, as the tables the jobs share
+        unsigned timeout;                           // Milliseconds an image may take once started, or 0 for no limit
+        bool cheapestFirst;                         // Waiting images are taken by the least cost rather than in turn
+        unsigned reservedWorkers;                   // Compute threads that take only interactive images
+    } Settings;
+    
+    // Supplies up to most items at a time, waiting for at least one, or returns false once there are no more.
+    typedef std::function<bool(std::vector<Item>& items, size_t most)> Source;
+    
+    // Applies the restoration settings to the image once decoded, returning the stages to plan.
+    typedef std::function<Pipeline::Options(rePiX& repix, const Item& item)> Configure;
+    
+    // Called for each image once saved, one at a time, with an empty error on success.
+    typedef std::function<void(const Item& item, const rePiX& repix, const Pipeline& pipeline, const std::string& error)> Completion;
+    
+    static Settings defaultSettings(void);
+    
+    // The CPUs that the threads of each stage are pinned to, in the order that they are pinned.
+    static std::string describeAffinity(const Settings& settings);
+    
+    /**
+     @brief    Restores every item, returning once all have been saved.
+     @param    items The images to restore.
+     @param    settings The threads for each stage and the memory budget.
+     @param    configure Prepares each image for restoring.
+     @param    completion Reports each image.
+     @return   The number of images that failed.
+     */
+    static unsigned run(const std::vector<Item>& items, const Settings& settings, const Configure& configure, const Completion& completion);
+    
+    // Restores the items as the source supplies them, the stages staying up between them.
+    static unsigned run(const Source& source, const Settings& settings, const Configure& configure, const Completion& completion);
+};
+
+#endif /* Batch_hpp */
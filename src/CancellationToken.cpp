@@ -0,0 +1,52 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "CancellationToken.hpp"
+
+static int64_t now(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CancellationToken::cancel(void) {
+    _cancelled.store(true, std::memory_order_relaxed);
+}
+
+void CancellationToken::setTimeout(unsigned milliseconds) {
+    _timeout = milliseconds;
+    _deadline.store(milliseconds ? now() + (int64_t)milliseconds * 1000000 : 0, std::memory_order_relaxed);
+}
+
+bool CancellationToken::isCancelled(void) const {
+    if (_cancelled.load(std::memory_order_relaxed)) return true;
+    
+    int64_t deadline = _deadline.load(std::memory_order_relaxed);
+    return deadline != 0 && now() >= deadline;
+}
+
+void CancellationToken::check(void) const {
+    if (_cancelled.load(std::memory_order_relaxed)) throw Cancelled("Cancelled");
+    if (isCancelled()) throw Cancelled("Timed out after " + std::to_string(_timeout) + " ms");
+}
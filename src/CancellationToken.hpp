@@ -0,0 +1,68 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef CancellationToken_hpp
+#define CancellationToken_hpp
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+/*
+ Lets work on an image be abandoned, either cancelled from another thread or
+ once its deadline passes. The stages check the token a row at a time, and
+ throw Cancelled, which is kept apart from a failure so the caller can tell
+ abandoned work from broken work.
+ */
+class CancellationToken {
+public:
+    class Cancelled : public std::runtime_error {
+    public:
+        explicit Cancelled(const std::string& what) : std::runtime_error(what) {}
+    };
+    
+    // Cancels the work, safe from any thread or a signal handler.
+    void cancel(void);
+    
+    /**
+     @brief    Sets the deadline as a time from now.
+     @param    milliseconds The time allowed, or 0 for no deadline.
+     */
+    void setTimeout(unsigned milliseconds);
+    
+    bool isCancelled(void) const;
+    
+    // Throws Cancelled once cancelled or past the deadline.
+    void check(void) const;
+    
+private:
+    std::atomic<bool> _cancelled{false};
+    std::atomic<int64_t> _deadline{0};     // Steady clock nanoseconds, or 0 for none
+    unsigned _timeout = 0;
+};
+
+#endif /* CancellationToken_hpp */
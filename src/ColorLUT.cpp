@@ -0,0 +1,358 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "ColorLUT.hpp"
+#include "Kernels.hpp"
+#include "Allocations.hpp"
+#include "Metrics.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Entries are filled in runs sharing all but the lowest bits of the color.
+#define RUN_BITS 4
+#define RUN_LENGTH (1 << RUN_BITS)
+#define TABLE_SIZE (1 << 24)
+
+//MARK: - CubeLUT
+
+bool CubeLUT::loadCubeFile(const std::string& filename) {
+    std::ifstream infile;
+    
+    infile.open(filename, std::ios::in);
+    if (!infile.is_open()) {
+        return false;
+    }
+    
+    _size = 0;
+    _grid.clear();
+    
+    std::string line;
+    while (std::getline(infile, line)) {
+        std::istringstream is(line);
+        std::string keyword;
+        if (!(is >> keyword) || keyword[0] == '#') continue;
+        
+        if (keyword == "TITLE") {
+            size_t start = line.find('"'), end = line.rfind('"');
+            if (start != std::string::npos && end > start) _title = line.substr(start + 1, end - start - 1);
+            continue;
+        }
+        if (keyword == "LUT_3D_SIZE") {
+            is >> _size;
+            if (_size < 2 || _size > 256) return false;
+            _grid.reserve((size_t)_size * _size * _size * 3);
+            continue;
+        }
+        if (keyword == "DOMAIN_MIN") {
+            is >> _domainMin[0] >> _domainMin[1] >> _domainMin[2];
+            continue;
+        }
+        if (keyword == "DOMAIN_MAX") {
+            is >> _domainMax[0] >> _domainMax[1] >> _domainMax[2];
+            continue;
+        }
+        if (keyword == "LUT_1D_SIZE") {
+            return false;
+        }
+        
+        float r, g, b;
+        std::istringstream values(line);
+        if (!(values >> r >> g >> b) || _size == 0) return false;
+        _grid.push_back(r);
+        _grid.push_back(g);
+        _grid.push_back(b);
+    }
+    infile.close();
+    
+    return _size > 0 && _grid.size() == (size_t)_size * _size * _size * 3;
+}
+
+uint32_t CubeLUT::evaluate(uint32_t color) const {
+    const float n = (float)(_size - 1);
+    float position[3];
+    unsigned index[3];
+    
+    for (int c = 0; c < 3; ++c) {
+        float value = (float)(color >> (c * 8) & 0xFF) / 255.0f;
+        value = (value - _domainMin[c]) / (_domainMax[c] - _domainMin[c]) * n;
+        value = value < 0 ? 0 : value > n ? n : value;
+        index[c] = value >= n ? _size - 2 : (unsigned)value;
+        position[c] = value - (float)index[c];
+    }
+    
+    auto at = [&](unsigned r, unsigned g, unsigned b) {
+        return &_grid[(((size_t)(index[2] + b) * _size + index[1] + g) * _size + index[0] + r) * 3];
+    };
+    
+    // Tetrahedral interpolation, the cube is split into six tetrahedra along its diagonal.
+    const float fr = position[0], fg = position[1], fb = position[2];
+    const float* c000 = at(0, 0, 0);
+    const float* c111 = at(1, 1, 1);
+    const float *c1, *c2;
+    float w0, w1, w2, w3;
+    
+    if (fr > fg) {
+        if (fg > fb) {
+            c1 = at(1, 0, 0); c2 = at(1, 1, 0);
+            w0 = 1 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+        } else if (fr > fb) {
+            c1 = at(1, 0, 0); c2 = at(1, 0, 1);
+            w0 = 1 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+        } else {
+            c1 = at(0, 0, 1); c2 = at(1, 0, 1);
+            w0 = 1 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+        }
+    } else {
+        if (fb > fg) {
+            c1 = at(0, 0, 1); c2 = at(0, 1, 1);
+            w0 = 1 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+        } else if (fb > fr) {
+            c1 = at(0, 1, 0); c2 = at(0, 1, 1);
+            w0 = 1 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+        } else {
+            c1 = at(0, 1, 0); c2 = at(1, 1, 0);
+            w0 = 1 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+        }
+    }
+    
+    uint32_t result = color & 0xFF000000;
+    for (int c = 0; c < 3; ++c) {
+        float value = w0 * c000[c] + w1 * c1[c] + w2 * c2[c] + w3 * c111[c];
+        value = roundf(value * 255.0f);
+        value = value < 0 ? 0 : value > 255 ? 255 : value;
+        result |= (uint32_t)value << (c * 8);
+    }
+    return result;
+}
+
+//MARK: - ColorLUT
+
+ColorLUT::ColorLUT() {
+    invalidate();
+}
+
+ColorLUT::~ColorLUT() {
+    Allocations::release(_table.load());
+}
+
+void ColorLUT::clear(void) {
+    _stages.clear();
+    invalidate();
+}
+
+void ColorLUT::addPostorize(unsigned levels) {
+    Stage stage = {};
+    stage.type = Postorize;
+    stage.levels = levels;
+    _stages.push_back(stage);
+    invalidate();
+}
+
+size_t ColorLUT::tableMemory(void) {
+    return (size_t)TABLE_SIZE * sizeof(uint32_t) + TABLE_SIZE / RUN_LENGTH / 8;
+}
+
+bool ColorLUT::isPostorizeIdentity(unsigned levels) {
+    // Each channel is posterized on its own, so a gray ramp covers every value of every channel.
+    uint32_t ramp[256];
+    for (uint32_t n = 0; n < 256; ++n) {
+        ramp[n] = 0xFF000000 | n << 16 | n << 8 | n;
+    }
+    Kernels::active().postorize(ramp, 256, levels);
+    
+    for (uint32_t n = 0; n < 256; ++n) {
+        if (ramp[n] != (0xFF000000 | n << 16 | n << 8 | n)) return false;
+    }
+    return true;
+}
+
+void ColorLUT::addCube(const CubeLUT& cube) {
+    Stage stage = {Cube, 0, cube, {}, -1};
+    _stages.push_back(stage);
+    invalidate();
+}
+
+void ColorLUT::addColorTable(const ColorTable& colorTable) {
+    Stage stage = {};
+    stage.type = Palette;
+    stage.colors.assign(colorTable.colors.begin(), colorTable.colors.begin() + colorTable.defined);
+    stage.transparency = colorTable.transparency;
+    _stages.push_back(stage);
+    invalidate();
+}
+
+// Only called while adding stages, never while the table is being applied.
+void ColorLUT::invalidate(void) {
+    const size_t words = (TABLE_SIZE / RUN_LENGTH) / 64;
+    if (!_filled) _filled.reset(new std::atomic<uint64_t>[words]);
+    for (size_t n = 0; n < words; ++n) {
+        _filled[n].store(0, std::memory_order_relaxed);
+    }
+}
+
+// Runs every stage in turn on the pixels using the pixel kernels.
+void ColorLUT::run(uint32_t* pixels, long length) const {
+    for (const Stage& stage : _stages) {
+        switch (stage.type) {
+            case Postorize:
+                Kernels::active().postorize(pixels, length, stage.levels);
+                break;
+                
+            case Cube:
+                for (long i = 0; i < length; ++i) {
+                    pixels[i] = stage.cube.evaluate(pixels[i]);
+                }
+                break;
+                
+            case Palette:
+                Kernels::active().mapColorsToNearestPalette(pixels, length, stage.colors.data(), (int)stage.colors.size(), stage.transparency);
+                break;
+        }
+    }
+}
+
+bool ColorLUT::fill(uint32_t key) {
+    uint32_t run[RUN_LENGTH];
+    uint32_t first = key & ~(uint32_t)(RUN_LENGTH - 1);
+    
+    for (int n = 0; n < RUN_LENGTH; ++n) {
+        run[n] = 0xFF000000 | (first + n);
+    }
+    this->run(run, RUN_LENGTH);
+    
+    // Another thread may have filled the run meanwhile, and it may already be being read.
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_filled[key >> RUN_BITS >> 6].load(std::memory_order_relaxed) >> (key >> RUN_BITS & 63) & 1) return false;
+    memcpy(_table.load(std::memory_order_relaxed) + first, run, sizeof(run));
+    _filled[key >> RUN_BITS >> 6].fetch_or(1ull << (key >> RUN_BITS & 63), std::memory_order_release);
+    return true;
+}
+
+void ColorLUT::apply(uint32_t* pixels, long length) {
+    if (_stages.empty()) return;
+    
+    if (_table.load(std::memory_order_acquire) == nullptr) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // Pages are only committed as runs of the table are filled.
+        if (_table.load(std::memory_order_relaxed) == nullptr) {
+            _table.store((uint32_t*)Allocations::allocate(TABLE_SIZE * sizeof(uint32_t), "lut table"), std::memory_order_release);
+        }
+        if (_table.load(std::memory_order_relaxed) == nullptr) {
+            run(pixels, length);
+            return;
+        }
+    }
+    
+    /*
+     The table holds the result for opaque colors. Unless a posterize comes
+     first and makes every pixel opaque, translucent pixels are run through
+     the stages on their own.
+     */
+    bool keepsAlpha = _stages.front().type != Postorize;
+    std::vector<std::pair<long, uint32_t>> translucent;
+    uint64_t misses = 0, fills = 0;
+    
+    for (long i = 0; i < length; ++i) {
+        uint32_t key = pixels[i] & 0xFFFFFF;
+        if (!(_filled[key >> RUN_BITS >> 6].load(std::memory_order_acquire) >> (key >> RUN_BITS & 63) & 1)) {
+            misses++;
+            if (fill(key)) fills++;
+        }
+        if (keepsAlpha && pixels[i] >> 24 != 0xFF) translucent.push_back({i, pixels[i]});
+    }
+    
+    // How well the table works as a cache, the pixels found already filled against the runs filled for the others.
+    Metrics::add("repix_lut_hits_total", "", length - misses);
+    Metrics::add("repix_lut_runs_filled_total", "", fills);
+    
+    Kernels::active().applyColorLUT(pixels, length, _table.load(std::memory_order_relaxed));
+    
+    for (auto& pixel : translucent) {
+        run(&pixel.second, 1);
+        pixels[pixel.first] = pixel.second;
+    }
+}
+
+bool ColorLUT::saveCubeFile(const std::string& filename, unsigned size) {
+    if (size < 2 || size > 256) return false;
+    
+    std::ofstream outfile;
+    outfile.open(filename, std::ios::out | std::ios::trunc);
+    if (!outfile.is_open()) {
+        return false;
+    }
+    
+    std::vector<uint32_t> grid;
+    grid.reserve((size_t)size * size * size);
+    for (unsigned b = 0; b < size; ++b) {
+        for (unsigned g = 0; g < size; ++g) {
+            for (unsigned r = 0; r < size; ++r) {
+                uint32_t color = 0xFF000000;
+                color |= (uint32_t)lroundf(r * 255.0f / (size - 1));
+                color |= (uint32_t)lroundf(g * 255.0f / (size - 1)) << 8;
+                color |= (uint32_t)lroundf(b * 255.0f / (size - 1)) << 16;
+                grid.push_back(color);
+            }
+        }
+    }
+    run(grid.data(), grid.size());
+    
+    // A .cube file has no alpha, so colors made transparent are written as black.
+    outfile << "TITLE \"rePiX " << describe() << "\"\n";
+    outfile << "LUT_3D_SIZE " << size << "\n";
+    char line[64];
+    for (uint32_t color : grid) {
+        snprintf(line, sizeof(line), "%.6f %.6f %.6f\n", (color & 0xFF) / 255.0f, (color >> 8 & 0xFF) / 255.0f, (color >> 16 & 0xFF) / 255.0f);
+        outfile << line;
+    }
+    outfile.close();
+    return true;
+}
+
+std::string ColorLUT::describe(void) const {
+    std::string description;
+    
+    for (const Stage& stage : _stages) {
+        if (!description.empty()) description += " + ";
+        switch (stage.type) {
+            case Postorize:
+                description += "postorize(" + std::to_string(stage.levels) + ")";
+                break;
+                
+            case Cube:
+                description += "cube(" + std::to_string(stage.cube.size) + ")";
+                break;
+                
+            case Palette:
+                description += "palette(" + std::to_string(stage.colors.size()) + ")";
+                break;
+        }
+    }
+    return description;
+}
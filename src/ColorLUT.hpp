@@ -0,0 +1,138 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+// Written for Little Endian!
+
+#ifndef ColorLUT_hpp
+#define ColorLUT_hpp
+
+#include "ColorTable.hpp"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+
+/*
+ A 3D lookup table sampled on an N x N x N grid, as read from an Adobe/Resolve
+ .cube file, applied with tetrahedral interpolation.
+ */
+class CubeLUT {
+public:
+    const unsigned& size = _size;
+    const std::string& title = _title;
+    
+    CubeLUT() {}
+    CubeLUT(const CubeLUT& other) : _size(other._size), _title(other._title), _domainMin(other._domainMin), _domainMax(other._domainMax), _grid(other._grid) {}
+    
+    bool loadCubeFile(const std::string& filename);
+    uint32_t evaluate(uint32_t color) const;
+    
+private:
+    unsigned _size = 0;
+    std::string _title;
+    std::array<float, 3> _domainMin = {0, 0, 0};
+    std::array<float, 3> _domainMax = {1, 1, 1};
+    std::vector<float> _grid;   // Red varies fastest, as in the file
+};
+
+/*
+ Composes the per-pixel color stages into one 24-bit to 32-bit table. Each
+ stage only depends on the color of the pixel, so the table is filled lazily,
+ a run of entries at a time through the pixel kernels, for the colors that
+ actually occur, and then applied to the image in a single gather pass.
+ 
+ Once its stages are added a table can be applied from several threads at
+ once, runs being filled under a lock and published through their bits.
+ */
+class ColorLUT {
+public:
+    ColorLUT();
+    ColorLUT(const ColorLUT&) = delete;
+    ColorLUT& operator=(const ColorLUT&) = delete;
+    ~ColorLUT();
+    
+    bool isEmpty(void) const {
+        return _stages.empty();
+    }
+    
+    void clear(void);
+    void addPostorize(unsigned levels);
+    
+    // Whether posterizing with the given levels leaves every opaque color unchanged.
+    static bool isPostorizeIdentity(unsigned levels);
+    
+    // The most memory the table takes once applied, every run of it filled.
+    static size_t tableMemory(void);
+    void addCube(const CubeLUT& cube);
+    void addColorTable(const ColorTable& colorTable);
+    
+    /**
+     @brief    Runs every stage on the pixels, in the order they were added.
+     @param    pixels The 32-bit pixels.
+     @param    length The number of pixels.
+     */
+    void apply(uint32_t* pixels, long length);
+    
+    /**
+     @brief    Writes the composed stages sampled on a grid as an Adobe/Resolve .cube file.
+     @param    filename The filename of the .cube file.
+     @param    size The number of grid points along each axis.
+     @return   A true on success.
+     */
+    bool saveCubeFile(const std::string& filename, unsigned size = 33);
+    
+    // The name of each stage in order, used when describing the pipeline.
+    std::string describe(void) const;
+    
+private:
+    typedef enum {
+        Postorize,
+        Cube,
+        Palette
+    } StageType;
+    
+    typedef struct {
+        StageType type;
+        unsigned levels;
+        CubeLUT cube;
+        std::vector<uint32_t> colors;
+        int transparency;
+    } Stage;
+    
+    std::vector<Stage> _stages;
+    std::atomic<uint32_t*> _table{nullptr};
+    std::unique_ptr<std::atomic<uint64_t>[]> _filled;  // One bit for each run of entries
+    std::mutex _mutex;                                  // Held while allocating the table or filling a run
+    
+    void run(uint32_t* pixels, long length) const;
+    bool fill(uint32_t key);                        // A false if another thread filled the run first
+    void invalidate(void);
+};
+
+#endif /* ColorLUT_hpp */
@@ -25,6 +25,12 @@
 #include "ColorTable.hpp"
 
 #include <fstream>
+#include <climits>
+
+// The Adobe Color Table is stored big-endian, so the values need swapping on little-endian hosts.
+#if defined(__LITTLE_ENDIAN__) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define ACT_SWAP_ENDIAN
+#endif
 
 typedef struct __attribute__((__packed__)) {
     struct {
@@ -52,7 +58,7 @@ template <typename T> static T swap_endian(T u) {
 }
 
 void ColorTable::loadAdobeColorTable(const char* filename) {
-    AdobeColorTable adobeColorTable;
+    AdobeColorTable adobeColorTable = {};
     std::ifstream infile;
     
     infile.open(filename, std::ios::in | std::ios::binary);
@@ -61,20 +67,36 @@ void ColorTable::loadAdobeColorTable(const char* filename) {
     }
     
     infile.read((char *)&adobeColorTable, sizeof(AdobeColorTable));
+    std::streamsize length = infile.gcount();
     infile.close();
     
     _defined = adobeColorTable.defined;
     _transparency = adobeColorTable.transparency;
-#ifdef __LITTLE_ENDIAN__
+#ifdef ACT_SWAP_ENDIAN
     _defined = swap_endian(_defined);
     _transparency = swap_endian(_transparency);
 #endif
+    // Older tables are just the 256 colors without the trailing count and transparency index.
+    if (length == sizeof(adobeColorTable.colors)) {
+        _defined = 256;
+        _transparency = -1;
+    }
+    if (_defined > 256) _defined = 256;
     
     for (int n = 0; n < _defined; n++) {
         uint32_t color = (uint32_t)adobeColorTable.colors[n].r << 24 | (uint32_t)adobeColorTable.colors[n].g << 16 | (uint32_t)adobeColorTable.colors[n].b << 8 | 255;
-#ifdef __LITTLE_ENDIAN__
+#ifdef ACT_SWAP_ENDIAN
         color = swap_endian(color);
 #endif
         _colors[n] = color;
     }
 }
+
+void ColorTable::setColors(const uint32_t* colors, uint16_t defined, int16_t transparency) {
+    _defined = defined > 256 ? 256 : defined;
+    _transparency = transparency < _defined ? transparency : -1;
+    _colors = {};
+    for (int n = 0; n < _defined; n++) {
+        _colors[n] = colors[n];
+    }
+}
@@ -40,6 +40,7 @@ public:
     }
     
     void loadAdobeColorTable(const char* filename);
+    void setColors(const uint32_t* colors, uint16_t defined, int16_t transparency);
 private:
     std::array<uint32_t, 256> _colors = {};
     int16_t _transparency;
@@ -23,15 +23,24 @@
  */
 
 #include "ImageAdjustments.hpp"
+#include "Kernels.hpp"
+#include "CancellationToken.hpp"
+#include "Allocations.hpp"
+
 #include <string>
+#include <cmath>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 
 typedef uint32_t Color;
 
-typedef struct {
-    float r;
-    float g;
-    float b;
-} ColorRGB;
+// The rows the palette and outline stages work through between checks of the token.
+#define BAND_ROWS 64
+
+static bool isCancelled(const CancellationToken* token) {
+    return token != nullptr && token->isCancelled();
+}
 
 // Function to extract color components from ARGB value
 static void getColorComponents(Color color, int* r, int* g, int* b) {
@@ -54,66 +63,21 @@ static unsigned colorDistance(Color color1, Color color2) {
                 (b1 - b2) * (b1 - b2));
 }
 
-static ColorRGB convertFromPackedRGB(const Color color) {
-    ColorRGB colorRGB;
-    
-    // Extract the RGB components from the ARGB value
-    unsigned char r = (color >> 16) & 0xFF; // Red (bits 16-23)
-    unsigned char g = (color >> 8) & 0xFF;  // Green (bits 8-15)
-    unsigned char b = color & 0xFF;         // Blue (bits 0-7)
-    
-    // Normalize the values to the range 0-1
-    colorRGB.r = r / 255.0f;
-    colorRGB.g = g / 255.0f;
-    colorRGB.b = b / 255.0f;
-    
-    return colorRGB;
-}
-
-static Color convertToPackedRGB(const ColorRGB colorRGB, float alpha) {
-    // Convert the RGB values (0-1 range) back to 0-255 range
-    Color r = (Color)(colorRGB.r * 255.0f);
-    Color g = (Color)(colorRGB.g * 255.0f);
-    Color b = (Color)(colorRGB.b * 255.0f);
-    Color a = (Color)(alpha * 255.0f);
-    
-    // Combine ARGB into a 32-bit integer
-    return a << 24 | r << 16 | g << 8 | b;
+void ImageAdjustments::postorize(const void* pixels, long length, unsigned levels) {
+    Kernels::active().postorize((uint32_t *)pixels, length, levels);
 }
 
-// Function to reduce resolution of a single color channel (0-1 float)
-static float postorizeChannel(float value, unsigned levels) {
-    float step = 1.0f / (float)(levels - 1);
-    return round(value / step) * step;
-}
+typedef struct {
+    Color baseColor;
+    int count;
+} Bucket;
 
-// Function to reduce the resolution of RGB channels (0-1 range)
-static ColorRGB posterizeRGB(ColorRGB colorRGB, unsigned levels) {
-    colorRGB.r = postorizeChannel(colorRGB.r, levels);
-    colorRGB.g = postorizeChannel(colorRGB.g, levels);
-    colorRGB.b = postorizeChannel(colorRGB.b, levels);
-    return colorRGB;
+size_t ImageAdjustments::normalizeMemory(void) {
+    return (size_t)256 * 256 * 256 * sizeof(Bucket);
 }
 
-
-void ImageAdjustments::postorize(const void* pixels, long length, unsigned levels) {
-    uint32_t* color = (uint32_t*)pixels;
-    
-    for (long i = 0; i < length; ++i) {
-        ColorRGB colorRGB = convertFromPackedRGB(*color);
-        colorRGB = posterizeRGB(colorRGB, levels);
-        *color = convertToPackedRGB(colorRGB, 1.0);
-        color++;
-    }
-}
-
-void ImageAdjustments::normalizeColors(const void* pixels, int w, int h, unsigned threshold) {
-    typedef struct {
-        Color baseColor;
-        int count;
-    } Bucket;
-    
-    Bucket* buckets = (Bucket *)calloc(256 * 256 * 256, sizeof(Bucket)); // Max size for all RGB combinations
+void ImageAdjustments::normalizeColors(const void* pixels, int w, int h, unsigned threshold, const CancellationToken* token) {
+    Bucket* buckets = (Bucket *)Allocations::allocateZeroed(256 * 256 * 256 * sizeof(Bucket), "normalize buckets"); // Max size for all RGB combinations
     Color* colors = (Color *)pixels;
     
     for (int y = 0; y < h; ++y) {
@@ -123,6 +87,12 @@ void ImageAdjustments::normalizeColors(const void* pixels, int w, int h, unsigne
             uint32_t key = baseColor & 0xFFFFFF;
             if (buckets[key].count >= 1) continue;
             
+            // Each new color scans the whole image, so the token is checked before every scan.
+            if (isCancelled(token)) {
+                Allocations::release(buckets);
+                return;
+            }
+            
             buckets[key].count++;
             buckets[key].baseColor = baseColor;
             
@@ -135,72 +105,87 @@ void ImageAdjustments::normalizeColors(const void* pixels, int w, int h, unsigne
         }
     }
 
-    free(buckets);
+    Allocations::release(buckets);
 }
 
-void ImageAdjustments::mapColorsToNearestPalette(const void* pixels, int w, int h, const uint32_t* palt, int paletteSize, int transparencyIndex) {
-    Color* colors = (Color *)pixels;
+void ImageAdjustments::mapColorsToNearestPalette(const void* pixels, int w, int h, const uint32_t* palt, int paletteSize, int transparencyIndex, const CancellationToken* token) {
+    for (int top = 0; top < h && !isCancelled(token); top += BAND_ROWS) {
+        long length = (long)std::min(BAND_ROWS, h - top) * w;
+        Kernels::active().mapColorsToNearestPalette((uint32_t *)pixels + (size_t)top * w, length, palt, paletteSize, transparencyIndex);
+    }
+}
+
+// Each band is outlined against the row above it as it was before the band above was outlined.
+void ImageAdjustments::applyOutline(const void* pixels, int w, int h, const CancellationToken* token) {
+    std::vector<uint32_t> previous(w), last(w);
+    for (int top = 0; top < h && !isCancelled(token); top += BAND_ROWS) {
+        int bottom = std::min(top + BAND_ROWS, h);
+        memcpy(last.data(), (uint32_t *)pixels + (size_t)(bottom - 1) * w, w * sizeof(uint32_t));
+        Kernels::active().applyOutline((uint32_t *)pixels, w, h, top, bottom, previous.data());
+        previous.swap(last);
+    }
+}
+
+bool ImageAdjustments::mapColorsToNearestPaletteIndex(const void* pixels, void* indices, int w, int h, const uint32_t* palt, int paletteSize, const CancellationToken* token) {
+    bool matched = true;
+    for (int top = 0; top < h && !isCancelled(token); top += BAND_ROWS) {
+        long length = (long)std::min(BAND_ROWS, h - top) * w;
+        if (!Kernels::active().mapColorsToNearestPaletteIndex((const uint32_t *)pixels + (size_t)top * w, (uint8_t *)indices + (size_t)top * w, length, palt, paletteSize)) matched = false;
+    }
+    return matched;
+}
+
+void ImageAdjustments::applyOutlineIndexed(const void* indices, int w, int h, const uint32_t* palette, int paletteSize, uint8_t outlineIndex, const CancellationToken* token) {
+    uint8_t classes[256] = {};
     
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            int i = x + y * w;
-            Color baseColor = colors[i];
-            Color matchedColor = baseColor;
-            
-            int distance = 256;
-            for (int n = 0; n < paletteSize; ++n) {
-                if (colorDistance(baseColor, palt[n]) < distance) {
-                    distance = colorDistance(baseColor, palt[n]);
-                    matchedColor = palt[n];
-                }
-            }
-            if (transparencyIndex >= 0) {
-                if (matchedColor == palt[transparencyIndex]) matchedColor = 0;
-            }
-            colors[i] = matchedColor;
-        }
+    // Unused entries are treated as transparent, matching the zeroed pixels of the RGBA outline.
+    for (int n = 0; n < 256; ++n) {
+        uint32_t color = n < paletteSize ? palette[n] : 0;
+        classes[n] = (color == 0 ? 1 : 0) | (color != 0 && color != 0xFF000000 ? 2 : 0);
+    }
+    
+    std::vector<uint8_t> previous(w), last(w);
+    for (int top = 0; top < h && !isCancelled(token); top += BAND_ROWS) {
+        int bottom = std::min(top + BAND_ROWS, h);
+        memcpy(last.data(), (uint8_t *)indices + (size_t)(bottom - 1) * w, w);
+        Kernels::active().applyOutlineIndexed((uint8_t *)indices, w, h, top, bottom, previous.data(), classes, outlineIndex);
+        previous.swap(last);
     }
 }
 
-void ImageAdjustments::applyOutline(const void* pixels, int w, int h) {
-    Color color;
-    Color* colors = (Color *)pixels;
+double ImageAdjustments::paletteError(const uint32_t* colors, const unsigned* counts, long length, const uint32_t* palt, int paletteSize) {
+    if (length <= 0 || paletteSize <= 0) return 0;
     
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            color = colors[x + y * w];
-            if (!color) {
-                continue;
-            }
-            
-            if (color == 0xFF000000) {
-                continue;
-            }
-            
-            if (x > 0) {
-                if (colors[x + y * w - 1] == 0) {
-                    colors[x + y * w - 1] = 0xFF000000;
-                }
-            }
-            
-            if (x < w - 1) {
-                if (colors[x + y * w + 1] == 0) {
-                    colors[x + y * w + 1] = 0xFF000000;
-                }
-            }
-            
-            if (y > 0) {
-                if (colors[x + y * w - w] == 0) {
-                    colors[x + y * w - w] = 0xFF000000;
-                }
-            }
-            
-            if (y < h - 1) {
-                if (colors[x + y * w + w] == 0) {
-                    colors[x + y * w + w] = 0xFF000000;
-                }
-            }
+    // An index can't hold the unmatched sentinel of a full palette, so unmatched colors are flagged apart.
+    uint8_t* indices = (uint8_t *)Allocations::allocate(length * 2, "palette indices");
+    if (!indices) return 0;
+    uint8_t* unmatched = indices + length;
+    memset(unmatched, 0, length);
+    
+    const long Run = 256;
+    for (long first = 0; first < length; first += Run) {
+        long count = std::min(Run, length - first);
+        if (Kernels::active().mapColorsToNearestPaletteIndex(colors + first, indices + first, count, palt, paletteSize)) continue;
+        
+        // Some colors in this run are unmatched, find which.
+        for (long n = first; n < first + count; ++n) {
+            unmatched[n] = !Kernels::active().mapColorsToNearestPaletteIndex(colors + n, indices + n, 1, palt, paletteSize);
+        }
+    }
+    
+    double error = 0, total = 0;
+    for (long i = 0; i < length; ++i) {
+        int squared = 256 * 256;
+        if (!unmatched[i]) {
+            int r1, g1, b1, r2, g2, b2;
+            getColorComponents(colors[i], &r1, &g1, &b1);
+            getColorComponents(palt[indices[i]], &r2, &g2, &b2);
+            squared = (r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) + (b1 - b2) * (b1 - b2);
         }
+        error += (double)squared * counts[i];
+        total += counts[i];
     }
+    Allocations::release(indices);
+    
+    return total > 0 ? error / total : 0;
 }
-
@@ -28,13 +28,34 @@
 #define ImageAdjustments_hpp
 
 #include <stdint.h>
+#include <stddef.h>
+
+class CancellationToken;
 
 class ImageAdjustments {
 public:
     static void postorize(const void* pixels, long length, unsigned levels);
-    static void normalizeColors(const void* pixels, int w, int h, unsigned threshold);
-    static void mapColorsToNearestPalette(const void* pixels, int w, int h, const uint32_t* palt, int paletteSize, int transparencyIndex);
-    static void applyOutline(const void* pixels, int w, int h);
+    
+    // Compares every color with every pixel, so it stops early once the token, if any, is cancelled.
+    static void normalizeColors(const void* pixels, int w, int h, unsigned threshold, const CancellationToken* token = nullptr);
+    
+    // The memory normalizing takes whatever the size of the image, a bucket for every RGB color.
+    static size_t normalizeMemory(void);
+    
+    // The palette and outline stages work through the image a band of rows at a time, stopping once the token is cancelled.
+    static void mapColorsToNearestPalette(const void* pixels, int w, int h, const uint32_t* palt, int paletteSize, int transparencyIndex, const CancellationToken* token = nullptr);
+    static void applyOutline(const void* pixels, int w, int h, const CancellationToken* token = nullptr);
+    
+    /*
+     The mean squared error of mapping colors, each occurring count times, to
+     the nearest palette entries. A color too far from every entry to be
+     matched counts as 256 away.
+     */
+    static double paletteError(const uint32_t* colors, const unsigned* counts, long length, const uint32_t* palt, int paletteSize);
+    
+    // Indexed images, where each pixel is an 8-bit index into a palette of up to 256 colors.
+    static bool mapColorsToNearestPaletteIndex(const void* pixels, void* indices, int w, int h, const uint32_t* palt, int paletteSize, const CancellationToken* token = nullptr);
+    static void applyOutlineIndexed(const void* indices, int w, int h, const uint32_t* palette, int paletteSize, uint8_t outlineIndex, const CancellationToken* token = nullptr);
 };
 
 #endif /* ImageAdjustments_hpp */
@@ -0,0 +1,166 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "ImageMetrics.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+// The height of a tile of source rows, also the size of the SSIM window.
+#define TILE_SIZE 8
+
+typedef struct {
+    double x, y, xx, yy, xy;
+    unsigned count;
+} WindowSums;
+
+static void addBlockError(QualityMetrics& metrics, double sum, unsigned count, unsigned x, unsigned y, unsigned& blocks) {
+    if (count == 0) return;
+    
+    double error = sqrt(sum / (3.0 * count));
+    metrics.meanBlockError += error;
+    if (error > metrics.maxBlockError || blocks == 0) {
+        metrics.maxBlockError = error;
+        metrics.worstBlockX = x;
+        metrics.worstBlockY = y;
+    }
+    blocks++;
+}
+
+static double windowSSIM(const WindowSums& w) {
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    
+    double n = w.count;
+    double mx = w.x / n, my = w.y / n;
+    double vx = w.xx / n - mx * mx;
+    double vy = w.yy / n - my * my;
+    double cxy = w.xy / n - mx * my;
+    
+    return ((2 * mx * my + c1) * (2 * cxy + c2)) / ((mx * mx + my * my + c1) * (vx + vy + c2));
+}
+
+QualityMetrics ImageMetrics::compare(const TImage* original, const TImage* restored, const std::vector<unsigned>& columns, const std::vector<unsigned>& rows) {
+    QualityMetrics metrics = {};
+    
+    if (original == nullptr || restored == nullptr || original->bitWidth != 32 || restored->bitWidth != 32) return metrics;
+    
+    const unsigned w = original->width;
+    const unsigned h = original->height;
+    const uint32_t* src = (const uint32_t *)original->data;
+    const uint32_t* dst = (const uint32_t *)restored->data;
+    
+    /*
+     Each source row is compared against the restored row it maps to, upscaled
+     with the same nearest neighbour replication as scaleImage. The channels
+     are split into planes first so that the per-pixel arithmetic is a simple
+     loop over arrays that the compiler is able to vectorize.
+     */
+    std::vector<int> sr(w), sg(w), sb(w), ur(w), ug(w), ub(w), error(w), ly(w), lx(w);
+    std::vector<uint8_t> valid(w);
+    std::vector<double> blockSum(restored->width);
+    std::vector<unsigned> blockCount(restored->width);
+    std::vector<WindowSums> windows((w + TILE_SIZE - 1) / TILE_SIZE);
+    
+    double totalError = 0, totalSSIM = 0;
+    unsigned long long pixelCount = 0;
+    unsigned blocks = 0, windowCount = 0;
+    unsigned blockRow = NoBlock;
+    
+    for (unsigned ty = 0; ty < h; ty += TILE_SIZE) {
+        std::fill(windows.begin(), windows.end(), WindowSums{});
+        
+        for (unsigned y = ty; y < ty + TILE_SIZE && y < h; ++y) {
+            if (rows[y] == NoBlock) continue;
+            
+            if (rows[y] != blockRow) {
+                for (unsigned bx = 0; bx < restored->width; ++bx) {
+                    addBlockError(metrics, blockSum[bx], blockCount[bx], bx, blockRow, blocks);
+                }
+                std::fill(blockSum.begin(), blockSum.end(), 0.0);
+                std::fill(blockCount.begin(), blockCount.end(), 0);
+                blockRow = rows[y];
+            }
+            
+            const uint32_t* s = src + (size_t)y * w;
+            const uint32_t* d = dst + (size_t)rows[y] * restored->width;
+            
+            for (unsigned x = 0; x < w; ++x) {
+                uint32_t c = columns[x] == NoBlock ? 0 : d[columns[x]];
+                valid[x] = columns[x] != NoBlock;
+                ur[x] = c & 0xFF;
+                ug[x] = c >> 8 & 0xFF;
+                ub[x] = c >> 16 & 0xFF;
+                sr[x] = s[x] & 0xFF;
+                sg[x] = s[x] >> 8 & 0xFF;
+                sb[x] = s[x] >> 16 & 0xFF;
+            }
+            
+            for (unsigned x = 0; x < w; ++x) {
+                int dr = sr[x] - ur[x], dg = sg[x] - ug[x], db = sb[x] - ub[x];
+                error[x] = valid[x] ? dr * dr + dg * dg + db * db : 0;
+                
+                // Luma using the Rec. 601 weights in 8-bit fixed point.
+                ly[x] = (77 * sr[x] + 150 * sg[x] + 29 * sb[x]) >> 8;
+                lx[x] = (77 * ur[x] + 150 * ug[x] + 29 * ub[x]) >> 8;
+            }
+            
+            for (unsigned x = 0; x < w; ++x) {
+                if (!valid[x]) continue;
+                totalError += error[x];
+                blockSum[columns[x]] += error[x];
+                blockCount[columns[x]]++;
+                pixelCount++;
+                
+                WindowSums& window = windows[x / TILE_SIZE];
+                window.x += lx[x];
+                window.y += ly[x];
+                window.xx += lx[x] * lx[x];
+                window.yy += ly[x] * ly[x];
+                window.xy += lx[x] * ly[x];
+                window.count++;
+            }
+        }
+        
+        for (const WindowSums& window : windows) {
+            if (window.count == 0) continue;
+            totalSSIM += windowSSIM(window);
+            windowCount++;
+        }
+    }
+    
+    for (unsigned bx = 0; bx < restored->width && blockRow != NoBlock; ++bx) {
+        addBlockError(metrics, blockSum[bx], blockCount[bx], bx, blockRow, blocks);
+    }
+    
+    if (pixelCount == 0) return metrics;
+    
+    double mse = totalError / (3.0 * pixelCount);
+    metrics.psnr = mse > 0 ? std::fmin(10.0 * log10(255.0 * 255.0 / mse), 100.0) : 100.0;
+    metrics.ssim = windowCount ? totalSSIM / windowCount : 1.0;
+    metrics.meanBlockError /= blocks ? blocks : 1;
+    
+    return metrics;
+}
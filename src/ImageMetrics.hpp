@@ -0,0 +1,59 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+// Written for Little Endian!
+
+#ifndef ImageMetrics_hpp
+#define ImageMetrics_hpp
+
+#include "image.hpp"
+
+#include <vector>
+
+typedef struct {
+    double psnr;            // Peak signal-to-noise ratio in dB, capped at 100 for identical images
+    double ssim;            // Mean structural similarity of the luma over 8x8 windows (0-1)
+    double meanBlockError;  // Mean of the per-block RMS error (0-255)
+    double maxBlockError;   // Largest per-block RMS error (0-255)
+    unsigned worstBlockX;   // Position of the block with the largest error in the restored image
+    unsigned worstBlockY;
+} QualityMetrics;
+
+class ImageMetrics {
+public:
+    static constexpr unsigned NoBlock = ~0u;
+    
+    /**
+     @brief    Compares a restored image, upscaled back onto the source grid, against the source image.
+     @param    original The 32-bit source image.
+     @param    restored The 32-bit restored image.
+     @param    columns For each source column, the restored image column it belongs to or NoBlock.
+     @param    rows For each source row, the restored image row it belongs to or NoBlock.
+     @return   The quality metrics of the restoration.
+     */
+    static QualityMetrics compare(const TImage* original, const TImage* restored, const std::vector<unsigned>& columns, const std::vector<unsigned>& rows);
+};
+
+#endif /* ImageMetrics_hpp */
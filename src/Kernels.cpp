@@ -0,0 +1,572 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "Kernels.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS
+#endif
+
+#define KERNEL_INLINE inline __attribute__((always_inline))
+
+#define OUTLINE_COLOR 0xFF000000
+
+//MARK: - Kernel Implementation/s
+
+/*
+ The kernels are written once as always inlined functions, each instruction
+ set then has its own copy compiled into a function with the matching target
+ attribute so the compiler is free to vectorize for that instruction set.
+ */
+
+static KERNEL_INLINE void postorizePixels(uint32_t* pixels, long length, unsigned levels) {
+    float step = 1.0f / (float)(levels - 1);
+    
+    for (long i = 0; i < length; ++i) {
+        uint32_t color = pixels[i];
+        
+        float r = (float)(color >> 16 & 0xFF) / 255.0f;
+        float g = (float)(color >> 8 & 0xFF) / 255.0f;
+        float b = (float)(color & 0xFF) / 255.0f;
+        
+        r = roundf(r / step) * step;
+        g = roundf(g / step) * step;
+        b = roundf(b / step) * step;
+        
+        pixels[i] = 0xFF000000 | (uint32_t)(r * 255.0f) << 16 | (uint32_t)(g * 255.0f) << 8 | (uint32_t)(b * 255.0f);
+    }
+}
+
+#define PALETTE_CHUNK 16
+
+/*
+ A chunk of pixels is matched against every palette entry at once. The first
+ entry with the smallest whole number distance is kept, which is the entry the
+ Euclidean distance truncated to an integer selects. The nearest squared
+ distance is found first, then the first entry that truncates to the same
+ distance, so the per entry work is all integer arithmetic that vectorizes.
+ Pixels with no entry closer than 256 are given an index of paletteSize.
+ */
+static KERNEL_INLINE void nearestPaletteIndices(const uint32_t* pixels, long count, const int* pr, const int* pg, const int* pb, int paletteSize, int* index) {
+    int r[PALETTE_CHUNK], g[PALETTE_CHUNK], b[PALETTE_CHUNK], nearest[PALETTE_CHUNK], bound[PALETTE_CHUNK];
+    
+    for (int k = 0; k < PALETTE_CHUNK; ++k) {
+        uint32_t color = k < count ? pixels[k] : 0;
+        r[k] = color >> 16 & 0xFF;
+        g[k] = color >> 8 & 0xFF;
+        b[k] = color & 0xFF;
+        nearest[k] = INT32_MAX;
+        index[k] = paletteSize;
+    }
+    
+    for (int n = 0; n < paletteSize; ++n) {
+        for (int k = 0; k < PALETTE_CHUNK; ++k) {
+            int dr = r[k] - pr[n], dg = g[k] - pg[n], db = b[k] - pb[n];
+            int d = dr * dr + dg * dg + db * db;
+            nearest[k] = d < nearest[k] ? d : nearest[k];
+        }
+    }
+    
+    // Any squared distance below the bound truncates to the same distance as the nearest.
+    for (int k = 0; k < PALETTE_CHUNK; ++k) {
+        int distance = (int)sqrt((double)nearest[k]);
+        bound[k] = distance < 256 ? (distance + 1) * (distance + 1) : 0;
+    }
+    
+    for (int n = paletteSize - 1; n >= 0; --n) {
+        for (int k = 0; k < PALETTE_CHUNK; ++k) {
+            int dr = r[k] - pr[n], dg = g[k] - pg[n], db = b[k] - pb[n];
+            int d = dr * dr + dg * dg + db * db;
+            index[k] = d < bound[k] ? n : index[k];
+        }
+    }
+}
+
+static KERNEL_INLINE int splitPalette(const uint32_t* palt, int paletteSize, int* pr, int* pg, int* pb) {
+    if (paletteSize > 256) paletteSize = 256;
+    for (int n = 0; n < paletteSize; ++n) {
+        pr[n] = palt[n] >> 16 & 0xFF;
+        pg[n] = palt[n] >> 8 & 0xFF;
+        pb[n] = palt[n] & 0xFF;
+    }
+    return paletteSize;
+}
+
+static KERNEL_INLINE void mapPixelsToNearestPalette(uint32_t* pixels, long length, const uint32_t* palt, int paletteSize, int transparencyIndex) {
+    int pr[256], pg[256], pb[256], index[PALETTE_CHUNK];
+    
+    paletteSize = splitPalette(palt, paletteSize, pr, pg, pb);
+    
+    for (long i = 0; i < length; i += PALETTE_CHUNK) {
+        long count = length - i < PALETTE_CHUNK ? length - i : PALETTE_CHUNK;
+        
+        nearestPaletteIndices(pixels + i, count, pr, pg, pb, paletteSize, index);
+        
+        for (long k = 0; k < count; ++k) {
+            uint32_t matchedColor = index[k] < paletteSize ? palt[index[k]] : pixels[i + k];
+            if (transparencyIndex >= 0) {
+                if (matchedColor == palt[transparencyIndex]) matchedColor = 0;
+            }
+            pixels[i + k] = matchedColor;
+        }
+    }
+}
+
+// Returns false if any pixel had no palette entry close enough to be matched.
+static KERNEL_INLINE bool mapPixelsToNearestPaletteIndex(const uint32_t* pixels, uint8_t* indices, long length, const uint32_t* palt, int paletteSize) {
+    int pr[256], pg[256], pb[256], index[PALETTE_CHUNK];
+    int unmatched = 0;
+    
+    paletteSize = splitPalette(palt, paletteSize, pr, pg, pb);
+    
+    for (long i = 0; i < length; i += PALETTE_CHUNK) {
+        long count = length - i < PALETTE_CHUNK ? length - i : PALETTE_CHUNK;
+        
+        nearestPaletteIndices(pixels + i, count, pr, pg, pb, paletteSize, index);
+        
+        for (long k = 0; k < count; ++k) {
+            unmatched |= index[k] >= paletteSize;
+            indices[i + k] = (uint8_t)index[k];
+        }
+    }
+    
+    return !unmatched;
+}
+
+static KERNEL_INLINE uint32_t isOutlined(uint32_t color) {
+    return color != 0 && color != OUTLINE_COLOR;
+}
+
+/*
+ Transparent pixels bordering any opaque pixel, other than one that is itself
+ an outline, become the outline color. The original rows are kept in padded
+ buffers so each row is a simple stencil over its neighbours.
+ 
+ Only the rows [top, bottom) are outlined, previous being the row above top as
+ it was before its own band was outlined.
+ */
+static KERNEL_INLINE void outlinePixels(uint32_t* pixels, int w, int h, int top, int bottom, const uint32_t* previous) {
+    std::vector<uint32_t> buffer((w + 2) * 3, 0);
+    uint32_t* above = buffer.data();
+    uint32_t* current = above + w + 2;
+    uint32_t* below = current + w + 2;
+    
+    if (top > 0) memcpy(current + 1, previous, w * sizeof(uint32_t));
+    if (top < bottom) memcpy(below + 1, pixels + (size_t)top * w, w * sizeof(uint32_t));
+    
+    for (int y = top; y < bottom; ++y) {
+        uint32_t* swap = above;
+        above = current;
+        current = below;
+        below = swap;
+        
+        if (y + 1 < h) {
+            memcpy(below + 1, pixels + (size_t)(y + 1) * w, w * sizeof(uint32_t));
+        } else {
+            memset(below, 0, (w + 2) * sizeof(uint32_t));
+        }
+        
+        uint32_t* row = pixels + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            uint32_t edge = isOutlined(current[x]) | isOutlined(current[x + 2]) | isOutlined(above[x + 1]) | isOutlined(below[x + 1]);
+            row[x] = current[x + 1] == 0 && edge ? OUTLINE_COLOR : current[x + 1];
+        }
+    }
+}
+
+/*
+ The indexed version of the outline, classes holds for each palette entry
+ whether it is transparent (bit 0) and whether it is outlined (bit 1).
+ */
+static KERNEL_INLINE void outlineIndexedPixels(uint8_t* pixels, int w, int h, int top, int bottom, const uint8_t* previous, const uint8_t* classes, uint8_t outlineIndex) {
+    std::vector<uint8_t> buffer((w + 2) * 3, 0);
+    uint8_t* above = buffer.data();
+    uint8_t* current = above + w + 2;
+    uint8_t* below = current + w + 2;
+    
+    // The padding needs to be an entry that is never outlined.
+    uint8_t padding = 0;
+    for (int n = 0; n < 256; ++n) {
+        if ((classes[n] & 2) == 0) {
+            padding = n;
+            break;
+        }
+    }
+    memset(buffer.data(), padding, buffer.size());
+    
+    if (top > 0) memcpy(current + 1, previous, w);
+    if (top < bottom) memcpy(below + 1, pixels + (size_t)top * w, w);
+    
+    for (int y = top; y < bottom; ++y) {
+        uint8_t* swap = above;
+        above = current;
+        current = below;
+        below = swap;
+        
+        if (y + 1 < h) {
+            memcpy(below + 1, pixels + (size_t)(y + 1) * w, w);
+        } else {
+            memset(below, padding, w + 2);
+        }
+        
+        uint8_t* row = pixels + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            uint8_t edge = (classes[current[x]] | classes[current[x + 2]] | classes[above[x + 1]] | classes[below[x + 1]]) & 2;
+            row[x] = (classes[current[x + 1]] & 1) && edge ? outlineIndex : current[x + 1];
+        }
+    }
+}
+
+static KERNEL_INLINE void expandIndexedPixelsToRGBA(const uint8_t* src, uint32_t* dest, long length, const uint32_t* palette) {
+    for (long i = 0; i < length; ++i) {
+        dest[i] = palette[src[i]];
+    }
+}
+
+static KERNEL_INLINE void expandPixelsRGBToRGBA(const uint8_t* src, uint32_t* dest, long length) {
+    for (long i = 0; i < length; ++i) {
+        dest[i] = 0xFF000000 | (uint32_t)src[i * 3 + 2] << 16 | (uint32_t)src[i * 3 + 1] << 8 | src[i * 3];
+    }
+}
+
+/*
+ Each source row is replicated horizontally into the first of its scaled rows,
+ which is then copied for the remaining rows. With the scale known at compile
+ time the inner loop is fully unrolled into a run of stores, a scale of 0
+ uses the scale given at runtime.
+ */
+template <int S, typename T> static KERNEL_INLINE void scalePixels(const T* src, T* dest, int w, int h, int scale) {
+    const int s = S ? S : scale;
+    const size_t stride = (size_t)w * s;
+    
+    for (int y = 0; y < h; y++) {
+        T* row = dest + (size_t)y * s * stride;
+        for (int x = 0; x < w; x++) {
+            T color = src[x + (size_t)y * w];
+            for (int sx = 0; sx < s; sx++) {
+                row[x * s + sx] = color;
+            }
+        }
+        for (int sy = 1; sy < s; sy++) {
+            memcpy(row + sy * stride, row, stride * sizeof(T));
+        }
+    }
+}
+
+static KERNEL_INLINE uint32_t getPixel(const unsigned x, const unsigned y, const unsigned w, const unsigned h, const uint32_t *pixels) {
+    if (x >= w || y >= h) return 0;
+    return pixels[x + y * w];
+}
+
+// Averages a sample point that may overlap the edge of the image, anything outside counts as transparent.
+static KERNEL_INLINE uint32_t averageColorClipped(unsigned size, unsigned x, unsigned y, const unsigned w, const unsigned h, const uint32_t *pixels) {
+    uint32_t r, g, b, a;
+    
+    r = g = b = a = 0;
+    
+    x -= size / 2;
+    y -= size / 2;
+    
+    for (unsigned i = 0; i < size; ++i) {
+        for (unsigned j = 0; j < size; ++j) {
+            uint32_t color = getPixel(x + j, y + i, w, h, pixels);
+            r += color & 0xFF;
+            g += color >> 8 & 0xFF;
+            b += color >> 16 & 0xFF;
+            a += color >> 24;
+        }
+    }
+    
+    unsigned average = size * size;
+    return r / average | g / average << 8 | b / average << 16 | a / average << 24;
+}
+
+/*
+ Samples a row of blocks, specialized for a fixed sample size so the loops are
+ fully unrolled and the average becomes a multiply, a size of 0 uses the size
+ given at runtime. Sample points overlapping the edge of the image use the
+ bounds checked version.
+ */
+template <unsigned N> static KERNEL_INLINE void sampleBlocks(const uint32_t* pixels, unsigned w, unsigned h, const unsigned* columns, unsigned count, unsigned y, unsigned size, uint32_t* dest) {
+    const unsigned n = N ? N : (size < 1 ? 1 : size);
+    
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned x = columns[i];
+        
+        if (x < n / 2 || y < n / 2 || x + n / 2 >= w || y + n / 2 >= h) {
+            dest[i] = averageColorClipped(n, x, y, w, h, pixels);
+            continue;
+        }
+        
+        const uint32_t* p = pixels + (x - n / 2) + (size_t)(y - n / 2) * w;
+        uint32_t r, g, b, a;
+        
+        r = g = b = a = 0;
+        
+        for (unsigned k = 0; k < n; ++k) {
+            for (unsigned j = 0; j < n; ++j) {
+                uint32_t color = p[j + k * w];
+                r += color & 0xFF;
+                g += color >> 8 & 0xFF;
+                b += color >> 16 & 0xFF;
+                a += color >> 24;
+            }
+        }
+        
+        dest[i] = r / (n * n) | g / (n * n) << 8 | b / (n * n) << 16 | a / (n * n) << 24;
+    }
+}
+
+/*
+ Scale2x (also known as EPX) and Scale3x only ever copy a neighbouring pixel,
+ so they work on palette indices as well as colors. Edges repeat the nearest
+ row or column. Each output row is written with a branch free select over the
+ three source rows so the inner loop vectorizes.
+ */
+template <typename T> static KERNEL_INLINE void scale2xRows(const T* src, T* dest, int w, int h, int top, int bottom) {
+    const size_t stride = (size_t)w * 2;
+    
+    for (int y = top; y < bottom; ++y) {
+        const T* above = src + (size_t)(y > 0 ? y - 1 : y) * w;
+        const T* current = src + (size_t)y * w;
+        const T* below = src + (size_t)(y + 1 < h ? y + 1 : y) * w;
+        T* row0 = dest + (size_t)y * 2 * stride;
+        T* row1 = row0 + stride;
+        
+        for (int x = 0; x < w; ++x) {
+            T b = above[x], e = current[x], h = below[x];
+            T d = current[x > 0 ? x - 1 : x];
+            T f = current[x + 1 < w ? x + 1 : x];
+            bool changed = b != h && d != f;
+            
+            row0[x * 2] = changed && d == b ? d : e;
+            row0[x * 2 + 1] = changed && b == f ? f : e;
+            row1[x * 2] = changed && d == h ? d : e;
+            row1[x * 2 + 1] = changed && h == f ? f : e;
+        }
+    }
+}
+
+template <typename T> static KERNEL_INLINE void scale3xRows(const T* src, T* dest, int w, int h, int top, int bottom) {
+    const size_t stride = (size_t)w * 3;
+    
+    for (int y = top; y < bottom; ++y) {
+        const T* above = src + (size_t)(y > 0 ? y - 1 : y) * w;
+        const T* current = src + (size_t)y * w;
+        const T* below = src + (size_t)(y + 1 < h ? y + 1 : y) * w;
+        T* row0 = dest + (size_t)y * 3 * stride;
+        T* row1 = row0 + stride;
+        T* row2 = row1 + stride;
+        
+        for (int x = 0; x < w; ++x) {
+            int left = x > 0 ? x - 1 : x, right = x + 1 < w ? x + 1 : x;
+            T a = above[left], b = above[x], c = above[right];
+            T d = current[left], e = current[x], f = current[right];
+            T g = below[left], h = below[x], i = below[right];
+            bool changed = b != h && d != f;
+            bool db = changed && d == b, bf = changed && b == f;
+            bool dh = changed && d == h, hf = changed && h == f;
+            
+            row0[x * 3] = db ? d : e;
+            row0[x * 3 + 1] = (db && e != c) || (bf && e != a) ? b : e;
+            row0[x * 3 + 2] = bf ? f : e;
+            row1[x * 3] = (db && e != g) || (dh && e != a) ? d : e;
+            row1[x * 3 + 1] = e;
+            row1[x * 3 + 2] = (bf && e != i) || (hf && e != c) ? f : e;
+            row2[x * 3] = dh ? d : e;
+            row2[x * 3 + 1] = (dh && e != i) || (hf && e != g) ? h : e;
+            row2[x * 3 + 2] = hf ? f : e;
+        }
+    }
+}
+
+// A single gather, the alpha of each pixel is ignored when looking up its color.
+static KERNEL_INLINE void applyColorTable(uint32_t* pixels, long length, const uint32_t* table) {
+    for (long i = 0; i < length; ++i) {
+        pixels[i] = table[pixels[i] & 0xFFFFFF];
+    }
+}
+
+//MARK: - Kernel Table/s
+
+#define DEFINE_KERNEL_TABLE(NAME, TARGET) \
+    TARGET static void NAME##Postorize(uint32_t* pixels, long length, unsigned levels) { \
+        postorizePixels(pixels, length, levels); \
+    } \
+    TARGET static void NAME##MapColors(uint32_t* pixels, long length, const uint32_t* palt, int paletteSize, int transparencyIndex) { \
+        mapPixelsToNearestPalette(pixels, length, palt, paletteSize, transparencyIndex); \
+    } \
+    TARGET static void NAME##Outline(uint32_t* pixels, int w, int h, int top, int bottom, const uint32_t* previous) { \
+        outlinePixels(pixels, w, h, top, bottom, previous); \
+    } \
+    TARGET static void NAME##Expand(const uint8_t* src, uint32_t* dest, long length) { \
+        expandPixelsRGBToRGBA(src, dest, length); \
+    } \
+    TARGET static bool NAME##MapIndices(const uint32_t* pixels, uint8_t* indices, long length, const uint32_t* palt, int paletteSize) { \
+        return mapPixelsToNearestPaletteIndex(pixels, indices, length, palt, paletteSize); \
+    } \
+    TARGET static void NAME##OutlineIndexed(uint8_t* pixels, int w, int h, int top, int bottom, const uint8_t* previous, const uint8_t* classes, uint8_t outlineIndex) { \
+        outlineIndexedPixels(pixels, w, h, top, bottom, previous, classes, outlineIndex); \
+    } \
+    TARGET static void NAME##ExpandIndexed(const uint8_t* src, uint32_t* dest, long length, const uint32_t* palette) { \
+        expandIndexedPixelsToRGBA(src, dest, length, palette); \
+    } \
+    TARGET static void NAME##ApplyLUT(uint32_t* pixels, long length, const uint32_t* table) { \
+        applyColorTable(pixels, length, table); \
+    } \
+    template <int S> TARGET static void NAME##Scale(const uint32_t* src, uint32_t* dest, int w, int h, int scale) { \
+        scalePixels<S>(src, dest, w, h, scale); \
+    } \
+    template <int S> TARGET static void NAME##ScaleIndexed(const uint8_t* src, uint8_t* dest, int w, int h, int scale) { \
+        scalePixels<S>(src, dest, w, h, scale); \
+    } \
+    template <typename T> TARGET static void NAME##Scale2x(const T* src, T* dest, int w, int h, int top, int bottom) { \
+        scale2xRows(src, dest, w, h, top, bottom); \
+    } \
+    template <typename T> TARGET static void NAME##Scale3x(const T* src, T* dest, int w, int h, int top, int bottom) { \
+        scale3xRows(src, dest, w, h, top, bottom); \
+    } \
+    template <unsigned N> TARGET static void NAME##Sample(const uint32_t* pixels, unsigned w, unsigned h, const unsigned* columns, unsigned count, unsigned y, unsigned size, uint32_t* dest) { \
+        sampleBlocks<N>(pixels, w, h, columns, count, y, size, dest); \
+    } \
+    static const KernelTable NAME##Kernels = { \
+        #NAME, \
+        NAME##Postorize, \
+        NAME##MapColors, \
+        NAME##Outline, \
+        NAME##Expand, \
+        NAME##MapIndices, \
+        NAME##OutlineIndexed, \
+        NAME##ExpandIndexed, \
+        NAME##ApplyLUT, \
+        { NAME##Scale<0>, NAME##Scale<1>, NAME##Scale<2>, NAME##Scale<3>, NAME##Scale<4>, NAME##Scale<0>, NAME##Scale<6>, NAME##Scale<0>, NAME##Scale<8> }, \
+        { NAME##ScaleIndexed<0>, NAME##ScaleIndexed<1>, NAME##ScaleIndexed<2>, NAME##ScaleIndexed<3>, NAME##ScaleIndexed<4>, NAME##ScaleIndexed<0>, NAME##ScaleIndexed<6>, NAME##ScaleIndexed<0>, NAME##ScaleIndexed<8> }, \
+        { NAME##Sample<0>, NAME##Sample<1>, NAME##Sample<0>, NAME##Sample<3>, NAME##Sample<0>, NAME##Sample<5> }, \
+        { NAME##Scale2x<uint32_t>, NAME##Scale3x<uint32_t> }, \
+        { NAME##Scale2x<uint8_t>, NAME##Scale3x<uint8_t> } \
+    };
+
+DEFINE_KERNEL_TABLE(generic, )
+
+#ifdef X86_KERNELS
+DEFINE_KERNEL_TABLE(sse2, __attribute__((target("sse2"))))
+DEFINE_KERNEL_TABLE(avx2, __attribute__((target("avx2"))))
+DEFINE_KERNEL_TABLE(avx512, __attribute__((target("avx512f,avx512bw,avx512vl"))))
+#endif
+
+static const KernelTable* kernelTable(CPULevel level) {
+    switch (level) {
+#ifdef X86_KERNELS
+        case CPULevel::SSE2:
+            return &sse2Kernels;
+            
+        case CPULevel::AVX2:
+            return &avx2Kernels;
+            
+        case CPULevel::AVX512:
+            return &avx512Kernels;
+#endif
+        default:
+            return &genericKernels;
+    }
+}
+
+static const KernelTable* _kernels = kernelTable(Kernels::detectCPU());
+
+//MARK: - Method/s Implimentatin
+
+bool Kernels::isSupported(CPULevel level) {
+    switch (level) {
+        case CPULevel::Generic:
+            return true;
+            
+#ifdef X86_KERNELS
+        case CPULevel::SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+            
+        case CPULevel::AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+            
+        case CPULevel::AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+#endif
+        default:
+            return false;
+    }
+}
+
+CPULevel Kernels::detectCPU(void) {
+    if (isSupported(CPULevel::AVX512)) return CPULevel::AVX512;
+    if (isSupported(CPULevel::AVX2)) return CPULevel::AVX2;
+    if (isSupported(CPULevel::SSE2)) return CPULevel::SSE2;
+    return CPULevel::Generic;
+}
+
+bool Kernels::select(CPULevel level) {
+    if (!isSupported(level)) return false;
+    _kernels = kernelTable(level);
+    return true;
+}
+
+const KernelTable& Kernels::active(void) {
+    return *_kernels;
+}
+
+ScaleKernel Kernels::scaleKernel(int scale) {
+    if (scale > 0 && scale < (int)(sizeof(_kernels->scale) / sizeof(_kernels->scale[0]))) {
+        return _kernels->scale[scale];
+    }
+    return _kernels->scale[0];
+}
+
+IndexedScaleKernel Kernels::indexedScaleKernel(int scale) {
+    if (scale > 0 && scale < (int)(sizeof(_kernels->scaleIndexed) / sizeof(_kernels->scaleIndexed[0]))) {
+        return _kernels->scaleIndexed[scale];
+    }
+    return _kernels->scaleIndexed[0];
+}
+
+SampleKernel Kernels::sampleKernel(unsigned size) {
+    if (size < sizeof(_kernels->sample) / sizeof(_kernels->sample[0])) {
+        return _kernels->sample[size];
+    }
+    return _kernels->sample[0];
+}
+
+bool Kernels::parseCPULevel(const std::string& name, CPULevel& level) {
+    if (name == "generic") level = CPULevel::Generic;
+    else if (name == "sse2") level = CPULevel::SSE2;
+    else if (name == "avx2") level = CPULevel::AVX2;
+    else if (name == "avx512") level = CPULevel::AVX512;
+    else return false;
+    return true;
+}
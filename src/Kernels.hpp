@@ -0,0 +1,89 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+// Written for Little Endian!
+
+#ifndef Kernels_hpp
+#define Kernels_hpp
+
+#include <stdint.h>
+#include <string>
+
+enum class CPULevel {
+    Generic,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+typedef void (*ScaleKernel)(const uint32_t* src, uint32_t* dest, int w, int h, int scale);
+typedef void (*IndexedScaleKernel)(const uint8_t* src, uint8_t* dest, int w, int h, int scale);
+typedef void (*PixelArtKernel)(const uint32_t* src, uint32_t* dest, int w, int h, int top, int bottom);
+typedef void (*IndexedPixelArtKernel)(const uint8_t* src, uint8_t* dest, int w, int h, int top, int bottom);
+typedef void (*SampleKernel)(const uint32_t* pixels, unsigned w, unsigned h, const unsigned* columns, unsigned count, unsigned y, unsigned size, uint32_t* dest);
+
+typedef struct {
+    const char* name;
+    void (*postorize)(uint32_t* pixels, long length, unsigned levels);
+    void (*mapColorsToNearestPalette)(uint32_t* pixels, long length, const uint32_t* palt, int paletteSize, int transparencyIndex);
+    void (*applyOutline)(uint32_t* pixels, int w, int h, int top, int bottom, const uint32_t* previous);    // Over the rows [top, bottom)
+    void (*expandRGBToRGBA)(const uint8_t* src, uint32_t* dest, long length);
+    bool (*mapColorsToNearestPaletteIndex)(const uint32_t* pixels, uint8_t* indices, long length, const uint32_t* palt, int paletteSize);
+    void (*applyOutlineIndexed)(uint8_t* pixels, int w, int h, int top, int bottom, const uint8_t* previous, const uint8_t* classes, uint8_t outlineIndex);
+    void (*expandIndexedToRGBA)(const uint8_t* src, uint32_t* dest, long length, const uint32_t* palette);
+    void (*applyColorLUT)(uint32_t* pixels, long length, const uint32_t* table);
+    ScaleKernel scale[9];       // Indexed by the scale factor, entry 0 handles any scale
+    IndexedScaleKernel scaleIndexed[9];
+    SampleKernel sample[6];     // Indexed by the sample point size, entry 0 handles any size
+    PixelArtKernel pixelArt[2];                 // Scale2x and Scale3x over the source rows [top, bottom)
+    IndexedPixelArtKernel pixelArtIndexed[2];
+} KernelTable;
+
+/*
+ The pixel kernels are compiled once for each instruction set and the set
+ matching the CPU is bound at startup, so a single binary runs on any host
+ while still using the widest vectors available.
+ */
+class Kernels {
+public:
+    static CPULevel detectCPU(void);
+    static bool isSupported(CPULevel level);
+    
+    /**
+     @brief    Binds the kernels compiled for the given instruction set.
+     @param    level The instruction set to use.
+     @return   A false if the instruction set is not supported by this CPU.
+     */
+    static bool select(CPULevel level);
+    
+    static const KernelTable& active(void);
+    static ScaleKernel scaleKernel(int scale);
+    static IndexedScaleKernel indexedScaleKernel(int scale);
+    static SampleKernel sampleKernel(unsigned size);
+    
+    static bool parseCPULevel(const std::string& name, CPULevel& level);
+};
+
+#endif /* Kernels_hpp */
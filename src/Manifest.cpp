@@ -0,0 +1,323 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "Manifest.hpp"
+#include "Report.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//MARK: - JSON Reading
+
+/*
+ Only the manifest's own lines are read back, so only what they hold is
+ understood: strings, numbers, booleans, arrays of strings and objects, the
+ last being skipped.
+ */
+static void skipSpace(const std::string& line, size_t& pos) {
+    while (pos < line.size() && isspace((unsigned char)line[pos])) pos++;
+}
+
+static bool readString(const std::string& line, size_t& pos, std::string& value) {
+    skipSpace(line, pos);
+    if (pos >= line.size() || line[pos] != '"') return false;
+    
+    value.clear();
+    for (pos++; pos < line.size(); pos++) {
+        char c = line[pos];
+        if (c == '"') {
+            pos++;
+            return true;
+        }
+        if (c != '\\') {
+            value += c;
+            continue;
+        }
+        if (++pos >= line.size()) return false;
+        switch (line[pos]) {
+            case 'n':
+                value += '\n';
+                break;
+                
+            case 't':
+                value += '\t';
+                break;
+                
+            case 'u':
+                if (pos + 4 >= line.size()) return false;
+                value += (char)std::stoi(line.substr(pos + 1, 4), nullptr, 16);
+                pos += 4;
+                break;
+                
+            default:
+                value += line[pos];
+                break;
+        }
+    }
+    return false;
+}
+
+// Reads a number or boolean as its text, or skips an object or array.
+static bool readValue(const std::string& line, size_t& pos, std::string& value) {
+    skipSpace(line, pos);
+    if (pos >= line.size()) return false;
+    if (line[pos] == '"') return readString(line, pos, value);
+    
+    if (line[pos] == '{' || line[pos] == '[') {
+        std::string skipped;
+        for (int depth = 0; pos < line.size();) {
+            if (line[pos] == '"') {
+                if (!readString(line, pos, skipped)) return false;
+                continue;
+            }
+            if (line[pos] == '{' || line[pos] == '[') depth++;
+            if ((line[pos] == '}' || line[pos] == ']') && --depth == 0) {
+                pos++;
+                return true;
+            }
+            pos++;
+        }
+        return false;
+    }
+    
+    size_t start = pos;
+    while (pos < line.size() && line[pos] != ',' && line[pos] != '}' && line[pos] != ']') pos++;
+    value = line.substr(start, pos - start);
+    return !value.empty();
+}
+
+static bool readStrings(const std::string& line, size_t& pos, std::vector<std::string>& values) {
+    skipSpace(line, pos);
+    if (pos >= line.size() || line[pos++] != '[') return false;
+    
+    values.clear();
+    for (skipSpace(line, pos); pos < line.size() && line[pos] != ']';) {
+        std::string value;
+        if (!readString(line, pos, value)) return false;
+        values.push_back(value);
+        skipSpace(line, pos);
+        if (pos < line.size() && line[pos] == ',') pos++;
+    }
+    return pos++ < line.size();
+}
+
+static bool readTimings(const std::string& line, size_t& pos, std::vector<rePiX::StageTiming>& timings) {
+    skipSpace(line, pos);
+    if (pos >= line.size() || line[pos++] != '{') return false;
+    
+    timings.clear();
+    for (skipSpace(line, pos); pos < line.size() && line[pos] != '}';) {
+        std::string stage, value;
+        if (!readString(line, pos, stage)) return false;
+        skipSpace(line, pos);
+        if (pos >= line.size() || line[pos++] != ':' || !readValue(line, pos, value)) return false;
+        if (stage != "total") timings.push_back({stage, std::stod(value)});
+        skipSpace(line, pos);
+        if (pos < line.size() && line[pos] == ',') pos++;
+    }
+    return pos++ < line.size();
+}
+
+bool Manifest::parse(const std::string& line, Entry& entry) {
+    size_t pos = 0;
+    skipSpace(line, pos);
+    if (pos >= line.size() || line[pos++] != '{') return false;
+    
+    // A report line has no status, being only written for an image restored.
+    entry = {};
+    entry.done = true;
+    bool complete = false;
+    for (;;) {
+        std::string key, value;
+        if (!readString(line, pos, key)) return false;
+        skipSpace(line, pos);
+        if (pos >= line.size() || line[pos++] != ':') return false;
+        
+        // The outputs of a report are objects rather than filenames, so are skipped like any other value.
+        size_t start = pos;
+        bool parsed = (key == "outputs" && readStrings(line, pos, entry.outputs)) || (key == "timings" && readTimings(line, pos, entry.timings));
+        if (!parsed) {
+            pos = start;
+            if (key == "outputs") entry.outputs.clear();
+            if (key == "timings") entry.timings.clear();
+            if (!readValue(line, pos, value)) return false;
+            
+            // Each output object of a report with several scales names its file.
+            for (size_t found = line.find("{\"output\":", start); key == "outputs" && found < pos; found = line.find("{\"output\":", found)) {
+                found += 10;
+                std::string output;
+                if (readString(line, found, output)) entry.outputs.push_back(output);
+            }
+            if (key == "input") entry.input = value;
+            else if (key == "output") entry.outputs.push_back(value);
+            else if (key == "size") entry.size = std::stoull(value);
+            else if (key == "modified") entry.modified = std::stoll(value);
+            else if (key == "options") entry.options = value;
+            else if (key == "status") entry.done = value == "done";
+            else if (key == "error") entry.error = value;
+        }
+        
+        skipSpace(line, pos);
+        if (pos < line.size() && line[pos] == ',') {
+            pos++;
+            continue;
+        }
+        complete = pos < line.size() && line[pos] == '}';
+        break;
+    }
+    return complete && !entry.input.empty();
+}
+
+//MARK: - Manifest
+
+std::string Manifest::toJSON(const Entry& entry) {
+    std::ostringstream os;
+    
+    os << "{\"input\":" << Report::escape(entry.input) << ",\"size\":" << entry.size << ",\"modified\":" << entry.modified;
+    os << ",\"options\":" << Report::escape(entry.options) << ",\"outputs\":[";
+    for (size_t n = 0; n < entry.outputs.size(); ++n) {
+        os << (n ? "," : "") << Report::escape(entry.outputs[n]);
+    }
+    os << "],\"status\":\"" << (entry.done ? "done" : "failed") << "\"";
+    if (!entry.error.empty()) os << ",\"error\":" << Report::escape(entry.error);
+    
+    double total = 0;
+    os << ",\"timings\":{";
+    for (const rePiX::StageTiming& timing : entry.timings) {
+        os << Report::escape(timing.stage) << ":" << timing.milliseconds << ",";
+        total += timing.milliseconds;
+    }
+    os << "\"total\":" << total << "}}";
+    
+    return os.str();
+}
+
+Manifest::~Manifest() {
+    if (_fd >= 0) close(_fd);
+}
+
+bool Manifest::open(const std::string& filename, bool resume) {
+    _filename = filename;
+    _entries.clear();
+    
+    if (resume) {
+        std::vector<Entry> entries = read(filename);
+        
+        // Compacted to the latest line of each input, through a temporary file renamed over the manifest.
+        std::string temporary = filename + ".tmp";
+        std::ofstream outfile(temporary, std::ios::out | std::ios::trunc);
+        if (!outfile.is_open()) return false;
+        for (const Entry& entry : entries) {
+            _entries[entry.input] = entry;
+            outfile << toJSON(entry) << "\n";
+        }
+        outfile.close();
+        if (outfile.fail() || rename(temporary.c_str(), filename.c_str()) != 0) return false;
+    }
+    
+    _fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0666);
+    return _fd >= 0;
+}
+
+bool Manifest::isFinished(const std::string& input, const std::string& options) const {
+    auto it = _entries.find(input);
+    if (it == _entries.end() || !it->second.done || it->second.options != options) return false;
+    
+    uint64_t size;
+    int64_t modified;
+    if (!fingerprint(input, size, modified) || size != it->second.size || modified != it->second.modified) return false;
+    
+    for (const std::string& output : it->second.outputs) {
+        struct stat status;
+        if (stat(output.c_str(), &status) != 0) return false;
+    }
+    return true;
+}
+
+bool Manifest::record(const Entry& entry) {
+    std::string line = toJSON(entry) + "\n";
+    
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries[entry.input] = entry;
+    return _fd >= 0 && ::write(_fd, line.data(), line.size()) == (ssize_t)line.size();
+}
+
+bool Manifest::fingerprint(const std::string& filename, uint64_t& size, int64_t& modified) {
+    struct stat status;
+    if (stat(filename.c_str(), &status) != 0) return false;
+    
+    size = status.st_size;
+#ifdef __APPLE__
+    modified = (int64_t)status.st_mtimespec.tv_sec * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+    modified = (int64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+uint64_t Manifest::fnv1a(const std::string& text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string Manifest::hash(const std::string& text) {
+    std::ostringstream os;
+    os << std::hex << std::setw(16) << std::setfill('0') << fnv1a(text);
+    return os.str();
+}
+
+std::vector<Manifest::Entry> Manifest::read(const std::string& filename) {
+    std::unordered_map<std::string, size_t> latest;
+    std::vector<Entry> entries;
+    
+    std::ifstream infile(filename);
+    std::string line;
+    while (std::getline(infile, line)) {
+        Entry entry;
+        try {
+            if (!parse(line, entry)) continue;
+        } catch (const std::exception& e) {
+            continue;
+        }
+        auto it = latest.find(entry.input);
+        if (it != latest.end()) {
+            entries[it->second] = entry;
+            continue;
+        }
+        latest[entry.input] = entries.size();
+        entries.push_back(entry);
+    }
+    return entries;
+}
@@ -0,0 +1,94 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef Manifest_hpp
+#define Manifest_hpp
+
+#include "rePiX.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <stdint.h>
+
+/*
+ Records each image of a batch as it completes, one JSON line per image, so
+ that an interrupted batch can be resumed. Every line is appended with a
+ single write, so a run that dies leaves at most a partial last line, which
+ is ignored when read back. Resuming rewrites the manifest with only the
+ latest line for each input, replacing it atomically.
+ */
+class Manifest {
+public:
+    typedef struct {
+        std::string input;
+        uint64_t size;                              // The input when it was read
+        int64_t modified;                           // In nanoseconds
+        std::string options;                        // The fingerprint of the options that affect the outputs
+        std::vector<std::string> outputs;
+        bool done;
+        std::string error;
+        std::vector<rePiX::StageTiming> timings;
+    } Entry;
+    
+    ~Manifest();
+    
+    /**
+     @brief    Opens the manifest for the entries of this run.
+     @param    filename The filename of the manifest.
+     @param    resume Keep the entries of an earlier run, otherwise the manifest is started afresh.
+     @return   A true on success.
+     */
+    bool open(const std::string& filename, bool resume);
+    
+    // Whether the input was restored with the same options, is unchanged since, and its outputs are still present.
+    bool isFinished(const std::string& input, const std::string& options) const;
+    
+    bool record(const Entry& entry);
+    
+    // The size and modification time of a file, false should it not exist.
+    static bool fingerprint(const std::string& filename, uint64_t& size, int64_t& modified);
+    
+    // The latest entry for each input, from a manifest or a report, in the order first seen.
+    static std::vector<Entry> read(const std::string& filename);
+    
+    static uint64_t fnv1a(const std::string& text);
+    
+    // A 64-bit FNV-1a hash, as hexadecimal.
+    static std::string hash(const std::string& text);
+    
+private:
+    std::string _filename;
+    int _fd = -1;
+    std::unordered_map<std::string, Entry> _entries;
+    std::mutex _mutex;
+    
+    static std::string toJSON(const Entry& entry);
+    static bool parse(const std::string& line, Entry& entry);
+};
+
+#endif /* Manifest_hpp */
@@ -0,0 +1,376 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "Metrics.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#define MAX_SERIES 64
+#define SUB_BUCKETS 16
+// Up to 2^36 microseconds, about 19 hours.
+#define BUCKETS ((36 - 3) * SUB_BUCKETS)
+
+// A scraper hanging up early must not raise SIGPIPE.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+enum class Kind {
+    Counter,
+    Gauge,
+    Histogram
+};
+
+typedef struct {
+    std::string name;
+    std::string labels;
+    Kind kind;
+} Series;
+
+/*
+ A thread's counts, written only by that thread but read by whichever thread
+ exports them, hence relaxed atomics. Shards are never freed, the counts of a
+ thread that has finished still belonging in the totals.
+ */
+typedef struct {
+    std::atomic<uint64_t> counts[MAX_SERIES][BUCKETS];
+    std::atomic<uint64_t> totals[MAX_SERIES];       // A counter's value, or a histogram's sum of microseconds
+} Shard;
+
+static std::mutex registryMutex;
+static std::vector<Series> registry;
+static std::unordered_map<std::string, unsigned> registryIndices;
+static std::vector<Shard*> shards;
+static std::atomic<int64_t> gauges[MAX_SERIES];
+
+// The series of the name and labels, registered on first use, or MAX_SERIES once there are too many.
+static unsigned seriesIndex(const std::string& name, const std::string& labels, Kind kind) {
+    thread_local std::unordered_map<std::string, unsigned> indices;
+    
+    std::string key = name + "{" + labels + "}";
+    auto it = indices.find(key);
+    if (it != indices.end()) return it->second;
+    
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto registered = registryIndices.find(key);
+    unsigned index = MAX_SERIES;
+    if (registered != registryIndices.end()) {
+        index = registered->second;
+    } else if (registry.size() < MAX_SERIES) {
+        index = (unsigned)registry.size();
+        registry.push_back({name, labels, kind});
+        registryIndices[key] = index;
+    }
+    indices[key] = index;
+    return index;
+}
+
+static Shard& threadShard(void) {
+    thread_local Shard* shard = nullptr;
+    if (shard == nullptr) {
+        shard = new Shard();
+        std::lock_guard<std::mutex> lock(registryMutex);
+        shards.push_back(shard);
+    }
+    return *shard;
+}
+
+static unsigned bucketOf(uint64_t microseconds) {
+    if (microseconds < SUB_BUCKETS) return (unsigned)microseconds;
+    
+    unsigned exponent = 63 - __builtin_clzll(microseconds);
+    unsigned index = (exponent - 3) * SUB_BUCKETS + (unsigned)((microseconds >> (exponent - 4)) & (SUB_BUCKETS - 1));
+    return std::min<unsigned>(index, BUCKETS - 1);
+}
+
+// The middle of the values falling within a bucket, in microseconds.
+static double bucketValue(unsigned index) {
+    if (index < SUB_BUCKETS) return index;
+    
+    unsigned exponent = index / SUB_BUCKETS + 3;
+    double width = (double)(1ull << (exponent - 4));
+    return (SUB_BUCKETS + index % SUB_BUCKETS) * width + width / 2;
+}
+
+//MARK: - Recording
+
+void Metrics::observe(const std::string& name, const std::string& labels, double seconds) {
+    unsigned index = seriesIndex(name, labels, Kind::Histogram);
+    if (index == MAX_SERIES) return;
+    
+    uint64_t microseconds = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+    Shard& shard = threadShard();
+    shard.counts[index][bucketOf(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    shard.totals[index].fetch_add(microseconds, std::memory_order_relaxed);
+}
+
+void Metrics::add(const std::string& name, const std::string& labels, uint64_t value) {
+    unsigned index = seriesIndex(name, labels, Kind::Counter);
+    if (index == MAX_SERIES) return;
+    
+    threadShard().totals[index].fetch_add(value, std::memory_order_relaxed);
+}
+
+void Metrics::set(const std::string& name, const std::string& labels, int64_t value) {
+    unsigned index = seriesIndex(name, labels, Kind::Gauge);
+    if (index == MAX_SERIES) return;
+    
+    gauges[index].store(value, std::memory_order_relaxed);
+}
+
+//MARK: - Exporting
+
+static std::string withLabels(const std::string& labels, const std::string& extra = "") {
+    std::string all = labels + (!labels.empty() && !extra.empty() ? "," : "") + extra;
+    return all.empty() ? "" : "{" + all + "}";
+}
+
+std::string Metrics::prometheus(void) {
+    std::vector<Series> series;
+    std::vector<std::vector<uint64_t>> counts;
+    std::vector<uint64_t> totals;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        series = registry;
+        counts.assign(series.size(), std::vector<uint64_t>(BUCKETS, 0));
+        totals.assign(series.size(), 0);
+        for (const Shard* shard : shards) {
+            for (size_t n = 0; n < series.size(); ++n) {
+                totals[n] += shard->totals[n].load(std::memory_order_relaxed);
+                if (series[n].kind != Kind::Histogram) continue;
+                for (unsigned b = 0; b < BUCKETS; ++b) {
+                    counts[n][b] += shard->counts[n][b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+    
+    // Every series of a name is written together, below the one type line.
+    std::vector<size_t> order(series.size());
+    for (size_t n = 0; n < order.size(); ++n) order[n] = n;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return series[a].name < series[b].name;
+    });
+    
+    std::ostringstream os;
+    std::string name;
+    for (size_t n : order) {
+        const Series& s = series[n];
+        if (s.name != name) {
+            name = s.name;
+            os << "# TYPE " << name << " " << (s.kind == Kind::Counter ? "counter" : s.kind == Kind::Gauge ? "gauge" : "summary") << "\n";
+        }
+        
+        if (s.kind == Kind::Counter) {
+            os << s.name << withLabels(s.labels) << " " << totals[n] << "\n";
+            continue;
+        }
+        if (s.kind == Kind::Gauge) {
+            os << s.name << withLabels(s.labels) << " " << gauges[n].load(std::memory_order_relaxed) << "\n";
+            continue;
+        }
+        
+        uint64_t count = 0;
+        for (uint64_t c : counts[n]) count += c;
+        for (const char* quantile : {"0.5", "0.95", "0.99"}) {
+            uint64_t rank = (uint64_t)ceil(atof(quantile) * count);
+            uint64_t seen = 0;
+            double value = 0;
+            for (unsigned b = 0; b < BUCKETS && count; ++b) {
+                seen += counts[n][b];
+                if (seen >= rank) {
+                    value = bucketValue(b) / 1e6;
+                    break;
+                }
+            }
+            os << s.name << withLabels(s.labels, std::string("quantile=\"") + quantile + "\"") << " " << value << "\n";
+        }
+        os << s.name << "_sum" << withLabels(s.labels) << " " << totals[n] / 1e6 << "\n";
+        os << s.name << "_count" << withLabels(s.labels) << " " << count << "\n";
+    }
+    return os.str();
+}
+
+// Each write has a temporary file of its own, so writes from different threads never share one.
+bool Metrics::writeFile(const std::string& filename) {
+    std::string temporary = filename + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0) return false;
+    
+    std::string text = prometheus();
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t bytes = write(fd, text.data() + written, text.size() - written);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        written += bytes;
+    }
+    
+    // A collector reading the file may run as another user.
+    bool complete = written == text.size() && fchmod(fd, 0644) == 0;
+    if (close(fd) != 0 || !complete || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+Metrics::FileWriter::FileWriter(const std::string& filename) {
+    if (filename.empty()) return;
+    _thread = std::thread([this, filename] {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_stopped.wait_for(lock, std::chrono::seconds(1), [this] { return _stopping; })) {
+            writeFile(filename);
+        }
+    });
+}
+
+Metrics::FileWriter::~FileWriter() {
+    stop();
+}
+
+void Metrics::FileWriter::stop(void) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _stopped.notify_all();
+    if (_thread.joinable()) _thread.join();
+}
+
+/*
+ Each connection is answered with the metrics and closed, whatever it asks
+ for, which is all a scraper needs, such as curl --unix-socket.
+ */
+bool Metrics::Server::serve(const std::string& path) {
+    sockaddr_un address = {};
+    if (_thread.joinable() || path.size() >= sizeof(address.sun_path)) return false;
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+    
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) return false;
+    
+    // Only a socket left by an earlier run is replaced, never a file that happens to have the name.
+    struct stat status;
+    if (lstat(path.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            close(listener);
+            return false;
+        }
+        unlink(path.c_str());
+    }
+    if (bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 8) != 0) {
+        close(listener);
+        return false;
+    }
+    
+    // Stopping writes to the pipe, waking the thread from its wait for a connection.
+    if (pipe(_wake) != 0) {
+        close(listener);
+        unlink(path.c_str());
+        return false;
+    }
+    _listener = listener;
+    _path = path;
+    
+    _thread = std::thread([listener, wake = _wake[0]] {
+        for (;;) {
+            pollfd waiting[2] = {{listener, POLLIN, 0}, {wake, POLLIN, 0}};
+            if (poll(waiting, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (waiting[1].revents) break;
+            if (!(waiting[0].revents & POLLIN)) continue;
+            
+            int connection = accept(listener, nullptr, nullptr);
+            if (connection < 0) continue;
+            
+            // Nor can one that never sends its request hold up the others for long.
+            timeval timeout = {1, 0};
+            setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            
+            char request[1024];
+            if (read(connection, request, sizeof(request)) < 0) {
+                close(connection);
+                continue;
+            }
+            
+            std::string body = prometheus();
+            std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t bytes = send(connection, response.data() + sent, response.size() - sent, SEND_FLAGS);
+                if (bytes <= 0) break;
+                sent += bytes;
+            }
+            close(connection);
+        }
+    });
+    return true;
+}
+
+Metrics::Server::~Server() {
+    stop();
+}
+
+void Metrics::Server::stop(void) {
+    if (!_thread.joinable()) return;
+    
+    char wake = 0;
+    while (write(_wake[1], &wake, 1) < 0 && errno == EINTR) {}
+    _thread.join();
+    
+    close(_listener);
+    close(_wake[0]);
+    close(_wake[1]);
+    _listener = _wake[0] = _wake[1] = -1;
+    unlink(_path.c_str());
+}
@@ -0,0 +1,117 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef Metrics_hpp
+#define Metrics_hpp
+
+#include <string>
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ An in-process registry of counters, gauges and latency histograms, exported
+ in the Prometheus text format. Counters and histograms are recorded into a
+ shard of the recording thread, so recording takes no lock once a thread has
+ seen a series, and the shards are summed when the metrics are read.
+
+ Histograms are HDR style, each power of two of microseconds split into 16
+ buckets, so a quantile is within about 3% from a microsecond to hours. They
+ are exported as summaries of the 50th, 95th and 99th percentiles.
+
+ A series is named along with its labels, such as name "repix_stage_seconds"
+ and labels "stage=\"restore\"", and there can be at most 64 of them, any
+ more being dropped.
+ */
+class Metrics {
+public:
+    // Records a duration into a histogram.
+    static void observe(const std::string& name, const std::string& labels, double seconds);
+    
+    // Adds to a counter.
+    static void add(const std::string& name, const std::string& labels, uint64_t value = 1);
+    
+    // Sets a gauge.
+    static void set(const std::string& name, const std::string& labels, int64_t value);
+    
+    // All the series in the Prometheus text format.
+    static std::string prometheus(void);
+    
+    /**
+     @brief    Writes the metrics to a file, replacing it only once complete.
+     @param    filename The file, read by a node exporter's textfile collector, for instance.
+     @return   A true on success.
+     */
+    static bool writeFile(const std::string& filename);
+    
+    // Rewrites the metrics file every second from a thread of its own, until stopped or destroyed.
+    class FileWriter {
+    public:
+        explicit FileWriter(const std::string& filename);
+        ~FileWriter();
+        
+        FileWriter(const FileWriter&) = delete;
+        FileWriter& operator=(const FileWriter&) = delete;
+        
+        // Waits for any write under way, so the final write is never replaced by an older one.
+        void stop(void);
+        
+    private:
+        std::thread _thread;
+        std::mutex _mutex;
+        std::condition_variable _stopped;
+        bool _stopping = false;
+    };
+    
+    // Serves the metrics over HTTP on a local (Unix domain) socket from a thread of its own, until stopped or destroyed.
+    class Server {
+    public:
+        Server(void) = default;
+        ~Server();
+        
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+        
+        /**
+         @brief    Starts listening on the socket.
+         @param    path The path of the socket, replacing any socket left there.
+         @return   A true if the socket is listening.
+         */
+        bool serve(const std::string& path);
+        
+        // Joins the thread and removes the socket.
+        void stop(void);
+        
+    private:
+        std::thread _thread;
+        std::string _path;
+        int _listener = -1;
+        int _wake[2] = {-1, -1};
+    };
+};
+
+#endif /* Metrics_hpp */
@@ -0,0 +1,191 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "PaletteLUT.hpp"
+#include "Kernels.hpp"
+#include "Parallel.hpp"
+
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COLOR_COUNT (1 << 24)
+#define INDICES_SIZE COLOR_COUNT
+#define UNMATCHED_SIZE (COLOR_COUNT / 8)
+
+static_assert(sizeof(PaletteLUT::Header) == 1056, "The palette LUT header must not be padded");
+
+static const char magic[8] = {'r', 'e', 'P', 'i', 'X', 'L', 'U', 'T'};
+
+static uint32_t checksum(const void* data, size_t length) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    const Bytef* bytes = (const Bytef*)data;
+    
+    // crc32 takes a 32-bit length, so large buffers are summed in parts.
+    while (length > 0) {
+        uInt part = length > (1u << 30) ? (1u << 30) : (uInt)length;
+        crc = crc32(crc, bytes, part);
+        bytes += part;
+        length -= part;
+    }
+    return (uint32_t)crc;
+}
+
+PaletteLUT::~PaletteLUT() {
+    close();
+}
+
+bool PaletteLUT::compile(const ColorTable& colorTable, const std::string& filename) {
+    std::vector<uint8_t> data(INDICES_SIZE + UNMATCHED_SIZE, 0);
+    uint8_t* indices = data.data();
+    uint8_t* unmatched = indices + INDICES_SIZE;
+    
+    // Each band of colors sharing the highest byte is mapped on its own thread.
+    Parallel::forRows(256, 1, [&](int top, int bottom) {
+        const int Run = 256;
+        uint32_t pixels[Run];
+        
+        for (uint32_t first = (uint32_t)top << 16; first < (uint32_t)bottom << 16; first += Run) {
+            for (int n = 0; n < Run; ++n) {
+                pixels[n] = 0xFF000000 | (first + n);
+            }
+            if (Kernels::active().mapColorsToNearestPaletteIndex(pixels, indices + first, Run, colorTable.colors.data(), colorTable.defined)) continue;
+            
+            // Some colors in this run are unmatched, find which.
+            for (int n = 0; n < Run; ++n) {
+                if (Kernels::active().mapColorsToNearestPaletteIndex(pixels + n, indices + first + n, 1, colorTable.colors.data(), colorTable.defined)) continue;
+                indices[first + n] = 0;
+                unmatched[(first + n) >> 3] |= 1 << ((first + n) & 7);
+            }
+        }
+    });
+    
+    Header header = {};
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = PALETTE_LUT_VERSION;
+    header.headerSize = sizeof(Header);
+    header.defined = colorTable.defined;
+    header.transparency = colorTable.transparency;
+    for (int n = 0; n < colorTable.defined; ++n) {
+        header.colors[n] = colorTable.colors[n];
+    }
+    header.dataCRC = checksum(data.data(), data.size());
+    header.headerCRC = checksum(&header, offsetof(Header, headerCRC));
+    
+    // Written to a temporary file first so workers never map a partly written table.
+    std::string temporary = filename + ".tmp";
+    std::ofstream outfile;
+    outfile.open(temporary, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!outfile.is_open()) {
+        return false;
+    }
+    outfile.write((const char*)&header, sizeof(Header));
+    outfile.write((const char*)data.data(), data.size());
+    outfile.close();
+    if (!outfile) {
+        remove(temporary.c_str());
+        return false;
+    }
+    
+    return rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+bool PaletteLUT::open(const std::string& filename) {
+    close();
+    
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size != sizeof(Header) + INDICES_SIZE + UNMATCHED_SIZE) {
+        ::close(fd);
+        return false;
+    }
+    
+    void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) return false;
+    
+    _header = (const Header*)address;
+    _length = info.st_size;
+    _indices = (const uint8_t*)address + sizeof(Header);
+    _unmatched = _indices + INDICES_SIZE;
+    
+    if (memcmp(_header->magic, magic, sizeof(magic)) != 0 || _header->version != PALETTE_LUT_VERSION || _header->headerSize != sizeof(Header) ||
+        _header->defined > 256 || _header->headerCRC != checksum(_header, offsetof(Header, headerCRC))) {
+        close();
+        return false;
+    }
+    
+    return true;
+}
+
+bool PaletteLUT::verify(void) const {
+    return isOpen() && _header->dataCRC == checksum(_indices, INDICES_SIZE + UNMATCHED_SIZE);
+}
+
+void PaletteLUT::close(void) {
+    if (_header != nullptr) {
+        munmap((void*)_header, _length);
+    }
+    _header = nullptr;
+    _indices = nullptr;
+    _unmatched = nullptr;
+    _length = 0;
+}
+
+void PaletteLUT::getColorTable(ColorTable& colorTable) const {
+    if (!isOpen()) return;
+    colorTable.setColors(_header->colors, _header->defined, _header->transparency);
+}
+
+bool PaletteLUT::mapColorsToIndices(const uint32_t* pixels, uint8_t* indices, long length) const {
+    uint8_t unmatched = 0;
+    
+    for (long i = 0; i < length; ++i) {
+        uint32_t key = pixels[i] & 0xFFFFFF;
+        indices[i] = _indices[key];
+        unmatched |= _unmatched[key >> 3] >> (key & 7) & 1;
+    }
+    return !unmatched;
+}
+
+bool PaletteLUT::isPaletteLUTFile(const std::string& filename) {
+    std::ifstream infile;
+    char buffer[sizeof(magic)] = {};
+    
+    infile.open(filename, std::ios::in | std::ios::binary);
+    if (!infile.is_open()) {
+        return false;
+    }
+    infile.read(buffer, sizeof(buffer));
+    return memcmp(buffer, magic, sizeof(magic)) == 0;
+}
@@ -0,0 +1,108 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+// Written for Little Endian!
+
+#ifndef PaletteLUT_hpp
+#define PaletteLUT_hpp
+
+#include "ColorTable.hpp"
+
+#include <stdint.h>
+#include <string>
+
+#define PALETTE_LUT_VERSION 1
+
+/*
+ A color table compiled into the palette entry nearest to every 24-bit color,
+ saved so it is built once. The file is mapped read-only, so every process
+ using the same file shares one copy in the page cache.
+ 
+ Layout: the header, the index of every color and a bitmask of the colors
+ with no entry close enough to be matched, which keep their own color.
+ */
+class PaletteLUT {
+public:
+    // Every field is naturally aligned, so the header has no padding.
+    typedef struct {
+        char magic[8];              // "rePiXLUT"
+        uint32_t version;
+        uint32_t headerSize;
+        uint32_t defined;
+        int32_t transparency;
+        uint32_t colors[256];
+        uint32_t dataCRC;           // CRC-32 of the indices and the bitmask
+        uint32_t headerCRC;         // CRC-32 of the header up to this field
+    } Header;
+    
+    ~PaletteLUT();
+    
+    /**
+     @brief    Builds the lookup table for a color table and saves it.
+     @param    colorTable The color table.
+     @param    filename The filename of the compiled palette.
+     @return   A true on success.
+     */
+    static bool compile(const ColorTable& colorTable, const std::string& filename);
+    
+    /**
+     @brief    Maps a compiled palette, checking its version and the checksum of its header. The tables are
+               left to verify, so that opening reads only the pages that are used.
+     @param    filename The filename of the compiled palette.
+     @return   A false if the file is missing, of another version or its header is damaged.
+     */
+    bool open(const std::string& filename);
+    void close(void);
+    
+    // Checks the tables against their checksum, reading the whole file.
+    bool verify(void) const;
+    
+    bool isOpen(void) const {
+        return _header != nullptr;
+    }
+    
+    const Header& header(void) const {
+        return *_header;
+    }
+    
+    // Loads the palette the table was compiled from into a color table.
+    void getColorTable(ColorTable& colorTable) const;
+    
+    /**
+     @brief    Maps pixels to palette indices.
+     @return   A false if any pixel had no palette entry close enough to be matched.
+     */
+    bool mapColorsToIndices(const uint32_t* pixels, uint8_t* indices, long length) const;
+    
+    static bool isPaletteLUTFile(const std::string& filename);
+    
+private:
+    const Header* _header = nullptr;
+    const uint8_t* _indices = nullptr;
+    const uint8_t* _unmatched = nullptr;
+    size_t _length = 0;
+};
+
+#endif /* PaletteLUT_hpp */
@@ -0,0 +1,228 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "Parallel.hpp"
+#include "Allocations.hpp"
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// The most CPUs that an affinity can name.
+#define MAX_CPUS 1024
+
+static std::vector<unsigned> affinity;
+
+// The thread of the affinity that the calling thread is pinned as, if any.
+static thread_local int pinned = -1;
+
+#ifdef __linux__
+typedef struct {
+    unsigned cpu;
+    unsigned package;
+    unsigned core;
+    unsigned sibling;       // The rank of the thread within its core
+    unsigned coreRank;      // The rank of the core within its package
+} Placement;
+
+static unsigned readTopology(unsigned cpu, const char* name, unsigned fallback) {
+    std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+    unsigned value;
+    return file >> value ? value : fallback;
+}
+
+// The CPUs that the process may run on, ordered for compact or scatter placement.
+static std::vector<unsigned> orderCPUs(bool scatter) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return {};
+    
+    std::vector<Placement> placements;
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) placements.push_back({cpu, readTopology(cpu, "physical_package_id", 0), readTopology(cpu, "core_id", cpu), 0, 0});
+    }
+    
+    for (Placement& p : placements) {
+        std::vector<unsigned> cores;
+        for (const Placement& q : placements) {
+            if (q.package != p.package) continue;
+            if (q.core == p.core && q.cpu < p.cpu) p.sibling++;
+            if (q.core < p.core) cores.push_back(q.core);
+        }
+        std::sort(cores.begin(), cores.end());
+        p.coreRank = (unsigned)(std::unique(cores.begin(), cores.end()) - cores.begin());
+    }
+    
+    std::sort(placements.begin(), placements.end(), [scatter](const Placement& a, const Placement& b) {
+        if (scatter) {
+            if (a.sibling != b.sibling) return a.sibling < b.sibling;
+            if (a.coreRank != b.coreRank) return a.coreRank < b.coreRank;
+            if (a.package != b.package) return a.package < b.package;
+        } else {
+            if (a.package != b.package) return a.package < b.package;
+            if (a.core != b.core) return a.core < b.core;
+            if (a.sibling != b.sibling) return a.sibling < b.sibling;
+        }
+        return a.cpu < b.cpu;
+    });
+    
+    std::vector<unsigned> cpus;
+    for (const Placement& p : placements) cpus.push_back(p.cpu);
+    return cpus;
+}
+#else
+// Without the topology the CPUs are simply taken in turn.
+static std::vector<unsigned> orderCPUs(bool scatter) {
+    std::vector<unsigned> cpus;
+    for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu) cpus.push_back(cpu);
+    return cpus;
+}
+#endif
+
+unsigned Parallel::threadCount(void) {
+    if (!affinity.empty()) return (unsigned)affinity.size();
+    unsigned count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+}
+
+bool Parallel::parseAffinity(const std::string& text, std::vector<unsigned>& cpus) {
+    if (text == "compact" || text == "scatter") {
+        cpus = orderCPUs(text == "scatter");
+        return !cpus.empty();
+    }
+    
+    cpus.clear();
+    std::stringstream list(text);
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        unsigned first, last;
+        char dash;
+        std::stringstream ss(range);
+        if (!(ss >> first)) return false;
+        last = first;
+        if (ss >> dash && (dash != '-' || !(ss >> last))) return false;
+        if (!ss.eof() || last < first || last >= MAX_CPUS) return false;
+        for (unsigned cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    
+#ifdef __linux__
+    // A CPU outside those the process may run on could never be pinned to.
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return false;
+    for (unsigned cpu : cpus) {
+        if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set)) return false;
+    }
+#endif
+    return !cpus.empty();
+}
+
+void Parallel::setAffinity(const std::vector<unsigned>& cpus) {
+    affinity = cpus;
+}
+
+bool Parallel::hasAffinity(void) {
+    return !affinity.empty();
+}
+
+bool Parallel::canPinThreads(void) {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Parallel::pinThread(unsigned n) {
+    if (affinity.empty()) return false;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinity[n % affinity.size()], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) return false;
+    pinned = (int)n;
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::string Parallel::describeCPUs(unsigned n, unsigned count) {
+    if (affinity.empty()) return "any";
+    
+    std::vector<unsigned> cpus;
+    for (unsigned i = 0; i < count && i < affinity.size(); ++i) cpus.push_back(affinity[(n + i) % affinity.size()]);
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    
+    // Runs of consecutive CPUs are given as ranges.
+    std::string text;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!text.empty()) text += ",";
+        text += std::to_string(cpus[i]);
+        if (j > i) text += "-" + std::to_string(cpus[j]);
+        i = j;
+    }
+    return text;
+}
+
+void Parallel::forRows(int rows, int minimumRows, const std::function<void(int top, int bottom)>& body) {
+    if (rows <= 0) return;
+    if (minimumRows < 1) minimumRows = 1;
+    
+    int bands = (int)threadCount();
+    if (bands > rows / minimumRows) bands = rows / minimumRows;
+    if (bands <= 1) {
+        body(0, rows);
+        return;
+    }
+    
+    // Threads inherit the CPU of a pinned thread starting them, so each band is pinned after it.
+    const unsigned first = pinned < 0 ? 0 : (unsigned)pinned;
+    // Nor do they inherit its allocation stage, which is thread local.
+    const char* stage = Allocations::Stage::current();
+    std::vector<std::thread> threads;
+    threads.reserve(bands - 1);
+    for (int n = 1; n < bands; ++n) {
+        threads.emplace_back([&body, first, stage, n, top = rows * n / bands, bottom = rows * (n + 1) / bands] {
+            Allocations::Stage scope(stage);
+            pinThread(first + n);
+            body(top, bottom);
+        });
+    }
+    body(0, rows / bands);
+    
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#ifndef Parallel_hpp
+#define Parallel_hpp
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ Splits a range of rows into bands run concurrently, one band per hardware
+ thread. Small ranges run on the calling thread, since starting threads
+ would cost more than the work itself.
+ 
+ Threads can be pinned to CPUs, the nth thread of a pool to the nth CPU of
+ the affinity, wrapping around. The bands of a pinned thread are pinned to
+ the CPUs that follow its own, so that they stay close to it.
+ */
+class Parallel {
+public:
+    // The hardware threads, or the CPUs of the affinity when threads are pinned.
+    static unsigned threadCount(void);
+    
+    /**
+     @brief    Parses an affinity into the CPUs that threads are pinned to, in turn.
+     @param    text Either compact, filling the threads of a core and then the cores of a package before
+               the next, scatter, spreading across packages and then cores before sharing a core, or a list
+               of CPUs such as 0,2,4-7.
+     @param    cpus The CPUs, only those the process may run on.
+     @return   A true if the affinity is valid, a list naming a CPU the process may not run on being invalid.
+     */
+    static bool parseAffinity(const std::string& text, std::vector<unsigned>& cpus);
+    
+    // Pins the threads started from now on to the CPUs in turn, or none when empty.
+    static void setAffinity(const std::vector<unsigned>& cpus);
+    
+    // Whether an affinity has been set for the threads to be pinned to.
+    static bool hasAffinity(void);
+    
+    // Whether threads can be pinned at all, sched_setaffinity being Linux only.
+    static bool canPinThreads(void);
+    
+    // Pins the calling thread to the CPU of the nth thread, returning false when not pinned.
+    static bool pinThread(unsigned n);
+    
+    // The CPUs of count threads from the nth, such as "0-3,8".
+    static std::string describeCPUs(unsigned n, unsigned count);
+    
+    /**
+     @brief    Runs the body over the rows [0, rows), each call covering the band [top, bottom).
+     @param    rows The number of rows.
+     @param    minimumRows The fewest rows worth giving to a thread of its own.
+     @param    body The work for a band of rows.
+     */
+    static void forRows(int rows, int minimumRows, const std::function<void(int top, int bottom)>& body);
+};
+
+#endif /* Parallel_hpp */
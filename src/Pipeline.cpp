@@ -0,0 +1,304 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "Pipeline.hpp"
+#include "ImageAdjustments.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+#include <mutex>
+
+void Pipeline::plan(const rePiX& repix, const Options& options) {
+    _options = options;
+    _steps.clear();
+    _notes.clear();
+    _lut = nullptr;
+    
+    if (options.threshold > 0.0) {
+        _steps.push_back(Normalize);
+    }
+    
+    // Posterizing also makes every pixel opaque, so it can only be dropped when they already are.
+    unsigned levels = options.levels;
+    if (ColorLUT::isPostorizeIdentity(options.levels) && repix.isOpaque()) {
+        _notes.push_back("postorize(" + std::to_string(options.levels) + ") dropped, it leaves every color unchanged");
+        levels = 0;
+    }
+    const CubeLUT* cube = options.cube != nullptr && options.cube->size ? options.cube : nullptr;
+    
+    if (!options.candidates.empty()) selectColorTable(repix, sharedLUT(levels, cube, nullptr));
+    
+    // A compiled color table is already a lookup table of indices, so it stays a stage of its own.
+    bool indexed = _options.colorTable != nullptr && _options.colorTable->defined;
+    bool compiled = indexed && _options.paletteLUT != nullptr && _options.paletteLUT->isOpen();
+    _lut = sharedLUT(levels, cube, indexed && !compiled ? _options.colorTable : nullptr);
+    if (_lut != nullptr) _steps.push_back(Color);
+    if (compiled) {
+        _steps.push_back(Palette);
+    } else if (indexed) {
+        _steps.push_back(Index);
+    }
+    if (options.outline) _steps.push_back(Outline);
+    if (options.quality && repix.isOutOfCore()) {
+        _notes.push_back("quality dropped, out of core the source is never held to measure against");
+    } else if (options.quality && repix.hasRegionOfInterest()) {
+        _notes.push_back("quality dropped, only a region of the image is restored");
+    } else if (options.quality) {
+        _steps.push_back(Quality);
+    }
+    
+    if (options.scales.size() > 1) {
+        _steps.push_back(SaveScaled);
+    } else {
+        _steps.push_back(Scale);
+        _steps.push_back(Save);
+    }
+}
+
+/*
+ Taken before any image is seen, so every stage the options ask for is
+ counted, including those that plan would drop.
+ */
+unsigned Pipeline::estimateStages(const Options& options) {
+    unsigned stages = 2;
+    if (options.threshold > 0.0) stages++;
+    
+    bool indexed = options.colorTable != nullptr || !options.candidates.empty();
+    if (!ColorLUT::isPostorizeIdentity(options.levels) || (options.cube != nullptr && options.cube->size) || indexed) stages++;
+    if (indexed) stages++;
+    if (options.outline) stages++;
+    if (options.quality) stages++;
+    
+    // Scaling and saving, for each output when there are several.
+    stages += options.scales.size() > 1 ? (unsigned)options.scales.size() : 2;
+    return stages;
+}
+
+/*
+ The normalize buckets are freed before the color lookup table is first
+ filled, so only the larger of the two is held at once, on top of the images.
+ */
+size_t Pipeline::estimatePeakMemory(const rePiX& repix, unsigned sourceWidth, unsigned sourceHeight, const Options& options, bool outOfCore) {
+    size_t buckets = options.threshold > 0.0 ? ImageAdjustments::normalizeMemory() : 0;
+    return repix.estimatePeakMemory(sourceWidth, sourceHeight, options.scales, outOfCore) + buckets;
+}
+
+/*
+ Counts every table sharedLUT could be asked for by the images planned with
+ the options. Selecting among candidates applies the other stages on their own
+ first, and each candidate chosen that is not compiled is a table of its own.
+ An opaque image drops a posterize that changes nothing, a table of its own too.
+ */
+size_t Pipeline::sharedMemory(const Options& options) {
+    const CubeLUT* cube = options.cube != nullptr && options.cube->size ? options.cube : nullptr;
+    
+    std::vector<unsigned> levels = {options.levels};
+    if (ColorLUT::isPostorizeIdentity(options.levels)) levels.push_back(0);
+    
+    auto mapped = [](const ColorTable* colorTable, const PaletteLUT* paletteLUT) -> const ColorTable* {
+        bool indexed = colorTable != nullptr && colorTable->defined;
+        bool compiled = indexed && paletteLUT != nullptr && paletteLUT->isOpen();
+        return indexed && !compiled ? colorTable : nullptr;
+    };
+    std::vector<const ColorTable*> colorTables;
+    if (options.candidates.empty()) {
+        colorTables.push_back(mapped(options.colorTable, options.paletteLUT));
+    } else {
+        colorTables.push_back(nullptr);
+        for (const Candidate& candidate : options.candidates) {
+            colorTables.push_back(mapped(candidate.colorTable, candidate.paletteLUT));
+        }
+    }
+    
+    std::set<std::pair<unsigned, const ColorTable*>> tables;
+    for (unsigned level : levels) {
+        for (const ColorTable* colorTable : colorTables) {
+            if (level || cube != nullptr || colorTable != nullptr) tables.insert({level, colorTable});
+        }
+    }
+    return tables.size() * ColorLUT::tableMemory();
+}
+
+/*
+ The tables are keyed by the cube and color table objects, which outlive every
+ pipeline, and are kept once made, there being at most a few for a run.
+ */
+std::shared_ptr<ColorLUT> Pipeline::sharedLUT(unsigned levels, const CubeLUT* cube, const ColorTable* colorTable) {
+    if (levels == 0 && cube == nullptr && colorTable == nullptr) return nullptr;
+    
+    static std::mutex mutex;
+    static std::map<std::tuple<unsigned, const CubeLUT*, const ColorTable*>, std::shared_ptr<ColorLUT>> tables;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<ColorLUT>& lut = tables[{levels, cube, colorTable}];
+    if (lut == nullptr) {
+        lut = std::make_shared<ColorLUT>();
+        if (levels) lut->addPostorize(levels);
+        if (cube != nullptr) lut->addCube(*cube);
+        if (colorTable != nullptr) lut->addColorTable(*colorTable);
+    }
+    return lut;
+}
+
+/*
+ Every color table is scored on the distinct colors of the restored image,
+ after the color stages that come before mapping, weighted by how often each
+ occurs. That costs about one mapping of the distinct colors per table rather
+ than a full run per table.
+ */
+void Pipeline::selectColorTable(const rePiX& repix, const std::shared_ptr<ColorLUT>& lut) {
+    std::vector<unsigned> counts;
+    std::vector<uint32_t> colors = repix.uniqueColors(counts);
+    if (lut != nullptr) lut->apply(colors.data(), colors.size());
+    
+    std::ostringstream os;
+    double best = 0;
+    for (size_t n = 0; n < _options.candidates.size(); ++n) {
+        const Candidate& candidate = _options.candidates[n];
+        double error = ImageAdjustments::paletteError(colors.data(), counts.data(), colors.size(), candidate.colorTable->colors.data(), candidate.colorTable->defined);
+        
+        if (n == 0 || error < best) {
+            best = error;
+            _options.colorTable = candidate.colorTable;
+            _options.paletteLUT = candidate.paletteLUT;
+            _selectedColorTable = candidate.name;
+        }
+        os << (n ? ", " : "") << candidate.name << " " << error;
+    }
+    
+    _notes.push_back("color table " + _selectedColorTable + " chosen (mean squared error: " + os.str() + ")");
+}
+
+void Pipeline::run(rePiX& repix) {
+    for (Step step : _steps) {
+        runStep(repix, step);
+    }
+}
+
+void Pipeline::runProcessing(rePiX& repix) {
+    for (Step step : _steps) {
+        if (step != Save && step != SaveScaled) runStep(repix, step);
+    }
+}
+
+void Pipeline::runOutput(rePiX& repix) {
+    for (Step step : _steps) {
+        if (step == Save || step == SaveScaled) runStep(repix, step);
+    }
+}
+
+void Pipeline::runStep(rePiX& repix, Step step) {
+    repix.checkCancelled();
+    switch (step) {
+        case Normalize:
+            repix.normalizeColors(_options.threshold);
+            break;
+            
+        case Color:
+            repix.applyColorLUT(*_lut);
+            break;
+            
+        case Index:
+            repix.indexColorTableColors(*_options.colorTable);
+            break;
+            
+        case Palette:
+            repix.normalizeColorsToPaletteLUT(*_options.paletteLUT, *_options.colorTable);
+            break;
+            
+        case Outline:
+            repix.applyOutline();
+            break;
+            
+        case Quality:
+            _quality = repix.measureQuality();
+            break;
+            
+        case Scale:
+            repix.applyScale();
+            break;
+            
+        case Save:
+            repix.saveAs(_options.filename);
+            break;
+            
+        case SaveScaled:
+            repix.saveScaledAs(_options.scales);
+            break;
+    }
+}
+
+std::string Pipeline::describe(void) const {
+    std::string description = "restore";
+    
+    for (Step step : _steps) {
+        description += " -> ";
+        switch (step) {
+            case Normalize:
+                description += "normalize";
+                break;
+                
+            case Color:
+                description += "color[" + _lut->describe() + "]";
+                break;
+                
+            case Index:
+                description += "index";
+                break;
+                
+            case Palette:
+                description += "palette[compiled(" + std::to_string(_options.colorTable->defined) + ")]";
+                break;
+                
+            case Outline:
+                description += "outline";
+                break;
+                
+            case Quality:
+                description += "quality";
+                break;
+                
+            case Scale:
+                description += "scale";
+                break;
+                
+            case Save:
+                description += "save";
+                break;
+                
+            case SaveScaled:
+                description += "save(" + std::to_string(_options.scales.size()) + " scales)";
+                break;
+        }
+    }
+    
+    for (const std::string& note : _notes) {
+        description += "\n  " + note;
+    }
+    return description;
+}
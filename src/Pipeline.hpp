@@ -0,0 +1,133 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#ifndef Pipeline_hpp
+#define Pipeline_hpp
+
+#include "rePiX.hpp"
+#include "ColorLUT.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/*
+ Plans the stages that follow the restoration from the options given. Stages
+ that would leave the image unchanged are dropped and the per-pixel color
+ stages are merged into one color lookup table, all ahead of any scaling so
+ they run on the smallest image.
+ 
+ The color lookup tables are shared by every pipeline planning the same color
+ stages, so a batch fills one table rather than one for each of its images.
+ */
+class Pipeline {
+public:
+    typedef struct {
+        std::string name;
+        const ColorTable* colorTable;
+        const PaletteLUT* paletteLUT;               // The color table compiled, or nullptr
+    } Candidate;
+    
+    typedef struct {
+        float threshold;
+        unsigned levels;
+        const CubeLUT* cube;                        // Or nullptr
+        const ColorTable* colorTable;               // Or nullptr
+        const PaletteLUT* paletteLUT;               // The color table compiled, or nullptr
+        std::vector<Candidate> candidates;          // Color tables to choose from, replacing the one above
+        bool outline;
+        bool quality;
+        std::vector<rePiX::ScaledOutput> scales;    // Several scales are each saved to their own file
+        std::string filename;                       // The output of a single scale
+    } Options;
+    
+    const Options& options = _options;
+    const QualityMetrics& quality = _quality;
+    const std::string& selectedColorTable = _selectedColorTable;
+    
+    /**
+     @brief    Chooses the stages to run on the restored image.
+     @param    repix The restored image.
+     @param    options The stages requested.
+     */
+    void plan(const rePiX& repix, const Options& options);
+    
+    // The stages the options would plan, including decoding and restoring, as an estimate of the work per pixel.
+    static unsigned estimateStages(const Options& options);
+    
+    /**
+     @brief    Estimates the most memory restoring an image and running the stages the options ask for would take,
+               less the color lookup tables shared with the other images.
+     @param    repix The restoration settings.
+     @param    sourceWidth The width of the pixelated image.
+     @param    sourceHeight The height of the pixelated image.
+     @param    options The stages requested, along with the scales saved.
+     @param    outOfCore Estimates restoring out of core, as it also is when already set to be.
+     @return   The peak memory in bytes.
+     */
+    static size_t estimatePeakMemory(const rePiX& repix, unsigned sourceWidth, unsigned sourceHeight, const Options& options, bool outOfCore = false);
+    
+    // The memory of the color lookup tables the options would plan, held once however many images share them.
+    static size_t sharedMemory(const Options& options);
+    void run(rePiX& repix);
+    
+    /*
+     The planned stages split at the output, so that a batch can encode one
+     image while the next is still being processed.
+     */
+    void runProcessing(rePiX& repix);
+    void runOutput(rePiX& repix);
+    
+    // The planned stages in order, along with why any were dropped.
+    std::string describe(void) const;
+    
+private:
+    typedef enum {
+        Normalize,
+        Color,
+        Index,
+        Palette,
+        Outline,
+        Quality,
+        Scale,
+        Save,
+        SaveScaled
+    } Step;
+    
+    Options _options;
+    std::vector<Step> _steps;
+    std::vector<std::string> _notes;
+    std::shared_ptr<ColorLUT> _lut;                 // Or nullptr when there are no color stages
+    QualityMetrics _quality = {};
+    std::string _selectedColorTable;
+    
+    void selectColorTable(const rePiX& repix, const std::shared_ptr<ColorLUT>& lut);
+    
+    // The table shared by every pipeline with the same stages, a posterize when levels is not 0, or nullptr for none.
+    static std::shared_ptr<ColorLUT> sharedLUT(unsigned levels, const CubeLUT* cube, const ColorTable* colorTable);
+    void runStep(rePiX& repix, Step step);
+};
+
+#endif /* Pipeline_hpp */
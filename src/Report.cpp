@@ -0,0 +1,202 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#include "Report.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_map>
+
+static bool hasExtension(const std::string& filename, const std::string& extension) {
+    if (filename.length() < extension.length()) return false;
+    return filename.compare(filename.length() - extension.length(), extension.length(), extension) == 0;
+}
+
+std::string Report::escape(const std::string& str) {
+    std::ostringstream os;
+    
+    os << '"';
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"':
+                os << "\\\"";
+                break;
+                
+            case '\\':
+                os << "\\\\";
+                break;
+                
+            case '\n':
+                os << "\\n";
+                break;
+                
+            case '\t':
+                os << "\\t";
+                break;
+                
+            default:
+                if (c < 0x20) {
+                    os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec;
+                } else {
+                    os << c;
+                }
+                break;
+        }
+    }
+    os << '"';
+    
+    return os.str();
+}
+
+std::string Report::toJSON(const QualityMetrics& metrics) {
+    std::ostringstream os;
+    
+    os << "{\"psnr\":" << metrics.psnr << ",\"ssim\":" << metrics.ssim
+    << ",\"meanBlockError\":" << metrics.meanBlockError << ",\"maxBlockError\":" << metrics.maxBlockError
+    << ",\"worstBlock\":[" << metrics.worstBlockX << "," << metrics.worstBlockY << "]}";
+    
+    return os.str();
+}
+
+std::string Report::toJSON(const std::string& input, const std::string& output, const rePiX::Statistics& statistics) {
+    return toJSON(input, std::vector<std::string>{output}, statistics);
+}
+
+std::string Report::toJSON(const std::string& input, const std::vector<std::string>& outputs, const rePiX::Statistics& statistics) {
+    std::ostringstream os;
+    
+    os << "{\"input\":" << escape(input);
+    if (outputs.size() == 1) {
+        os << ",\"output\":" << escape(outputs.front());
+    }
+    os << ",\"blockSize\":" << statistics.blockSize;
+    os << ",\"sourceSize\":[" << statistics.sourceWidth << "," << statistics.sourceHeight << "]";
+    os << ",\"restoredSize\":[" << statistics.restoredWidth << "," << statistics.restoredHeight << "]";
+    if (outputs.size() == 1) {
+        os << ",\"outputSize\":[" << statistics.width << "," << statistics.height << "]";
+    } else {
+        os << ",\"outputs\":[";
+        for (size_t n = 0; n < outputs.size(); ++n) {
+            os << (n ? "," : "") << "{\"output\":" << escape(outputs[n]);
+            if (n < statistics.outputSizes.size()) {
+                os << ",\"outputSize\":[" << statistics.outputSizes[n].first << "," << statistics.outputSizes[n].second << "]";
+            }
+            os << "}";
+        }
+        os << "]";
+    }
+    os << ",\"uniqueColors\":{\"restored\":" << statistics.restoredColors << ",\"final\":" << statistics.finalColors << "}";
+    
+    os << ",\"paletteHits\":[";
+    for (size_t n = 0; n < statistics.paletteHits.size(); ++n) {
+        os << (n ? "," : "") << statistics.paletteHits[n];
+    }
+    os << "]";
+    
+    if (statistics.hasQuality) {
+        os << ",\"quality\":" << toJSON(statistics.quality);
+    }
+    
+    double total = 0;
+    os << ",\"timings\":{";
+    for (const rePiX::StageTiming& timing : statistics.timings) {
+        os << escape(timing.stage) << ":" << timing.milliseconds << ",";
+        total += timing.milliseconds;
+    }
+    os << "\"total\":" << total << "}}";
+    
+    return os.str();
+}
+
+std::string Report::summarize(const std::vector<Manifest::Entry>& entries) {
+    std::unordered_map<std::string, size_t> latest;
+    for (size_t n = 0; n < entries.size(); ++n) {
+        latest[entries[n].input] = n;
+    }
+    
+    size_t done = 0, outputs = 0;
+    std::vector<std::string> failures;
+    std::vector<rePiX::StageTiming> timings;
+    for (size_t n = 0; n < entries.size(); ++n) {
+        const Manifest::Entry& entry = entries[n];
+        if (latest[entry.input] != n) continue;
+        
+        if (!entry.done) {
+            failures.push_back(entry.input);
+            continue;
+        }
+        done++;
+        outputs += entry.outputs.size();
+        for (const rePiX::StageTiming& timing : entry.timings) {
+            auto it = std::find_if(timings.begin(), timings.end(), [&](const rePiX::StageTiming& total) {
+                return total.stage == timing.stage;
+            });
+            if (it == timings.end()) {
+                timings.push_back(timing);
+            } else {
+                it->milliseconds += timing.milliseconds;
+            }
+        }
+    }
+    
+    std::ostringstream os;
+    os << "{\"images\":" << latest.size() << ",\"done\":" << done << ",\"failed\":" << failures.size() << ",\"outputs\":" << outputs;
+    
+    double total = 0;
+    os << ",\"timings\":{";
+    for (const rePiX::StageTiming& timing : timings) {
+        os << escape(timing.stage) << ":" << timing.milliseconds << ",";
+        total += timing.milliseconds;
+    }
+    os << "\"total\":" << total << "}";
+    
+    os << ",\"failures\":[";
+    for (size_t n = 0; n < failures.size(); ++n) {
+        os << (n ? "," : "") << escape(failures[n]);
+    }
+    os << "]}";
+    
+    return os.str();
+}
+
+bool Report::write(const std::string& filename, const std::string& json, bool append) {
+    std::ofstream outfile;
+    
+    if (append || hasExtension(filename, ".ndjson")) {
+        outfile.open(filename, std::ios::out | std::ios::app);
+    } else {
+        outfile.open(filename, std::ios::out | std::ios::trunc);
+    }
+    
+    if (!outfile.is_open()) {
+        return false;
+    }
+    
+    outfile << json << "\n";
+    outfile.close();
+    return true;
+}
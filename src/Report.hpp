@@ -0,0 +1,82 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#ifndef Report_hpp
+#define Report_hpp
+
+#include "rePiX.hpp"
+#include "Manifest.hpp"
+
+#include <string>
+#include <vector>
+
+class Report {
+public:
+    /**
+     @brief    Formats the quality metrics of a restoration as a JSON object.
+     @param    metrics The quality metrics.
+     @return   A single line JSON object.
+     */
+    static std::string toJSON(const QualityMetrics& metrics);
+    
+    /**
+     @brief    Formats the statistics gathered while processing an image as a JSON object.
+     @param    input The filename of the source image.
+     @param    output The filename of the restored image.
+     @param    statistics The statistics gathered by the pipeline.
+     @return   A single line JSON object.
+     */
+    static std::string toJSON(const std::string& input, const std::string& output, const rePiX::Statistics& statistics);
+    
+    /**
+     @brief    Formats the statistics of a run with several scaled outputs, each listed with its size.
+     @param    input The filename of the source image.
+     @param    outputs The filenames of the scaled images, in the order of the output sizes in the statistics.
+     @param    statistics The statistics gathered by the pipeline.
+     @return   A single line JSON object.
+     */
+    static std::string toJSON(const std::string& input, const std::vector<std::string>& outputs, const rePiX::Statistics& statistics);
+    
+    /**
+     @brief    Writes a report, a filename with the .ndjson extension has the report appended as a new line.
+     @param    filename The filename of the report.
+     @param    json The JSON object to be written.
+     @param    append A true to append to any other filename too, as a batch does after its first report.
+     @return   A true on success.
+     */
+    static bool write(const std::string& filename, const std::string& json, bool append = false);
+    
+    /**
+     @brief    Summarizes the images of several reports or manifests, such as those of each shard of a batch, an
+               image listed more than once counting only as its last listing.
+     @param    entries The images of every report, in the order read.
+     @return   A single line JSON object.
+     */
+    static std::string summarize(const std::vector<Manifest::Entry>& entries);
+    
+    static std::string escape(const std::string& str);
+};
+
+#endif /* Report_hpp */
@@ -0,0 +1,134 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#include "WatchFolder.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// How often a stop is noticed, and the directory scanned where there is no inotify.
+#define WATCH_INTERVAL_MS 250
+
+// Set by a signal handler and read by the batch reader thread, so atomic rather than just volatile.
+static std::atomic<bool> stopped(false);
+static_assert(std::atomic<bool>::is_always_lock_free, "stopping must be safe from a signal handler");
+
+static bool isWatchedFile(const std::string& name) {
+    if (name.empty() || name[0] == '.' || name.size() < 4) return false;
+    std::string extension = name.substr(name.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".png";
+}
+
+WatchFolder::~WatchFolder() {
+    if (_fd >= 0) close(_fd);
+}
+
+bool WatchFolder::open(const std::string& directory) {
+    _directory = directory;
+    
+#ifdef __linux__
+    _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_fd < 0) return false;
+    return inotify_add_watch(_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) >= 0;
+#else
+    // The files already present are not reported, only those completed from now on.
+    std::error_code error;
+    if (!std::filesystem::is_directory(directory, error)) return false;
+    scan();
+    _reported = _seen;
+    _ready.clear();
+    return true;
+#endif
+}
+
+void WatchFolder::stop(void) {
+    stopped = true;
+}
+
+/*
+ A file is taken as complete once its size and modification time are the
+ same on two scans in a row, and is reported again should it change.
+ */
+void WatchFolder::scan(void) {
+    std::map<std::string, std::pair<off_t, time_t>> seen;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(_directory, error)) {
+        std::string name = entry.path().filename().string();
+        struct stat status;
+        if (!isWatchedFile(name) || stat(entry.path().c_str(), &status) != 0 || !S_ISREG(status.st_mode)) continue;
+        
+        std::pair<off_t, time_t> state = {status.st_size, status.st_mtime};
+        seen[name] = state;
+        auto last = _seen.find(name);
+        auto reported = _reported.find(name);
+        if (last != _seen.end() && last->second == state && (reported == _reported.end() || reported->second != state)) {
+            _reported[name] = state;
+            _ready.push_back(entry.path().string());
+        }
+    }
+    _seen.swap(seen);
+}
+
+bool WatchFolder::wait(std::vector<std::string>& filenames, size_t most) {
+    filenames.clear();
+    
+    while (_ready.empty() && !stopped) {
+#ifdef __linux__
+        struct pollfd descriptor = {_fd, POLLIN, 0};
+        if (poll(&descriptor, 1, WATCH_INTERVAL_MS) <= 0) continue;
+        
+        alignas(struct inotify_event) char buffer[16384];
+        for (ssize_t length = read(_fd, buffer, sizeof(buffer)); length > 0; length = read(_fd, buffer, sizeof(buffer))) {
+            for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+                const struct inotify_event* event = (const struct inotify_event *)p;
+                if (event->len == 0 || (event->mask & IN_ISDIR) || !isWatchedFile(event->name)) continue;
+                
+                std::string filename = (std::filesystem::path(_directory) / event->name).string();
+                if (std::find(_ready.begin(), _ready.end(), filename) == _ready.end()) _ready.push_back(filename);
+            }
+        }
+#else
+        usleep(WATCH_INTERVAL_MS * 1000);
+        scan();
+#endif
+    }
+    if (stopped) return false;
+    
+    while (!_ready.empty() && filenames.size() < most) {
+        filenames.push_back(_ready.front());
+        _ready.pop_front();
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+/*
+ The MIT License (MIT)
+ 
+ Copyright (c) 2024 Insoft. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+
+#ifndef WatchFolder_hpp
+#define WatchFolder_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <utility>
+#include <sys/types.h>
+
+/*
+ Reports the PNG files completed within a directory, once the writer closes
+ them or they are moved in, so that nothing partly written is picked up.
+ Hidden files, such as those of an upload still in progress, are ignored.
+ On Linux the directory is watched through inotify, elsewhere it is scanned
+ for files whose size and modification time have settled.
+ */
+class WatchFolder {
+public:
+    ~WatchFolder();
+    
+    bool open(const std::string& directory);
+    
+    /**
+     @brief    Waits for files to be completed within the directory.
+     @param    filenames Receives the paths of up to most files.
+     @param    most The most files to return at once.
+     @return   False once stopped.
+     */
+    bool wait(std::vector<std::string>& filenames, size_t most);
+    
+    // Ends every wait, safe to call from a signal handler.
+    static void stop(void);
+    
+private:
+    std::string _directory;
+    int _fd = -1;
+    std::deque<std::string> _ready;
+    std::map<std::string, std::pair<off_t, time_t>> _seen;      // When scanning, the size and time of each file
+    std::map<std::string, std::pair<off_t, time_t>> _reported;
+    
+    void scan(void);
+};
+
+#endif /* WatchFolder_hpp */
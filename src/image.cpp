@@ -23,10 +23,21 @@
  */
 
 #include "image.hpp"
+#include "Kernels.hpp"
+#include "Parallel.hpp"
+#include "Allocations.hpp"
+#include "CancellationToken.hpp"
 
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
 #include <png.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 
 /* Windows 3.x bitmap file header */
@@ -67,65 +78,112 @@ static void flipImageVertically(const TImage *image)
     
 }
 
-TImage *loadPNGGraphicFile(const std::string& filename) {
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+/*
+ The structs of libpng, and the buffers it allocates, are tracked along with
+ the pixels when allocations are being tracked.
+ */
+#if defined(REPIX_TRACK_ALLOCATIONS) && defined(PNG_USER_MEM_SUPPORTED)
+static png_voidp allocatePNG(png_structp, png_alloc_size_t size) {
+    return Allocations::allocate(size, "libpng");
+}
+
+static void releasePNG(png_structp, png_voidp pointer) {
+    Allocations::release(pointer);
+}
+
+static png_structp createPNGReadStruct(void) {
+    return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr, nullptr, allocatePNG, releasePNG);
+}
+
+static png_structp createPNGWriteStruct(void) {
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr, nullptr, allocatePNG, releasePNG);
+}
+#else
+static png_structp createPNGReadStruct(void) {
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+}
+
+static png_structp createPNGWriteStruct(void) {
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+}
+#endif
+
+/*
+ Sets up the libpng transforms so that any PNG is delivered as 8-bit RGBA rows,
+ unless expandRGB is false in which case RGB images are delivered as 8-bit RGB
+ rows for the caller to expand.
+ */
+static void setPNGTransformsToRGBA(png_structp png, png_infop info, bool expandRGB = true) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    // Convert the PNG to 8-bit RGBA format
+    if (bit_depth == 16) png_set_strip_16(png);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) png_set_gray_to_rgb(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
+    if (color_type == PNG_COLOR_TYPE_GRAY || (color_type == PNG_COLOR_TYPE_RGB && expandRGB)) png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+    png_read_update_info(png, info);
+}
+
+/*
+ Decodes a PNG through the given read function, the first sigBytes of the
+ signature having already been read and checked by the caller.
+ */
+static TImage *decodePNG(void* io, png_rw_ptr read, int sigBytes) {
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image) {
         return nullptr;
     }
+    image->data = nullptr;
     
-    // Open the file using an ifstream
-    std::ifstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + filename);
-    }
-
-    // Read the PNG signature (first 8 bytes)
-    png_byte header[8];
-    file.read(reinterpret_cast<char*>(header), sizeof(header));
-    if (file.gcount() != sizeof(header) || png_sig_cmp(header, 0, 8)) {
-        throw std::runtime_error("File is not a valid PNG: " + filename);
-    }
-
     // Initialize PNG structs
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    if (!png) throw std::runtime_error("Failed to create PNG read struct");
+    png_structp png = createPNGReadStruct();
+    if (!png) {
+        reset(image);
+        throw std::runtime_error("Failed to create PNG read struct");
+    }
 
     png_infop info = png_create_info_struct(png);
     if (!info) {
         png_destroy_read_struct(&png, nullptr, nullptr);
+        reset(image);
         throw std::runtime_error("Failed to create PNG info struct");
     }
 
+    /*
+     A libpng error longjmps back to here, skipping any destructors, so the
+     buffers are raw allocations that are released by hand and are volatile so
+     that their values survive the jump.
+     */
+    png_byte *volatile row = nullptr;
+    png_byte *volatile rgb = nullptr;
+    png_bytep *volatile row_pointers = nullptr;
+    
     if (setjmp(png_jmpbuf(png))) {
+        Allocations::release(row);
+        Allocations::release(rgb);
+        Allocations::release(row_pointers);
         png_destroy_read_struct(&png, &info, nullptr);
+        reset(image);
         throw std::runtime_error("Error during PNG read");
     }
 
-    // Set the custom read function to use ifstream
-    png_set_read_fn(png, &file, [](png_structp png, png_bytep data, png_size_t length) {
-        std::ifstream* file = static_cast<std::ifstream*>(png_get_io_ptr(png));
-        file->read(reinterpret_cast<char*>(data), length);
-    });
+    png_set_read_fn(png, io, read);
 
-    // Inform libpng we've already read the first 8 bytes
-    png_set_sig_bytes(png, 8);
+    // Inform libpng we've already read the first bytes
+    png_set_sig_bytes(png, sigBytes);
 
     // Read the image info
     png_read_info(png, info);
 
     int width = png_get_image_width(png, info);
     int height = png_get_image_height(png, info);
-    png_byte color_type = png_get_color_type(png, info);
-    png_byte bit_depth = png_get_bit_depth(png, info);
 
-    // Convert the PNG to 8-bit RGBA format
-    if (bit_depth == 16) png_set_strip_16(png);
-    if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
-    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY) png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
-
-    png_read_update_info(png, info);
+    int passes = png_set_interlace_handling(png);
+    setPNGTransformsToRGBA(png, info, false);
 
     // Create the TImage structure
     image->width = static_cast<uint16_t>(width);
@@ -134,35 +192,220 @@ TImage *loadPNGGraphicFile(const std::string& filename) {
 
     // Allocate memory for the pixel data
     size_t dataSize = width * height * 4; // 4 bytes per pixel (RGBA)
-    image->data = new uint8_t[dataSize];
+    image->data = (uint8_t *)Allocations::allocate(dataSize, "png pixels");
+    if (!image->data) png_error(png, "Out of memory");
 
-    // Read the image data row by row
-    std::vector<png_bytep> row_pointers(height);
-    for (int y = 0; y < height; ++y) {
-        row_pointers[y] = image->data + y * width * 4;
-    }
+    if (png_get_channels(png, info) == 3) {
+        /*
+         RGB rows are expanded to RGBA by the vectorized kernel rather than by
+         libpng, a row at a time so that the image is only written once.
+         */
+        if (passes > 1) {
+            // Each pass only fills in some of the pixels of a row, so the whole image is needed as RGB.
+            rgb = (png_byte *)Allocations::allocate((size_t)width * height * 3, "png rgb");
+            row_pointers = (png_bytep *)Allocations::allocate(height * sizeof(png_bytep), "png row pointers");
+            if (!rgb || !row_pointers) png_error(png, "Out of memory");
+            for (int y = 0; y < height; ++y) {
+                row_pointers[y] = rgb + (size_t)y * width * 3;
+            }
+            png_read_image(png, row_pointers);
+            Kernels::active().expandRGBToRGBA(rgb, (uint32_t *)image->data, (long)width * height);
+        } else {
+            row = (png_byte *)Allocations::allocate(png_get_rowbytes(png, info), "png row");
+            if (!row) png_error(png, "Out of memory");
+            for (int y = 0; y < height; ++y) {
+                png_read_row(png, row, nullptr);
+                Kernels::active().expandRGBToRGBA(row, (uint32_t *)(image->data + (size_t)y * width * 4), width);
+            }
+        }
+    } else {
+        // Read the image data row by row
+        row_pointers = (png_bytep *)Allocations::allocate(height * sizeof(png_bytep), "png row pointers");
+        if (!row_pointers) png_error(png, "Out of memory");
+        for (int y = 0; y < height; ++y) {
+            row_pointers[y] = image->data + y * width * 4;
+        }
 
-    png_read_image(png, row_pointers.data());
+        png_read_image(png, row_pointers);
+    }
 
     // Clean up
+    Allocations::release(row);
+    Allocations::release(rgb);
+    Allocations::release(row_pointers);
     png_destroy_read_struct(&png, &info, nullptr);
 
     return image;
 }
 
+TImage *loadPNGGraphicFile(const std::string& filename) {
+    // Open the file using an ifstream
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file: " + filename);
+    }
+
+    // Read the PNG signature (first 8 bytes)
+    png_byte header[8];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (file.gcount() != sizeof(header) || png_sig_cmp(header, 0, 8)) {
+        throw std::runtime_error("File is not a valid PNG: " + filename);
+    }
+
+    // Set the custom read function to use ifstream
+    return decodePNG(&file, [](png_structp png, png_bytep data, png_size_t length) {
+        std::ifstream* file = static_cast<std::ifstream*>(png_get_io_ptr(png));
+        file->read(reinterpret_cast<char*>(data), length);
+    }, 8);
+}
+
+TImage *loadPNGGraphicData(const uint8_t* data, size_t length) {
+    if (length < 8 || png_sig_cmp(data, 0, 8)) {
+        throw std::runtime_error("Data is not a valid PNG");
+    }
+    
+    typedef struct {
+        const uint8_t* data;
+        size_t length;
+        size_t offset;
+    } Source;
+    Source source = {data, length, 8};
+    
+    return decodePNG(&source, [](png_structp png, png_bytep data, png_size_t length) {
+        Source* source = static_cast<Source*>(png_get_io_ptr(png));
+        if (source->length - source->offset < length) png_error(png, "Truncated PNG data");
+        memcpy(data, source->data + source->offset, length);
+        source->offset += length;
+    }, 8);
+}
+
+bool readPNGGraphicFileSize(const std::string& filename, uint16_t& width, uint16_t& height) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    
+    /*
+     The IHDR chunk always follows the 8 byte signature, so the width and
+     height can be read directly without involving libpng.
+     */
+    png_byte header[24];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (file.gcount() != sizeof(header) || png_sig_cmp(header, 0, 8) || memcmp(header + 12, "IHDR", 4)) {
+        return false;
+    }
+    
+    uint32_t w = (uint32_t)header[16] << 24 | (uint32_t)header[17] << 16 | (uint32_t)header[18] << 8 | header[19];
+    uint32_t h = (uint32_t)header[20] << 24 | (uint32_t)header[21] << 16 | (uint32_t)header[22] << 8 | header[23];
+    if (w == 0 || h == 0 || w > UINT16_MAX || h > UINT16_MAX) {
+        return false;
+    }
+    
+    width = static_cast<uint16_t>(w);
+    height = static_cast<uint16_t>(h);
+    return true;
+}
+
+bool readPNGGraphicFileRows(const std::string& filename, const std::function<bool(unsigned y, const uint32_t* pixels, unsigned width)>& visit) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    
+    png_byte header[8];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (file.gcount() != sizeof(header) || png_sig_cmp(header, 0, 8)) {
+        return false;
+    }
+    
+    png_structp png = createPNGReadStruct();
+    if (!png) return false;
+    
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return false;
+    }
+    
+    Allocations::Vector<png_byte> row(Allocations::Allocator<png_byte>("png row"));
+    
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    
+    png_set_read_fn(png, &file, [](png_structp png, png_bytep data, png_size_t length) {
+        std::ifstream* file = static_cast<std::ifstream*>(png_get_io_ptr(png));
+        file->read(reinterpret_cast<char*>(data), length);
+    });
+    
+    png_set_sig_bytes(png, 8);
+    png_read_info(png, info);
+    
+    /*
+     Interlaced images spread every row across seven passes, so rows can't be
+     read in turn; the caller is expected to fall back to loading the whole image.
+     */
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    
+    unsigned width = png_get_image_width(png, info);
+    unsigned height = png_get_image_height(png, info);
+    
+    setPNGTransformsToRGBA(png, info);
+    
+    // Rows are read one at a time into a single scratch row.
+    row.resize(png_get_rowbytes(png, info));
+    
+    for (unsigned y = 0; y < height; ++y) {
+        png_read_row(png, row.data(), nullptr);
+        if (!visit(y, (const uint32_t *)row.data(), width)) break;
+    }
+    
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+}
+
+TImage *loadPNGGraphicFileSampled(const std::string& filename, const std::vector<unsigned>& columns, const std::vector<unsigned>& rows) {
+    TImage* image = createPixmap((int)columns.size(), (int)rows.size(), 32);
+    if (!image) return nullptr;
+    const unsigned stride = image->width;
+    uint32_t* dest = (uint32_t *)image->data;
+    
+    /*
+     Only the rows and columns that are sampled are kept, any sample falling
+     outside of the image is left as transparent.
+     */
+    size_t n = 0;
+    bool read = readPNGGraphicFileRows(filename, [&](unsigned y, const uint32_t* src, unsigned width) {
+        while (n < rows.size() && rows[n] == y) {
+            for (size_t i = 0; i < columns.size(); ++i) {
+                if (columns[i] < width) dest[i + n * stride] = src[columns[i]];
+            }
+            n++;
+        }
+        return n < rows.size();
+    });
+    
+    if (!read) reset(image);
+    return image;
+}
+
 TImage *loadBMPGraphicFile(const std::string& filename) {
     BIPHeader bip_header;
     
     std::ifstream infile;
     
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image) {
         return nullptr;
     }
     
     infile.open(filename, std::ios::in | std::ios::binary);
     if (!infile.is_open()) {
-        free(image);
+        Allocations::release(image);
         return nullptr;
     }
     
@@ -170,14 +413,14 @@ TImage *loadBMPGraphicFile(const std::string& filename) {
     
     if (strncmp(bip_header.fileHeader.bfType, "BM", 2) != 0) {
         infile.close();
-        free(image);
+        Allocations::release(image);
         return nullptr;
     }
     
     image->bitWidth = bip_header.biBitCount;
-    image->data = (unsigned char *)malloc(bip_header.biSizeImage);
+    image->data = (unsigned char *)Allocations::allocate(bip_header.biSizeImage, "bmp pixels");
     if (!image->data) {
-        free(image);
+        Allocations::release(image);
         infile.close();
         return nullptr;
     }
@@ -216,14 +459,14 @@ TImage *loadPBMGraphicFile(const std::string &filename)
 {
     std::ifstream infile;
     
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image) {
         return nullptr;
     }
     
     infile.open(filename, std::ios::in | std::ios::binary);
     if (!infile.is_open()) {
-        free(image);
+        Allocations::release(image);
         return nullptr;
     }
     
@@ -244,10 +487,10 @@ TImage *loadPBMGraphicFile(const std::string &filename)
     image->height = atoi(s.c_str());
     
     size_t length = ((image->width + 7) >> 3) * image->height;
-    image->data = (unsigned char *)malloc(length);
+    image->data = (unsigned char *)Allocations::allocate(length, "pbm pixels");
     
     if (!image->data) {
-        free(image);
+        Allocations::release(image);
         infile.close();
         return nullptr;
     }
@@ -257,20 +500,16 @@ TImage *loadPBMGraphicFile(const std::string &filename)
     return image;
 }
 
-bool saveImageAsPNGFile(TImage* image, const std::string& filename) {
-
-    // Open file
-    FILE* fp = fopen(filename.c_str(), "wb");
-    if (!fp) {
-        std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
-        return false;
-    }
+bool saveImageAsPNGFile(TImage* image, const std::string& filename, const uint32_t* palette, int paletteSize) {
+    return saveScaledImageAsPNGFile(image, 1, filename, palette, paletteSize);
+}
 
+// Encodes a PNG through the given write function, the token being checked before each row.
+static bool encodePNG(const TImage* image, int scale, const uint32_t* palette, int paletteSize, void* io, png_rw_ptr write, png_flush_ptr flush, const CancellationToken* token) {
     // Create PNG write struct
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_structp png = createPNGWriteStruct();
     if (!png) {
         std::cerr << "Error: Unable to create PNG write struct." << std::endl;
-        fclose(fp);
         return false;
     }
 
@@ -279,7 +518,6 @@ bool saveImageAsPNGFile(TImage* image, const std::string& filename) {
     if (!info) {
         std::cerr << "Error: Unable to create PNG info struct." << std::endl;
         png_destroy_write_struct(&png, nullptr);
-        fclose(fp);
         return false;
     }
 
@@ -287,18 +525,16 @@ bool saveImageAsPNGFile(TImage* image, const std::string& filename) {
     if (setjmp(png_jmpbuf(png))) {
         std::cerr << "Error: Exception during PNG creation." << std::endl;
         png_destroy_write_struct(&png, &info);
-        fclose(fp);
         return false;
     }
 
-    // Initialize file I/O
-    png_init_io(png, fp);
+    png_set_write_fn(png, io, write, flush);
 
     // Set image header info
     int color_type;
     switch (image->bitWidth) {
         case 8:
-            color_type = PNG_COLOR_TYPE_GRAY;
+            color_type = palette != nullptr ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_GRAY;
             break;
         case 24:
             color_type = PNG_COLOR_TYPE_RGB;
@@ -309,45 +545,126 @@ bool saveImageAsPNGFile(TImage* image, const std::string& filename) {
         default:
             std::cerr << "Error: Unsupported bit width." << std::endl;
             png_destroy_write_struct(&png, &info);
-            fclose(fp);
             return false;
     }
 
-    png_set_IHDR(png, info, image->width, image->height, 8, color_type,
+    png_set_IHDR(png, info, image->width * scale, image->height * scale, 8, color_type,
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_color colors[256];
+        png_byte alpha[256];
+        int opaque = 0;
+        
+        // The parameter is left unchanged after setjmp, so it can't be clobbered by a longjmp.
+        const int entries = paletteSize > 256 ? 256 : paletteSize;
+        for (int n = 0; n < entries; ++n) {
+            colors[n].red = palette[n] & 0xFF;
+            colors[n].green = palette[n] >> 8 & 0xFF;
+            colors[n].blue = palette[n] >> 16 & 0xFF;
+            alpha[n] = palette[n] >> 24;
+            if (alpha[n] != 255) opaque = n + 1;
+        }
+        png_set_PLTE(png, info, colors, entries);
+        
+        // Only the entries up to the last translucent one need an alpha value.
+        if (opaque > 0) png_set_tRNS(png, info, alpha, opaque, nullptr);
+    }
+
     png_write_info(png, info);
 
     // Write image data row by row
     const int bytes_per_pixel = image->bitWidth / 8;
-    std::vector<png_bytep> row_pointers(image->height);
-    for (size_t y = 0; y < image->height; ++y) {
-        row_pointers[y] = (png_bytep)(&image->data[y * image->width * bytes_per_pixel]);
+    auto cancelled = [&](void) {
+        if (token == nullptr || !token->isCancelled()) return false;
+        png_destroy_write_struct(&png, &info);
+        return true;
+    };
+    if (scale == 1) {
+        for (size_t y = 0; y < image->height; ++y) {
+            if (cancelled()) return false;
+            png_write_row(png, (png_bytep)(&image->data[y * image->width * bytes_per_pixel]));
+        }
+    } else {
+        // Each source row is scaled on its own and written once for every output row it covers.
+        Allocations::Vector<uint8_t> rows((size_t)image->width * scale * scale * bytes_per_pixel, Allocations::Allocator<uint8_t>("png scaled rows"));
+        for (size_t y = 0; y < image->height; ++y) {
+            if (cancelled()) return false;
+            const uint8_t* src = &image->data[y * image->width * bytes_per_pixel];
+            if (bytes_per_pixel == 1) {
+                Kernels::indexedScaleKernel(scale)(src, rows.data(), image->width, 1, scale);
+            } else {
+                Kernels::scaleKernel(scale)((const uint32_t*)src, (uint32_t*)rows.data(), image->width, 1, scale);
+            }
+            for (int sy = 0; sy < scale; ++sy) {
+                png_write_row(png, rows.data());
+            }
+        }
     }
-    png_write_image(png, row_pointers.data());
 
     // End write
     png_write_end(png, nullptr);
 
     // Cleanup
     png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+bool saveScaledImageAsPNGFile(const TImage* image, int scale, const std::string& filename, const uint32_t* palette, int paletteSize, const CancellationToken* token) {
+    if (scale < 1 || (scale > 1 && image->bitWidth != 8 && image->bitWidth != 32)) {
+        std::cerr << "Error: Unsupported scale for bit width." << std::endl;
+        return false;
+    }
+
+    // Open file
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Error: Unable to open file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    bool encoded = encodePNG(image, scale, palette, paletteSize, fp, [](png_structp png, png_bytep data, png_size_t length) {
+        if (fwrite(data, 1, length, static_cast<FILE*>(png_get_io_ptr(png))) != length) png_error(png, "Write error");
+    }, [](png_structp png) {
+        fflush(static_cast<FILE*>(png_get_io_ptr(png)));
+    }, token);
     fclose(fp);
+    if (!encoded) {
+        // Nothing is left behind of a save that failed or was cancelled part way.
+        remove(filename.c_str());
+        return false;
+    }
 
-    std::cout << "PNG file saved successfully: " << filename << std::endl;
+    // Outputs may be saved concurrently, so the message is written in one go.
+    std::cout << "PNG file saved successfully: " + filename + "\n" << std::flush;
     return true;
 }
 
+bool encodeScaledImageAsPNG(const TImage* image, int scale, std::vector<uint8_t>& data, const uint32_t* palette, int paletteSize, const CancellationToken* token) {
+    if (scale < 1 || (scale > 1 && image->bitWidth != 8 && image->bitWidth != 32)) {
+        std::cerr << "Error: Unsupported scale for bit width." << std::endl;
+        return false;
+    }
+    
+    data.clear();
+    return encodePNG(image, scale, palette, paletteSize, &data, [](png_structp png, png_bytep bytes, png_size_t length) {
+        std::vector<uint8_t>* data = static_cast<std::vector<uint8_t>*>(png_get_io_ptr(png));
+        data->insert(data->end(), bytes, bytes + length);
+    }, [](png_structp) {
+    }, token);
+}
+
 TImage *createBitmap(int w, int h)
 {
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image) {
         return nullptr;
     }
     
     w = (w + 7) & ~7;
-    image->data = (uint8_t *)calloc(sizeof(char), w * h / 8);
+    image->data = (uint8_t *)Allocations::allocateZeroed(w * h / 8, "bitmap");
     if (!image->data) {
-        free(image);
+        Allocations::release(image);
         return nullptr;
     }
     
@@ -360,14 +677,14 @@ TImage *createBitmap(int w, int h)
 
 TImage *createPixmap(int w, int h, int bitWidth)
 {
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image) {
         return nullptr;
     }
     
-    image->data = (uint8_t *)calloc(sizeof(char), w * h * (bitWidth / 8));
+    image->data = (uint8_t *)Allocations::allocateZeroed(w * h * (bitWidth / 8), "pixmap");
     if (!image->data) {
-        free(image);
+        Allocations::release(image);
         return nullptr;
     }
     
@@ -379,6 +696,73 @@ TImage *createPixmap(int w, int h, int bitWidth)
 }
 
 
+/*
+ The pixels of a mapped pixmap live in a file that is unlinked as soon as it is
+ created, so the system can write them back and page them out under memory
+ pressure, and the file goes once unmapped. The mappings are kept so that reset
+ knows to unmap rather than free.
+ */
+static std::mutex mappedPixmapsMutex;
+static std::unordered_map<void*, size_t> mappedPixmaps;
+static std::string mappedPixmapDirectory;
+
+void setMappedPixmapDirectory(const std::string& directory)
+{
+    std::lock_guard<std::mutex> lock(mappedPixmapsMutex);
+    mappedPixmapDirectory = directory;
+}
+
+TImage *createMappedPixmap(int w, int h, int bitWidth)
+{
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lock(mappedPixmapsMutex);
+        directory = mappedPixmapDirectory;
+    }
+    if (directory.empty()) {
+        const char* tmpdir = getenv("TMPDIR");
+        directory = tmpdir && *tmpdir ? tmpdir : "/tmp";
+    }
+    
+    std::string path = directory + "/.repix-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) return nullptr;
+    unlink(path.c_str());
+    
+    size_t length = (size_t)w * h * (bitWidth / 8);
+    if (length == 0 || ftruncate(fd, (off_t)length) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    
+    void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
+    if (!image) {
+        munmap(data, length);
+        return nullptr;
+    }
+    
+    image->data = (uint8_t *)data;
+    image->bitWidth = bitWidth;
+    image->width = w;
+    image->height = h;
+    
+    Allocations::track(data, length, "mapped pixmap");
+    std::lock_guard<std::mutex> lock(mappedPixmapsMutex);
+    mappedPixmaps[data] = length;
+    return image;
+}
+
+// Falls back to memory when the file can't be created.
+static TImage *allocatePixmap(int w, int h, int bitWidth, bool mapped)
+{
+    TImage *image = mapped ? createMappedPixmap(w, h, bitWidth) : nullptr;
+    return image ? image : createPixmap(w, h, bitWidth);
+}
+
 void copyPixmap(const TImage *dst, int dx, int dy, const TImage *src, int x, int y, uint16_t w, uint16_t h)
 {
     if (!dst || !src)
@@ -402,9 +786,28 @@ void copyPixmap(const TImage *dst, int dx, int dy, const TImage *src, int x, int
     }
 }
 
+TImage *cropPixmap(const TImage *image, int x, int y, int w, int h, bool mapped)
+{
+    if (!image || !image->data || (image->bitWidth != 8 && image->bitWidth != 32))
+        return nullptr;
+    
+    if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > image->width || y + h > image->height)
+        return nullptr;
+    
+    TImage *croppedImage = allocatePixmap(w, h, image->bitWidth, mapped);
+    if (!croppedImage)
+        return nullptr;
+    
+    const size_t bytes = image->bitWidth / 8;
+    for (int j = 0; j < h; ++j) {
+        memcpy(croppedImage->data + (size_t)j * w * bytes, image->data + ((size_t)(y + j) * image->width + x) * bytes, (size_t)w * bytes);
+    }
+    return croppedImage;
+}
+
 TImage *convertMonochromeBitmapToPixmap(const TImage *monochrome)
 {
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image)
         return nullptr;
     
@@ -414,7 +817,7 @@ TImage *convertMonochromeBitmapToPixmap(const TImage *monochrome)
     image->bitWidth = 8;
     image->width = monochrome->width;
     image->height = monochrome->height;
-    image->data = (uint8_t *)malloc(image->width * image->height);
+    image->data = (uint8_t *)Allocations::allocate(image->width * image->height, "8-bit pixmap");
     if (!image->data) return image;
     
     memset(image->data, 0, image->width * image->height);
@@ -444,7 +847,7 @@ TImage *convertPixmapTo8BitPixmap(const TImage *pixmap)
     if (pixmap->bitWidth != 4)
         return nullptr;
     
-    TImage *image = (TImage *)malloc(sizeof(TImage ));
+    TImage *image = (TImage *)Allocations::allocate(sizeof(TImage ), "image");
     if (!image)
         return nullptr;
     
@@ -453,7 +856,7 @@ TImage *convertPixmapTo8BitPixmap(const TImage *pixmap)
     image->bitWidth = 8;
     image->width = pixmap->width;
     image->height = pixmap->height;
-    image->data = (uint8_t *)malloc(image->width * image->height);
+    image->data = (uint8_t *)Allocations::allocate(image->width * image->height, "8-bit pixmap");
     if (!image->data) return image;
     
     memset(image->data, 0, image->width * image->height);
@@ -484,7 +887,7 @@ void convertPixmapTo8BitPixmapNoCopy(TImage *pixmap)
     if (pixmap->bitWidth != 4 && pixmap->bitWidth != 2)
         return;
     
-    uint8_t* new_data = (uint8_t *)malloc(pixmap->width * pixmap->height);
+    uint8_t* new_data = (uint8_t *)Allocations::allocate(pixmap->width * pixmap->height, "8-bit pixmap");
     if (new_data == nullptr)
         return;
     
@@ -508,16 +911,31 @@ void convertPixmapTo8BitPixmapNoCopy(TImage *pixmap)
         }
     }
     
-    free(pixmap->data);
+    Allocations::release(pixmap->data);
     pixmap->data = new_data;
     pixmap->bitWidth = 8;
 }
 
+static bool unmapPixmap(void* data)
+{
+    size_t length;
+    {
+        std::lock_guard<std::mutex> lock(mappedPixmapsMutex);
+        auto it = mappedPixmaps.find(data);
+        if (it == mappedPixmaps.end()) return false;
+        length = it->second;
+        mappedPixmaps.erase(it);
+    }
+    Allocations::forget(data);
+    munmap(data, length);
+    return true;
+}
+
 void reset(TImage *&image)
 {
     if (image) {
-        if (image->data) free(image->data);
-        free(image);
+        if (image->data && !unmapPixmap(image->data)) Allocations::release(image->data);
+        Allocations::release(image);
         image = nullptr;
     }
 }
@@ -584,41 +1002,100 @@ TImage *extractImageSectionMasked(TImage *image, uint8_t maskColor)
     return extractedImage;
 }
 
-TImage* scaleImage(const TImage *image, int scale) {
+TImage* scaleImage(const TImage *image, int scale, bool mapped) {
     if (image == nullptr || image->data == nullptr)
         return nullptr;
     
-    if (image->bitWidth != 32)
+    if (image->bitWidth != 32 && image->bitWidth != 8)
         return nullptr;
     
-    TImage *scaledImage = createPixmap(image->width * scale, image->height * scale, 32);
+    TImage *scaledImage = allocatePixmap(image->width * scale, image->height * scale, image->bitWidth, mapped);
     if (scaledImage == nullptr)
         return nullptr;
     
+    if (image->bitWidth == 8) {
+        Kernels::indexedScaleKernel(scale)(image->data, scaledImage->data, image->width, image->height, scale);
+        return scaledImage;
+    }
+    
     uint32_t* src = (uint32_t*)image->data;
     uint32_t* dest = (uint32_t*)scaledImage->data;
     
-    float scale_x = (float)scale;
-    float scale_y = (float)scale;
+    Kernels::scaleKernel(scale)(src, dest, image->width, image->height, scale);
     
-                     
-    // Iterate through the bitmap and draw it scaled
-    for (int y = 0; y < image->height; y++) {
-        for (int x = 0; x < image->width; x++) {
-            // Access pixel color data from the bitmap array
-            uint32_t color = src[y * image->width + x];
+    return scaledImage;
+}
+
+static TImage* scalePixelArt(const TImage *image, int factor, bool mapped) {
+    TImage *scaledImage = allocatePixmap(image->width * factor, image->height * factor, image->bitWidth, mapped);
+    if (scaledImage == nullptr)
+        return nullptr;
+    
+    // Bands of source rows are scaled concurrently, each writing its own output rows.
+    const int minimumRows = image->width > 0 ? 65536 / image->width + 1 : 1;
+    Parallel::forRows(image->height, minimumRows, [&](int top, int bottom) {
+        if (image->bitWidth == 8) {
+            Kernels::active().pixelArtIndexed[factor - 2](image->data, scaledImage->data, image->width, image->height, top, bottom);
+        } else {
+            Kernels::active().pixelArt[factor - 2]((const uint32_t*)image->data, (uint32_t*)scaledImage->data, image->width, image->height, top, bottom);
+        }
+    });
+    
+    return scaledImage;
+}
+
+TImage* scaleImageWithFilter(const TImage *image, ScaleFilter filter, bool mapped) {
+    if (image == nullptr || image->data == nullptr)
+        return nullptr;
+    
+    if (image->bitWidth != 32 && image->bitWidth != 8)
+        return nullptr;
+    
+    switch (filter) {
+        case ScaleFilter::Scale2x:
+            return scalePixelArt(image, 2, mapped);
             
-            // Draw the pixel at the scaled position
-            for (float sy = 0; sy < scale_y; sy += 1.0f) {
-                for (float sx = 0; sx < scale_x; sx += 1.0f) {
-                    // Calculate the scaled position
-                    int posX = (int)(x * scale_x + sx);
-                    int posY = (int)(y * scale_y + sy);
-                    dest[posX + posY * scaledImage->width] = color;
-                }
-            }
+        case ScaleFilter::Scale3x:
+            return scalePixelArt(image, 3, mapped);
+            
+        case ScaleFilter::Scale4x: {
+            TImage *doubledImage = scalePixelArt(image, 2, mapped);
+            if (doubledImage == nullptr)
+                return nullptr;
+            TImage *scaledImage = scalePixelArt(doubledImage, 2, mapped);
+            reset(doubledImage);
+            return scaledImage;
         }
+            
+        default:
+            return scaleImage(image, 1, mapped);
     }
-    return scaledImage;
 }
 
+int scaleFilterFactor(ScaleFilter filter) {
+    switch (filter) {
+        case ScaleFilter::Scale2x:
+            return 2;
+            
+        case ScaleFilter::Scale3x:
+            return 3;
+            
+        case ScaleFilter::Scale4x:
+            return 4;
+            
+        default:
+            return 1;
+    }
+}
+
+TImage *convertIndexedPixmapToRGBA(const TImage* pixmap, const uint32_t* palette, bool mapped) {
+    if (pixmap == nullptr || pixmap->data == nullptr || pixmap->bitWidth != 8)
+        return nullptr;
+    
+    TImage *image = allocatePixmap(pixmap->width, pixmap->height, 32, mapped);
+    if (image == nullptr)
+        return nullptr;
+    
+    Kernels::active().expandIndexedToRGBA(pixmap->data, (uint32_t*)image->data, (long)pixmap->width * pixmap->height, palette);
+    return image;
+}
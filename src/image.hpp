@@ -28,6 +28,8 @@
 #include <iostream>
 #include <sstream>
 #include <stdint.h>
+#include <vector>
+#include <functional>
 
 typedef struct __attribute__((__packed__)) {
     uint16_t width;
@@ -36,6 +38,16 @@ typedef struct __attribute__((__packed__)) {
     uint8_t *data;
 } TImage;
 
+// Pixel art upscalers, each only copies existing pixels so indexed images stay indexed.
+class CancellationToken;
+
+enum class ScaleFilter {
+    Nearest,
+    Scale2x,    // Also known as EPX
+    Scale3x,
+    Scale4x     // Scale2x applied twice
+};
+
 /**
  @brief    Loads a file in the Portable Network Graphic (PNG) format.
  @param    filename The filename of the Portable Network Graphic (PNG) to be loaded.
@@ -43,6 +55,40 @@ typedef struct __attribute__((__packed__)) {
  */
 TImage *loadPNGGraphicFile(const std::string& filename);
 
+/**
+ @brief    Decodes a Portable Network Graphic (PNG) already read into memory.
+ @param    data The contents of the PNG file.
+ @param    length The length of the data in bytes.
+ @return   A structure containing the 32-bit pixmap image data.
+ */
+TImage *loadPNGGraphicData(const uint8_t* data, size_t length);
+
+/**
+ @brief    Reads the dimensions of a Portable Network Graphic (PNG) file without decoding the image data.
+ @param    filename The filename of the Portable Network Graphic (PNG).
+ @param    width The width of the image.
+ @param    height The height of the image.
+ @return   A true on success.
+ */
+bool readPNGGraphicFileSize(const std::string& filename, uint16_t& width, uint16_t& height);
+
+/**
+ @brief    Loads only the sampled rows and columns of a file in the Portable Network Graphic (PNG) format.
+ @param    filename The filename of the Portable Network Graphic (PNG) to be loaded.
+ @param    columns The x-axis positions to be sampled, in ascending order.
+ @param    rows The y-axis positions to be sampled, in ascending order.
+ @return   A 32-bit pixmap of columns by rows in size, or nullptr if the image is interlaced.
+ */
+TImage *loadPNGGraphicFileSampled(const std::string& filename, const std::vector<unsigned>& columns, const std::vector<unsigned>& rows);
+
+/**
+ @brief    Reads a file in the Portable Network Graphic (PNG) format a row at a time, only a single row being held.
+ @param    filename The filename of the Portable Network Graphic (PNG) to be read.
+ @param    visit Called with each row of 32-bit pixels in turn, returning false to stop reading.
+ @return   A true on success, or false if the image can't be read or is interlaced.
+ */
+bool readPNGGraphicFileRows(const std::string& filename, const std::function<bool(unsigned y, const uint32_t* pixels, unsigned width)>& visit);
+
 /**
  @brief    Loads a file in the Bitmap (BMP) format.
  @param    filename The filename of the Bitmap (BMP) to be loaded.
@@ -61,9 +107,37 @@ TImage *loadPBMGraphicFile(const std::string& filename);
  @brief    Saves a file in the Portable Network Graphic (PNG) format.
  @param    image The image.
  @param    filename The filename of the Portable Network Graphic (PNG) to be loaded.
+ @param    palette The palette of an 8-bit indexed image, or nullptr to save an 8-bit image as grayscale.
+ @param    paletteSize The number of entries in the palette.
+ @return   A true on success.
+ */
+bool saveImageAsPNGFile(TImage* image, const std::string& filename, const uint32_t* palette = nullptr, int paletteSize = 0);
+
+/**
+ @brief    Saves a 32-bit or an 8-bit pixmap scaled by a whole number in the Portable Network Graphic (PNG) format,
+           the scaled rows are produced as they are written so the scaled image is never held in memory.
+ @param    image The image.
+ @param    scale The scale factor.
+ @param    filename The filename of the Portable Network Graphic (PNG) to be saved.
+ @param    palette The palette of an 8-bit indexed image, or nullptr to save an 8-bit image as grayscale.
+ @param    paletteSize The number of entries in the palette.
+ @param    token Stops writing rows once cancelled, failing the save, or nullptr.
  @return   A true on success.
  */
-bool saveImageAsPNGFile(TImage* image, const std::string& filename);
+bool saveScaledImageAsPNGFile(const TImage* image, int scale, const std::string& filename, const uint32_t* palette = nullptr, int paletteSize = 0, const CancellationToken* token = nullptr);
+
+/**
+ @brief    Encodes a 32-bit or an 8-bit pixmap scaled by a whole number in the Portable Network Graphic (PNG) format
+           into memory, for the caller to write.
+ @param    image The image.
+ @param    scale The scale factor.
+ @param    data Receives the contents of the PNG file.
+ @param    palette The palette of an 8-bit indexed image, or nullptr to encode an 8-bit image as grayscale.
+ @param    paletteSize The number of entries in the palette.
+ @param    token Stops encoding rows once cancelled, failing the encode, or nullptr.
+ @return   A true on success.
+ */
+bool encodeScaledImageAsPNG(const TImage* image, int scale, std::vector<uint8_t>& data, const uint32_t* palette = nullptr, int paletteSize = 0, const CancellationToken* token = nullptr);
 
 /**
  @brief    Creates a bitmap with the specified dimensions.
@@ -82,6 +156,33 @@ TImage *createBitmap(int w, int h);
  */
 TImage *createPixmap(int w, int h, int bitWidth);
 
+/**
+ @brief    Copies a rectangle of an 8-bit or 32-bit pixmap into a pixmap of its own.
+ @param    image The pixmap to crop.
+ @param    x The x-coordinate of the rectangle.
+ @param    y The y-coordinate of the rectangle.
+ @param    w The width of the rectangle.
+ @param    h The height of the rectangle.
+ @param    mapped Holds the cropped pixmap in a mapped file rather than in memory.
+ @return   A structure containing the cropped pixmap image data, or nullptr if the rectangle is not within the pixmap.
+ */
+TImage *cropPixmap(const TImage* image, int x, int y, int w, int h, bool mapped = false);
+
+/**
+ @brief    Creates a pixmap held in an unlinked temporary file, so the system can page it out rather than keep it in memory.
+ @param    w The width of the pixmap.
+ @param    h The height of the pixmap.
+ @param    bitWidth The bit width of the bitmap.
+ @return   A structure containing the pixmap image data, or nullptr if the file could not be created. Freed by reset as any other.
+ */
+TImage *createMappedPixmap(int w, int h, int bitWidth);
+
+/**
+ @brief    Sets the directory the files of mapped pixmaps are created in, by default TMPDIR or /tmp.
+ @param    directory The directory.
+ */
+void setMappedPixmapDirectory(const std::string& directory);
+
 /**
  @brief    Copies a section of a pixmap to another bitmap.
  @param    dst The pixmap to which the section will be copied.
@@ -155,5 +256,35 @@ TImage *extractImageSectionMasked(TImage* image, uint8_t maskColor);
  */
 TImage *grabImageSectionMasked(TImage* image, uint8_t maskColor, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
 
-TImage* scaleImage(const TImage *image, int scale);
+/**
+ @brief    Converts an 8-bit indexed pixmap to a 32-bit pixmap.
+ @param    pixmap The indexed pixmap to convert.
+ @param    palette The 256 entry palette the indices refer to.
+ @param    mapped Holds the 32-bit pixmap in a mapped file rather than in memory.
+ @return   A structure containing the 32-bit pixmap image data.
+ */
+TImage *convertIndexedPixmapToRGBA(const TImage* pixmap, const uint32_t* palette, bool mapped = false);
+
+/**
+ @brief    Scales a 32-bit or an 8-bit indexed pixmap by a whole number.
+ @param    image The pixmap to scale.
+ @param    scale The scale factor.
+ @param    mapped Holds the scaled pixmap in a mapped file rather than in memory.
+ @return   A structure containing the scaled pixmap image data.
+ */
+TImage* scaleImage(const TImage *image, int scale, bool mapped = false);
+
+/**
+ @brief    Scales a 32-bit or an 8-bit indexed pixmap with a pixel art upscaler.
+ @param    image The pixmap to scale.
+ @param    filter The upscaler, which also sets the scale factor.
+ @param    mapped Holds the scaled pixmap in a mapped file rather than in memory.
+ @return   A structure containing the scaled pixmap image data.
+ */
+TImage* scaleImageWithFilter(const TImage *image, ScaleFilter filter, bool mapped = false);
+
+/**
+ @brief    The scale factor of a pixel art upscaler.
+ */
+int scaleFilterFactor(ScaleFilter filter);
 
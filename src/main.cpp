@@ -27,9 +27,28 @@
 #include <string>
 #include <fstream>
 #include <array>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <filesystem>
+#include <algorithm>
+#include <csignal>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "rePiX.hpp"
 #include "ColorTable.hpp"
+#include "Report.hpp"
+#include "Kernels.hpp"
+#include "Parallel.hpp"
+#include "Pipeline.hpp"
+#include "Batch.hpp"
+#include "AsyncIO.hpp"
+#include "WatchFolder.hpp"
+#include "Manifest.hpp"
+#include "Metrics.hpp"
+#include "Allocations.hpp"
 
 #include "build.h"
 
@@ -111,14 +130,19 @@ void help(void)
     std::cout << "Copyright (C) 2024 Insoft. All rights reserved.\n";
     std::cout << "Insoft rePiX version, " << BUILD_NUMBER / 100000 << "." << BUILD_NUMBER / 10000 % 10 << (rev ? "." + std::to_string(rev) : "")
     << " (BUILD " << getBuildCode() << "-" << decimalToBase24(BUILD_DATE) << ")\n\n";
-    std::cout << "Usage: repix <input-file> [-o <output-file>] [-b <size>] [-x <scale>] [-p <levels>] [-a <act-file>] [-l] [-n <threshold>] [-u] [-s <size>] [-w <width>] [-h <height>] [-m <size>]\n\n";
+    std::cout << "Usage: repix <input-file> [-o <output-file>] [-b <size>] [-x <scale>] [-p <levels>] [-a <act-file>] [-l] [-n <threshold>] [-u] [-s <size>] [-w <width>] [-h <height>] [-m <size>] [-v] [--quality] [--report <file>] [--lut <file>] [--export-lut <file>] [--cpu <level>]\n";
+    std::cout << "       repix <input-file|directory> ... [-o <output-directory>] [--threads <r,c,w>] [--batch-memory <MiB>] [options]\n\n";
     std::cout << "Options:\n";
     std::cout << "    -o  <output-file>        Specify the filename for repixilated image.\n";
     std::cout << "    -b  <size>               Specify the block size.\n";
-    std::cout << "    -x  <scale>              Specify the scale factor for output image.\n";
+    std::cout << "    -x  <scale>              Specify the scale factor for output image, or a pixel art upscaler,\n";
+    std::cout << "                             one of scale2x, epx, scale3x or scale4x. A comma separated list\n";
+    std::cout << "                             such as 1,2,4 saves every scale from the one restoration.\n";
     std::cout << "    -p  <levels>             Posterize.\n";
     std::cout << "    -a  <act-file>           Specify the filename of the 'Adobe Color Table' file.\n";
-    std::cout << "                             use the default transparency index.\n";
+    std::cout << "                             use the default transparency index. A palette compiled with\n";
+    std::cout << "                             --compile-palette can be given instead. Given more than once, the\n";
+    std::cout << "                             table that best fits the restored colors is chosen.\n";
     std::cout << "    -l                       Specify if the repixilated should have a black outline applyed.\n";
     std::cout << "    -n  <threshold>          Normalize colors with a selected threshold.\n";
     std::cout << "    -u                       Auto adjust the specified block size for optimom sizing.\n";
@@ -129,11 +153,68 @@ void help(void)
     std::cout << "    -h  <height>             Specifying the destination height will automatically calculate the\n";
     std::cout << "                             required block size to achieve the desired height.\n";
     std::cout << "    -m  <size>               Specifying the surrounding margin size.\n";
+    std::cout << "    --roi <x,y,w,h>          Restore only the blocks covering the region of the source image given in\n";
+    std::cout << "                             pixels, saving the region as it would be cropped from the whole image.\n";
+    std::cout << "    -v                       Display detailed processing information.\n";
+    std::cout << "    --quality                Measure the restoration against the source image and output the\n";
+    std::cout << "                             PSNR, SSIM and per-block error as JSON.\n";
+    std::cout << "    --report <file>          Write the detected parameters and stage statistics as a JSON file,\n";
+    std::cout << "                             a filename ending in .ndjson has a line appended for each image.\n";
+    std::cout << "    --lut <file>             Apply a 3D LUT from an Adobe/Resolve .cube file after posterizing.\n";
+    std::cout << "    --export-lut <file>      Save the combined color stages, including any color table, as a\n";
+    std::cout << "                             33x33x33 .cube file.\n";
+    std::cout << "    --cpu <level>            Override the detected instruction set used by the pixel kernels,\n";
+    std::cout << "                             one of generic, sse2, avx2 or avx512.\n";
+    std::cout << "    --manifest <file>        Record each image of a batch as it completes, with its status and timings.\n";
+    std::cout << "    --resume                 Skip the images the manifest records as restored, if neither the image\n";
+    std::cout << "                             nor the options have changed and the outputs are still present.\n";
+    std::cout << "    --shard <i/n>            Restore only the share i, counting from 0, of n of a batch or watched\n";
+    std::cout << "                             directory, chosen by the path within the directory so that hosts can\n";
+    std::cout << "                             share it, each keeping its own manifest and report.\n";
+    std::cout << "    --threads <r,c,w>        With several inputs or a directory, the threads reading, restoring and\n";
+    std::cout << "                             writing images, the stages of different images overlapping.\n";
+    std::cout << "    --affinity <cpus>        Pin the threads restoring, and those of a batch, to CPUs, either compact\n";
+    std::cout << "                             filling the cores of a package first, scatter spreading across packages\n";
+    std::cout << "                             and cores first, or a list such as 0,2,4-7. Linux only.\n";
+    std::cout << "    --mem-limit <MiB>        Start a batch image only while the peak memory estimated for every\n";
+    std::cout << "                             image under way, from its size and the options, stays within the limit.\n";
+    std::cout << "    --schedule <order>       Start batch images in the order given, input, or largest or shortest\n";
+    std::cout << "                             first by their estimated peak memory, or cheapest first by their\n";
+    std::cout << "                             estimated work, the pixels times the stages, also when waiting\n";
+    std::cout << "                             between the batch stages.\n";
+    std::cout << "    --interactive <px[,n]>   Take batch or watched images of at most the pixels given ahead of\n";
+    std::cout << "                             the others, with n compute threads, 1 by default, kept for them.\n";
+    std::cout << "    --batch-memory <MiB>     The most decoded image data held waiting between the batch stages,\n";
+    std::cout << "                             defaults to 512.\n";
+    std::cout << "    --metrics-file <file>    Write the stage and image latencies, queue depths and bytes read and\n";
+    std::cout << "                             written in the Prometheus text format, every second while restoring.\n";
+    std::cout << "    --metrics-socket <path>  Serve the same metrics over HTTP on a local socket while restoring.\n";
+    std::cout << "    --profile                Print the time spent in each stage and, when built with\n";
+    std::cout << "                             REPIX_TRACK_ALLOCATIONS, the allocations made within each stage.\n";
+    std::cout << "    --timeout <ms>           Abandon an image not restored and saved within the time given, from\n";
+    std::cout << "                             when it starts restoring, exiting with status 254 for a single image.\n";
+    std::cout << "    --out-of-core            Decode the source a band of rows at a time and hold the restored image\n";
+    std::cout << "                             in a temporary file, for sources too large for memory. With --mem-limit\n";
+    std::cout << "                             an image whose estimate exceeds the limit is restored this way.\n";
+    std::cout << "    --tile-dir <dir>         Restore out of core, with the temporary files in the directory given.\n";
     std::cout << "\n";
     std::cout << "Additional Commands:\n";
     std::cout << "  repix {-version | -help}\n";
     std::cout << "    -version                 Display the version information.\n";
     std::cout << "    -help                    Show this help message.\n";
+    std::cout << "  repix --watch <directory> [-o <output-directory>] [options]\n";
+    std::cout << "    --watch                  Restore each PNG file as it is completed within the directory, until\n";
+    std::cout << "                             interrupted, along with any not yet restored. The outputs are saved\n";
+    std::cout << "                             to the output directory, by default repix within the directory, each\n";
+    std::cout << "                             appearing only once complete.\n";
+    std::cout << "  repix --merge-reports <summary-file> <report-file> ...\n";
+    std::cout << "    --merge-reports          Summarize the reports or manifests of every shard of a batch.\n";
+    std::cout << "  repix --compile-palette <act-file> [-o <lut-file>]\n";
+    std::cout << "    --compile-palette        Compile the nearest color of every RGB color into a lookup table\n";
+    std::cout << "                             file that is mapped by each process using it.\n";
+    std::cout << "  repix --verify-palette <lut-file>\n";
+    std::cout << "    --verify-palette         Check the whole of a compiled palette against its checksum, which\n";
+    std::cout << "                             is otherwise left unread beyond its header until used.\n";
 }
 
 void version(void) {
@@ -182,6 +263,222 @@ std::string removeExtension(const std::string& filename) {
 }
 
 
+bool parseScaleFilter(const std::string& name, ScaleFilter& filter) {
+    if (name == "scale2x" || name == "epx") filter = ScaleFilter::Scale2x;
+    else if (name == "scale3x") filter = ScaleFilter::Scale3x;
+    else if (name == "scale4x") filter = ScaleFilter::Scale4x;
+    else return false;
+    return true;
+}
+
+/*
+ Names the outputs of an image, a single scale defaulting to the input with the
+ scale as a suffix and several scales each getting their own file, named after
+ the output file with the scale as a suffix.
+ */
+Batch::Item nameOutputs(const std::string& in_filename, const std::string& out_filename, const std::vector<rePiX::ScaledOutput>& scales, unsigned scale) {
+    Batch::Item item = {in_filename, out_filename, scales};
+    
+    if (scales.size() > 1) {
+        std::string base = out_filename.empty() || out_filename == in_filename ? in_filename : out_filename;
+        std::string extension = out_filename.empty() || out_filename == in_filename ? ".png" : base.substr(removeExtension(base).length());
+        for (rePiX::ScaledOutput& output : item.scales) {
+            output.filename = removeExtension(base) + output.filename + extension;
+        }
+    }
+    
+    if (out_filename.empty() || out_filename == in_filename) {
+        item.output = removeExtension(in_filename) + "@" + std::to_string(scale) + "x.png";
+    }
+    return item;
+}
+
+std::vector<std::string> outputFilenames(const Batch::Item& item) {
+    std::vector<std::string> filenames;
+    for (const rePiX::ScaledOutput& output : item.scales) {
+        if (item.scales.size() > 1) filenames.push_back(output.filename);
+    }
+    if (filenames.empty()) filenames.push_back(item.output);
+    return filenames;
+}
+
+typedef struct {
+    unsigned index;
+    unsigned count;
+} Shard;
+
+// The order batch jobs are started in, by their estimated peak memory or work.
+enum class Schedule {
+    Input,
+    Largest,
+    Shortest,
+    Cheapest
+};
+
+/*
+ Whether the shard takes an input, decided by the hash of its path relative
+ to the directory given, so that hosts sharing the directory agree on every
+ input without talking to one another, wherever the directory is mounted.
+ */
+bool isInShard(const std::string& key, const Shard& shard) {
+    return shard.count <= 1 || Manifest::fnv1a(key) % shard.count == shard.index;
+}
+
+// Each shard keeps its own manifest and report, named after the one given.
+std::string shardFilename(const std::string& filename, const Shard& shard) {
+    if (shard.count <= 1 || filename.empty()) return filename;
+    return removeExtension(filename) + "." + std::to_string(shard.index) + "-of-" + std::to_string(shard.count) + filename.substr(removeExtension(filename).length());
+}
+
+// Whether the file is named as an output saved alongside its input, a name@Nx.png or name@Nx-filter.png.
+bool isGeneratedOutput(const std::filesystem::path& path) {
+    std::string stem = path.stem().string();
+    size_t at = stem.rfind('@');
+    if (at == std::string::npos) return false;
+    
+    size_t end = stem.find_first_not_of("0123456789", at + 1);
+    if (end == at + 1 || end == std::string::npos || stem[end] != 'x') return false;
+    return end + 1 == stem.length() || stem[end + 1] == '-';
+}
+
+/*
+ A directory given as an input stands for every PNG file within it, in name
+ order, less the outputs an earlier run without -o saved beside them, which
+ would otherwise be restored again by the next run or another shard.
+ */
+std::vector<std::string> expandInputs(const std::vector<std::string>& inputs, const Shard& shard) {
+    std::vector<std::string> files;
+    for (const std::string& input : inputs) {
+        std::error_code error;
+        if (!std::filesystem::is_directory(input, error)) {
+            if (isInShard(std::filesystem::path(input).lexically_normal().generic_string(), shard)) files.push_back(input);
+            continue;
+        }
+        
+        std::vector<std::string> entries;
+        for (const auto& entry : std::filesystem::directory_iterator(input, error)) {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (!entry.is_regular_file(error) || extension != ".png" || isGeneratedOutput(entry.path())) continue;
+            if (isInShard(entry.path().filename().generic_string(), shard)) entries.push_back(entry.path().string());
+        }
+        std::sort(entries.begin(), entries.end());
+        files.insert(files.end(), entries.begin(), entries.end());
+    }
+    return files;
+}
+
+/*
+ Fingerprints the options that decide the outputs, along with the size and
+ time of any file they name, so that a resumed batch only skips images that
+ were restored exactly as they would be now. Options that only change how the
+ run goes, or what it reports, are left out.
+ */
+std::string optionsFingerprint(int argc, const char * argv[]) {
+    const std::vector<std::string> ignored = {"-v", "--quality", "--resume", "--report", "--cpu", "--threads", "--batch-memory", "--manifest", "--watch", "--export-lut", "--shard", "--mem-limit", "--schedule", "--out-of-core", "--tile-dir", "--timeout", "--metrics-file", "--metrics-socket", "--profile", "--affinity", "--interactive"};
+    const std::vector<std::string> withValue = {"-o", "-b", "-p", "-x", "-a", "-n", "-s", "-w", "-h", "-m", "--report", "--lut", "--export-lut", "--cpu", "--threads", "--batch-memory", "--manifest", "--watch", "--shard", "--mem-limit", "--schedule", "--tile-dir", "--roi", "--timeout", "--metrics-file", "--metrics-socket", "--affinity", "--interactive"};
+    const std::vector<std::string> withFile = {"-a", "--lut"};
+    
+    std::string options;
+    for (int n = 1; n < argc; n++) {
+        std::string args(argv[n]);
+        if (args.empty() || args[0] != '-') continue;
+        
+        bool hasValue = std::find(withValue.begin(), withValue.end(), args) != withValue.end() && n + 1 < argc;
+        std::string value = hasValue ? argv[++n] : "";
+        if (std::find(ignored.begin(), ignored.end(), args) != ignored.end()) continue;
+        
+        options += args + " " + value + " ";
+        uint64_t size;
+        int64_t modified;
+        if (std::find(withFile.begin(), withFile.end(), args) != withFile.end() && Manifest::fingerprint(value, size, modified)) {
+            options += std::to_string(size) + ":" + std::to_string(modified) + " ";
+        }
+    }
+    return Manifest::hash(options);
+}
+
+void printQualityMetrics(const QualityMetrics& metrics) {
+    if (verbose) {
+        std::cout << MessageType::Verbose << "PSNR " << metrics.psnr << " dB, SSIM " << metrics.ssim << "\n";
+        std::cout << MessageType::Verbose << "Block error mean " << metrics.meanBlockError << ", max " << metrics.maxBlockError
+        << " at " << metrics.worstBlockX << "," << metrics.worstBlockY << "\n";
+    }
+    
+    std::cout << Report::toJSON(metrics) << "\n";
+}
+
+void writeMetrics(const std::string& filename) {
+    if (filename.empty()) return;
+    if (!Metrics::writeFile(filename)) {
+        std::cout << MessageType::Warning << "Unable to write the metrics '" << filename << "'.\n";
+    }
+}
+
+/*
+ Prints the time spent in each stage along with the allocations made within
+ it, those of each stage broken down by the site allocating them.
+ */
+void printProfile(const std::vector<rePiX::StageTiming>& timings) {
+    const std::vector<Allocations::Usage> stages = Allocations::stages(), sites = Allocations::sites();
+    std::vector<std::string> names;
+    for (const rePiX::StageTiming& timing : timings) names.push_back(timing.stage);
+    for (const Allocations::Usage& usage : stages) {
+        if (std::find(names.begin(), names.end(), usage.stage) == names.end()) names.push_back(usage.stage);
+    }
+    
+    char line[128];
+    std::cout << "Profile:\n";
+    snprintf(line, sizeof(line), Allocations::isEnabled() ? "  %-22s %10s %12s %12s %12s\n" : "  %-22s %10s\n", "stage", "ms", "allocations", "KiB", "peak KiB");
+    std::cout << line;
+    for (const std::string& name : names) {
+        // Stages outside of restoring, such as decoding a batch, are not timed.
+        double ms = 0;
+        bool timed = false;
+        for (const rePiX::StageTiming& timing : timings) {
+            if (timing.stage != name) continue;
+            ms += timing.milliseconds;
+            timed = true;
+        }
+        char time[16] = "-";
+        if (timed) snprintf(time, sizeof(time), "%.2f", ms);
+        if (!Allocations::isEnabled()) {
+            snprintf(line, sizeof(line), "  %-22s %10s\n", name.c_str(), time);
+            std::cout << line;
+            continue;
+        }
+        
+        Allocations::Usage total = {name, "", 0, 0, 0};
+        for (const Allocations::Usage& usage : stages) {
+            if (usage.stage == name) total = usage;
+        }
+        snprintf(line, sizeof(line), "  %-22s %10s %12zu %12zu %12zu\n", name.c_str(), time, total.count, total.bytes >> 10, total.peak >> 10);
+        std::cout << line;
+        
+        for (const Allocations::Usage& usage : sites) {
+            if (usage.stage != name) continue;
+            snprintf(line, sizeof(line), "    %-20s %10s %12zu %12zu %12zu\n", usage.site.c_str(), "", usage.count, usage.bytes >> 10, usage.peak >> 10);
+            std::cout << line;
+        }
+    }
+    
+    if (Allocations::isEnabled()) {
+        std::cout << "  Peak of " << (Allocations::peak() >> 10) << " KiB held at once\n";
+    } else {
+        std::cout << "  Allocations are only tracked when built with REPIX_TRACK_ALLOCATIONS defined.\n";
+    }
+}
+
+void exportLUT(const std::string& filename, int levels, const CubeLUT& cube, const ColorTable* colorTable) {
+    ColorLUT lut;
+    lut.addPostorize(levels);
+    if (cube.size) lut.addCube(cube);
+    if (colorTable != nullptr) lut.addColorTable(*colorTable);
+    if (!lut.saveCubeFile(filename)) {
+        std::cout << MessageType::Warning << "Unable to write the 3D LUT '" << filename << "'.\n";
+    }
+}
+
 int main(int argc, const char * argv[])
 {
     if ( argc == 1 ) {
@@ -189,16 +486,28 @@ int main(int argc, const char * argv[])
         return 0;
     }
     
-    std::string out_filename, in_filename;
-    
+    std::string out_filename, in_filename, report_filename, export_lut_filename, compile_palette_filename, verify_palette_filename, watch_directory, manifest_filename, merge_filename, metrics_filename, metrics_socket;
+    bool resume = false, profile = false, threadsGiven = false;
+    std::vector<unsigned> affinity;
+    Shard shard = {0, 1};
+    Schedule schedule = Schedule::Input;
+    uint64_t interactivePixels = 0;
+    std::vector<std::string> inputs;
+    Batch::Settings batchSettings = Batch::defaultSettings();
     
     
     rePiX repix = rePiX();
     ColorTable colorTable = ColorTable();
+    std::deque<ColorTable> colorTables;
+    std::deque<PaletteLUT> paletteLUTs;
+    std::vector<Pipeline::Candidate> candidates;
     bool outline = false;
     int levels = 255;
     float threshold = 0.0;
     bool autoAdjustBlockSize = false;
+    bool quality = false;
+    std::vector<rePiX::ScaledOutput> scales;
+    CubeLUT cube;
     
     for( int n = 1; n < argc; n++ ) {
         if (*argv[n] == '-') {
@@ -224,13 +533,52 @@ int main(int argc, const char * argv[])
             
             if (args == "-x") {
                 if (++n > argc) error();
-                repix.setScale(atoi(argv[n]));
+                scales.clear();
+                std::stringstream list(argv[n]);
+                std::string name;
+                while (std::getline(list, name, ',')) {
+                    rePiX::ScaledOutput output = {1, ScaleFilter::Nearest, ""};
+                    if (parseScaleFilter(name, output.filter)) {
+                        output.scale = scaleFilterFactor(output.filter);
+                        output.filename = "@" + std::to_string(output.scale) + "x-" + name;
+                    } else {
+                        if (atoi(name.c_str()) < 1) error();
+                        output.scale = atoi(name.c_str());
+                        output.filename = "@" + std::to_string(output.scale) + "x";
+                    }
+                    scales.push_back(output);
+                }
                 continue;
             }
             
             if (args == "-a") {
                 if (++n > argc) error();
-                colorTable.loadAdobeColorTable(argv[n]);
+                // Given more than once, the color table closest to the image is used.
+                colorTables.emplace_back();
+                if (PaletteLUT::isPaletteLUTFile(argv[n])) {
+                    paletteLUTs.emplace_back();
+                    if (!paletteLUTs.back().open(argv[n])) {
+                        std::cout << MessageType::Error << "The compiled palette '" << argv[n] << "' is damaged or from another version.\n";
+                        return -1;
+                    }
+                    paletteLUTs.back().getColorTable(colorTables.back());
+                    candidates.push_back({argv[n], &colorTables.back(), &paletteLUTs.back()});
+                    continue;
+                }
+                colorTables.back().loadAdobeColorTable(argv[n]);
+                if (colorTables.back().defined) candidates.push_back({argv[n], &colorTables.back(), nullptr});
+                continue;
+            }
+            
+            if (args == "--compile-palette") {
+                if (++n > argc) error();
+                compile_palette_filename = argv[n];
+                continue;
+            }
+            
+            if (args == "--verify-palette") {
+                if (++n > argc) error();
+                verify_palette_filename = argv[n];
                 continue;
             }
             
@@ -275,6 +623,173 @@ int main(int argc, const char * argv[])
             }
             
             
+            if (args == "-v") {
+                verbose = true;
+                continue;
+            }
+            
+            if (args == "--quality") {
+                quality = true;
+                continue;
+            }
+            
+            if (args == "--report") {
+                if (++n > argc) error();
+                report_filename = argv[n];
+                repix.collectStatistics = true;
+                continue;
+            }
+            
+            if (args == "--lut") {
+                if (++n > argc) error();
+                if (!cube.loadCubeFile(argv[n])) {
+                    std::cout << MessageType::Error << "Unable to load the 3D LUT '" << argv[n] << "'.\n";
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (args == "--export-lut") {
+                if (++n > argc) error();
+                export_lut_filename = argv[n];
+                continue;
+            }
+            
+            if (args == "--cpu") {
+                if (++n > argc) error();
+                CPULevel level;
+                if (!Kernels::parseCPULevel(argv[n], level)) error();
+                if (!Kernels::select(level)) {
+                    std::cout << MessageType::Warning << "The '" << argv[n] << "' instruction set is not supported by this CPU.\n";
+                }
+                continue;
+            }
+            
+            if (args == "--watch") {
+                if (++n > argc) error();
+                watch_directory = argv[n];
+                continue;
+            }
+            
+            if (args == "--manifest") {
+                if (++n > argc) error();
+                manifest_filename = argv[n];
+                continue;
+            }
+            
+            if (args == "--resume") {
+                resume = true;
+                continue;
+            }
+            
+            if (args == "--shard") {
+                if (++n > argc) error();
+                if (sscanf(argv[n], "%u/%u", &shard.index, &shard.count) != 2 || shard.count < 1 || shard.index >= shard.count) error();
+                continue;
+            }
+            
+            if (args == "--merge-reports") {
+                if (++n > argc) error();
+                merge_filename = argv[n];
+                continue;
+            }
+            
+            if (args == "--mem-limit") {
+                if (++n > argc) error();
+                if (atoi(argv[n]) < 1) error();
+                batchSettings.memoryLimit = (size_t)atoi(argv[n]) << 20;
+                continue;
+            }
+            
+            if (args == "--roi") {
+                if (++n > argc) error();
+                rePiX::Region region;
+                if (sscanf(argv[n], "%u,%u,%u,%u", &region.x, &region.y, &region.width, &region.height) != 4 || region.width < 1 || region.height < 1) error();
+                repix.setRegionOfInterest(region);
+                continue;
+            }
+            
+            if (args == "--metrics-file") {
+                if (++n > argc) error();
+                metrics_filename = argv[n];
+                continue;
+            }
+            
+            if (args == "--metrics-socket") {
+                if (++n > argc) error();
+                metrics_socket = argv[n];
+                continue;
+            }
+            
+            if (args == "--profile") {
+                profile = true;
+                continue;
+            }
+            
+            if (args == "--timeout") {
+                if (++n > argc) error();
+                if (atoi(argv[n]) < 1) error();
+                batchSettings.timeout = atoi(argv[n]);
+                continue;
+            }
+            
+            if (args == "--out-of-core") {
+                repix.setOutOfCore(true);
+                continue;
+            }
+            
+            if (args == "--tile-dir") {
+                if (++n > argc) error();
+                setMappedPixmapDirectory(argv[n]);
+                repix.setOutOfCore(true);
+                continue;
+            }
+            
+            if (args == "--schedule") {
+                if (++n > argc) error();
+                std::string name(argv[n]);
+                if (name == "largest") schedule = Schedule::Largest;
+                else if (name == "shortest") schedule = Schedule::Shortest;
+                else if (name == "cheapest") schedule = Schedule::Cheapest;
+                else if (name == "input") schedule = Schedule::Input;
+                else error();
+                batchSettings.cheapestFirst = schedule == Schedule::Cheapest;
+                continue;
+            }
+            
+            if (args == "--threads") {
+                if (++n > argc) error();
+                if (sscanf(argv[n], "%u,%u,%u", &batchSettings.readers, &batchSettings.workers, &batchSettings.writers) != 3) error();
+                threadsGiven = true;
+                continue;
+            }
+            
+            if (args == "--interactive") {
+                if (++n > argc) error();
+                unsigned long long pixels;
+                unsigned reserved = 1;
+                if (sscanf(argv[n], "%llu,%u", &pixels, &reserved) < 1 || pixels < 1) error();
+                interactivePixels = pixels;
+                batchSettings.reservedWorkers = reserved;
+                continue;
+            }
+            
+            if (args == "--affinity") {
+                if (++n > argc) error();
+                if (!Parallel::parseAffinity(argv[n], affinity)) {
+                    std::cout << MessageType::Error << "The affinity '" << argv[n] << "' is not compact, scatter or a list of the CPUs this process may run on.\n";
+                    return -1;
+                }
+                continue;
+            }
+            
+            if (args == "--batch-memory") {
+                if (++n > argc) error();
+                if (atoi(argv[n]) < 1) error();
+                batchSettings.memoryBudget = (size_t)atoi(argv[n]) << 20;
+                continue;
+            }
+            
             if (args == "-help") {
                 help();
                 return 0;
@@ -288,43 +803,429 @@ int main(int argc, const char * argv[])
             error();
             return 0;
         }
-        in_filename = argv[n];
+        inputs.push_back(argv[n]);
     }
     
     info();
     
-    if (!fileExists(in_filename)) {
+    if (verbose) {
+        std::cout << MessageType::Verbose << "Using " << Kernels::active().name << " pixel kernels\n";
+    }
+    
+    if (!affinity.empty() && !Parallel::canPinThreads()) {
+        std::cout << MessageType::Warning << "Threads can't be pinned on this system, the affinity is ignored.\n";
+        affinity.clear();
+    }
+    if (!affinity.empty()) {
+        Parallel::setAffinity(affinity);
+        
+        // Unless given, the threads of a batch are sized to the CPUs pinned to rather than every hardware thread.
+        if (!threadsGiven) {
+            Batch::Settings defaults = Batch::defaultSettings();
+            batchSettings.readers = defaults.readers;
+            batchSettings.workers = defaults.workers;
+            batchSettings.writers = defaults.writers;
+        }
+    }
+    
+    if (!compile_palette_filename.empty()) {
+        colorTable.loadAdobeColorTable(compile_palette_filename.c_str());
+        if (!colorTable.defined) {
+            std::cout << MessageType::Error << "File '" << compile_palette_filename << "' failed to load.\n";
+            return -1;
+        }
+        if (out_filename.empty()) out_filename = removeExtension(compile_palette_filename) + ".lut";
+        if (!PaletteLUT::compile(colorTable, out_filename)) {
+            std::cout << MessageType::Error << "Unable to write the compiled palette '" << out_filename << "'.\n";
+            return -1;
+        }
+        std::cout << "Compiled palette saved successfully: " << out_filename << "\n";
+        return 0;
+    }
+    
+    if (!verify_palette_filename.empty()) {
+        PaletteLUT paletteLUT;
+        if (!paletteLUT.open(verify_palette_filename) || !paletteLUT.verify()) {
+            std::cout << MessageType::Error << "The compiled palette '" << verify_palette_filename << "' is damaged or from another version.\n";
+            return -1;
+        }
+        std::cout << "Compiled palette verified: " << verify_palette_filename << "\n";
+        return 0;
+    }
+    
+    if (!merge_filename.empty()) {
+        std::vector<Manifest::Entry> entries;
+        for (const std::string& input : inputs) {
+            std::vector<Manifest::Entry> report = Manifest::read(input);
+            entries.insert(entries.end(), report.begin(), report.end());
+        }
+        std::string summary = Report::summarize(entries);
+        if (!Report::write(merge_filename, summary)) {
+            std::cout << MessageType::Error << "Unable to write the summary '" << merge_filename << "'.\n";
+            return -1;
+        }
+        std::cout << summary << "\n";
+        return 0;
+    }
+    
+    if (resume && manifest_filename.empty()) error();
+    manifest_filename = shardFilename(manifest_filename, shard);
+    
+    bool batch = inputs.size() > 1 || (inputs.size() == 1 && std::filesystem::is_directory(inputs.front())) || shard.count > 1;
+    if (batch) {
+        inputs = expandInputs(inputs, shard);
+        report_filename = shardFilename(report_filename, shard);
+    }
+    if (!inputs.empty()) in_filename = inputs.front();
+    
+    if (!watch_directory.empty()) {
+        std::error_code error;
+        if (!std::filesystem::is_directory(watch_directory, error)) {
+            std::cout << MessageType::Error << "Directory '" << watch_directory << "' not found.\n";
+            return -1;
+        }
+        // Outputs within the watched directory would themselves be picked up.
+        if (out_filename.empty()) out_filename = (std::filesystem::path(watch_directory) / "repix").string();
+        if (std::filesystem::equivalent(out_filename, watch_directory, error)) {
+            std::cout << MessageType::Error << "The output directory can't be the watched directory.\n";
+            return -1;
+        }
+        batch = true;
+    } else if (!fileExists(in_filename)) {
         std::cout << MessageType::Error << "File '" << in_filename << "' not found.\n";
         return -1;
     }
     
-    if (out_filename.empty() || out_filename == in_filename) {
-        out_filename = removeExtension(in_filename) + "@" + std::to_string(repix.scale) + "x.png";
+    if (scales.size() == 1) {
+        if (scales.front().filter == ScaleFilter::Nearest) {
+            repix.setScale(scales.front().scale);
+        } else {
+            repix.setScaleFilter(scales.front().filter);
+        }
+    }
+    
+    Pipeline::Options options = {threshold, (unsigned)levels, &cube, nullptr, nullptr, {}, outline, quality, scales, out_filename};
+    if (candidates.size() == 1) {
+        options.colorTable = candidates.front().colorTable;
+        options.paletteLUT = candidates.front().paletteLUT;
+    } else {
+        options.candidates = candidates;
+    }
+    
+    // Stopped on the way out of main, before the metrics it reads are destroyed.
+    Metrics::Server metricsServer;
+    if (!metrics_socket.empty() && !metricsServer.serve(metrics_socket)) {
+        std::cout << MessageType::Warning << "Unable to serve the metrics on '" << metrics_socket << "'.\n";
+    }
+    
+    if (batch) {
+        // The output, when given, is the directory the outputs are saved to, named as they would be alongside the inputs.
+        if (!out_filename.empty()) std::filesystem::create_directories(out_filename);
+        batchSettings.sharedMemory = Pipeline::sharedMemory(options);
+        auto batchItem = [&](const std::string& input) {
+            std::string name = input;
+            if (!out_filename.empty()) name = (std::filesystem::path(out_filename) / std::filesystem::path(input).filename()).string();
+            Batch::Item item = nameOutputs(name, "", scales, repix.scale);
+            item.input = input;
+            
+            // The peak memory and work are estimated from the header only when needed to admit, order or class the jobs.
+            uint16_t width, height;
+            uint64_t size;
+            int64_t modified;
+            if ((batchSettings.memoryLimit || schedule != Schedule::Input || interactivePixels) && readPNGGraphicFileSize(input, width, height) && Manifest::fingerprint(input, size, modified)) {
+                Pipeline::Options planned = options;
+                planned.scales = item.scales;
+                item.cost = (uint64_t)width * height * Pipeline::estimateStages(planned);
+                item.interactive = (uint64_t)width * height <= interactivePixels;
+                item.peakMemory = Pipeline::estimatePeakMemory(repix, width, height, planned) + size;
+                
+                // An image that could never fit within the limit, beside the shared tables, is restored out of core instead.
+                if (batchSettings.memoryLimit && item.peakMemory + batchSettings.sharedMemory > batchSettings.memoryLimit) {
+                    item.outOfCore = true;
+                    item.peakMemory = Pipeline::estimatePeakMemory(repix, width, height, planned, true);
+                }
+            }
+            item.outOfCore = item.outOfCore || repix.isOutOfCore();
+            return item;
+        };
+        
+        // Interactive images go ahead of the others whatever the order.
+        auto order = [&](std::vector<Batch::Item>& group) {
+            std::stable_sort(group.begin(), group.end(), [&](const Batch::Item& a, const Batch::Item& b) {
+                if (a.interactive != b.interactive) return a.interactive;
+                switch (schedule) {
+                    case Schedule::Largest:
+                        return a.peakMemory > b.peakMemory;
+                    case Schedule::Shortest:
+                        return a.peakMemory < b.peakMemory;
+                    case Schedule::Cheapest:
+                        return a.cost < b.cost;
+                    default:
+                        return false;
+                }
+            });
+        };
+        
+        auto configure = [&](rePiX& image, const Batch::Item& item) {
+            image.copySettings(repix);
+            if (autoAdjustBlockSize) image.autoAdjustBlockSize();
+            Pipeline::Options imageOptions = options;
+            imageOptions.scales = item.scales;
+            imageOptions.filename = item.output;
+            return imageOptions;
+        };
+        
+        Manifest manifest;
+        std::string options_fingerprint = optionsFingerprint(argc, argv);
+        if (!manifest_filename.empty() && !manifest.open(manifest_filename, resume)) {
+            std::cout << MessageType::Error << "Unable to open the manifest '" << manifest_filename << "'.\n";
+            return -1;
+        }
+        
+        // The input is fingerprinted when queued, so a change while it is being restored is seen on resuming.
+        std::mutex fingerprintMutex;
+        std::unordered_map<std::string, std::pair<uint64_t, int64_t>> fingerprints;
+        auto queued = [&](const Batch::Item& item) {
+            if (manifest_filename.empty()) return;
+            std::pair<uint64_t, int64_t> fingerprint = {0, 0};
+            Manifest::fingerprint(item.input, fingerprint.first, fingerprint.second);
+            std::lock_guard<std::mutex> lock(fingerprintMutex);
+            fingerprints[item.input] = fingerprint;
+        };
+        
+        // The stage timings of every image, summed for the profile.
+        std::vector<rePiX::StageTiming> timings;
+        // Completions are serialized by the batch, a plain flag is enough.
+        bool reported = false;
+        auto completion = [&](const Batch::Item& item, const rePiX& image, const Pipeline& pipeline, const std::string& message) {
+            for (const rePiX::StageTiming& timing : image.statistics.timings) {
+                if (!profile) break;
+                auto it = std::find_if(timings.begin(), timings.end(), [&](const rePiX::StageTiming& total) {
+                    return total.stage == timing.stage;
+                });
+                if (it == timings.end()) timings.push_back(timing);
+                else it->milliseconds += timing.milliseconds;
+            }
+            if (!manifest_filename.empty()) {
+                Manifest::Entry entry = {item.input, 0, 0, options_fingerprint, outputFilenames(item), message.empty(), message, image.statistics.timings};
+                {
+                    std::lock_guard<std::mutex> lock(fingerprintMutex);
+                    entry.size = fingerprints[item.input].first;
+                    entry.modified = fingerprints[item.input].second;
+                }
+                if (!manifest.record(entry)) {
+                    std::cout << MessageType::Warning << "Unable to write the manifest '" << manifest_filename << "'.\n";
+                }
+            }
+            
+            if (!message.empty()) {
+                std::cout << MessageType::Error << "File '" << item.input << "' failed: " << message << "\n";
+                return;
+            }
+            if (verbose) {
+                std::cout << MessageType::Verbose << item.input << " plan " << pipeline.describe() << "\n";
+            }
+            if (quality && image.statistics.hasQuality) printQualityMetrics(pipeline.quality);
+            if (!report_filename.empty()) {
+                // The first report truncates the file, every other image of the run is appended to it.
+                if (!Report::write(report_filename, Report::toJSON(item.input, outputFilenames(item), image.statistics), reported)) {
+                    std::cout << MessageType::Warning << "Unable to write report '" << report_filename << "'.\n";
+                }
+                reported = true;
+            }
+        };
+        
+        Metrics::FileWriter metricsWriter(metrics_filename);
+        
+        if (verbose) {
+            std::cout << MessageType::Verbose << "Batch of " << (watch_directory.empty() ? std::to_string(inputs.size()) : "watched") << " images, "
+            << batchSettings.readers << " reader, " << batchSettings.workers << " compute and " << batchSettings.writers << " writer threads, "
+            << AsyncIO().backend() << " file I/O\n";
+            if (!affinity.empty()) std::cout << MessageType::Verbose << "Pinning " << Batch::describeAffinity(batchSettings) << "\n";
+            if (interactivePixels) {
+                std::cout << MessageType::Verbose << "Images of at most " << interactivePixels << " pixels taken first, "
+                << std::min(batchSettings.reservedWorkers, std::max(batchSettings.workers, 1u) - 1) << " compute threads kept for them\n";
+            }
+        }
+        
+        if (!watch_directory.empty()) {
+            WatchFolder folder;
+            if (!folder.open(watch_directory)) {
+                std::cout << MessageType::Error << "Unable to watch '" << watch_directory << "'.\n";
+                return -1;
+            }
+            signal(SIGINT, [](int) { WatchFolder::stop(); });
+            signal(SIGTERM, [](int) { WatchFolder::stop(); });
+            
+            // Files that arrived while not watching are restored first, those already restored are skipped.
+            std::deque<Batch::Item> backlog;
+            for (const std::string& input : expandInputs({watch_directory}, shard)) {
+                Batch::Item item = batchItem(input);
+                if (fileExists(outputFilenames(item).front())) continue;
+                backlog.push_back(item);
+                queued(item);
+            }
+            
+            batchSettings.atomicWrites = true;
+            Batch::run([&](std::vector<Batch::Item>& group, size_t most) {
+                group.clear();
+                while (!backlog.empty() && group.size() < most) {
+                    group.push_back(backlog.front());
+                    backlog.pop_front();
+                }
+                if (!group.empty()) {
+                    order(group);
+                    return true;
+                }
+                
+                // Files for other shards are left to their hosts.
+                std::vector<std::string> filenames;
+                while (group.empty()) {
+                    if (!folder.wait(filenames, most)) return false;
+                    for (const std::string& filename : filenames) {
+                        if (!isInShard(std::filesystem::path(filename).filename().generic_string(), shard)) continue;
+                        group.push_back(batchItem(filename));
+                        queued(group.back());
+                    }
+                }
+                order(group);
+                return true;
+            }, batchSettings, configure, completion);
+            metricsWriter.stop();
+            writeMetrics(metrics_filename);
+            if (profile) printProfile(timings);
+            return 0;
+        }
+        
+        std::vector<Batch::Item> items;
+        size_t finished = 0;
+        for (const std::string& input : inputs) {
+            if (resume && manifest.isFinished(input, options_fingerprint)) {
+                finished++;
+                continue;
+            }
+            items.push_back(batchItem(input));
+            queued(items.back());
+        }
+        if (verbose && resume) {
+            std::cout << MessageType::Verbose << "Resuming, " << finished << " of " << inputs.size() << " images already restored\n";
+        }
+        order(items);
+        unsigned failures = Batch::run(items, batchSettings, configure, completion);
+        metricsWriter.stop();
+        writeMetrics(metrics_filename);
+        if (profile) printProfile(timings);
+        
+        if (!export_lut_filename.empty()) exportLUT(export_lut_filename, levels, cube, options.colorTable);
+        return failures ? -1 : 0;
+    }
+    
+    Batch::Item item = nameOutputs(in_filename, out_filename, scales, repix.scale);
+    out_filename = options.filename = item.output;
+    options.scales = item.scales;
+    
+    // A single image keeps a manifest of the one entry, as the last image of a batch would.
+    Manifest manifest;
+    std::string options_fingerprint = optionsFingerprint(argc, argv);
+    if (!manifest_filename.empty() && !manifest.open(manifest_filename, resume)) {
+        std::cout << MessageType::Error << "Unable to open the manifest '" << manifest_filename << "'.\n";
+        return -1;
+    }
+    if (resume && manifest.isFinished(in_filename, options_fingerprint)) {
+        if (verbose) std::cout << MessageType::Verbose << "Resuming, '" << in_filename << "' already restored\n";
+        return 0;
     }
+    Manifest::Entry entry = {in_filename, 0, 0, options_fingerprint, outputFilenames(item), false, "", {}};
+    Manifest::fingerprint(in_filename, entry.size, entry.modified);
+    auto record = [&](const std::string& message) {
+        if (manifest_filename.empty()) return;
+        entry.done = message.empty();
+        entry.error = message;
+        entry.timings = repix.statistics.timings;
+        if (!manifest.record(entry)) {
+            std::cout << MessageType::Warning << "Unable to write the manifest '" << manifest_filename << "'.\n";
+        }
+    };
     
     repix.loadPixelatedImage(in_filename);
     
     if (!repix.isPixelatedImageLoaded()) {
         std::cout << MessageType::Error << "File '" << in_filename << "' failed to load.\n";
+        record("Failed to load");
         return -1;
     }
     
     if (autoAdjustBlockSize) repix.autoAdjustBlockSize();
     
-    repix.restorePixelatedImage();
-    if (threshold > 0.0) {
-        repix.normalizeColors(threshold);
+    if (repix.hasRegionOfInterest() && (repix.regionOfInterest.x >= repix.statistics.sourceWidth || repix.regionOfInterest.y >= repix.statistics.sourceHeight)) {
+        std::cout << MessageType::Error << "The region of interest lies outside of '" << in_filename << "'.\n";
+        return -1;
+    }
+    
+    unsigned width = repix.statistics.sourceWidth, height = repix.statistics.sourceHeight;
+    size_t sharedMemory = Pipeline::sharedMemory(options);
+    if (batchSettings.memoryLimit && Pipeline::estimatePeakMemory(repix, width, height, options) + sharedMemory > batchSettings.memoryLimit) {
+        repix.setOutOfCore(true);
     }
-    repix.postorize(levels);
-    if (colorTable.defined) {
-        repix.normalizeColorsToColorTable(colorTable);
+    if (quality && repix.isOutOfCore()) {
+        std::cout << MessageType::Warning << "Quality is not measured out of core, the source is never held in full.\n";
+    }
+    if (verbose && repix.isOutOfCore()) {
+        std::cout << MessageType::Verbose << "Restoring out of core, about " << ((Pipeline::estimatePeakMemory(repix, width, height, options) + sharedMemory) >> 10) << " KiB held\n";
     }
     
-    if (outline) repix.applyOutline();
+    // Restoring runs on this thread as the first of the kernel threads.
+    if (!affinity.empty()) {
+        if (!Parallel::pinThread(0)) {
+            std::cout << MessageType::Warning << "Unable to pin to CPU " << Parallel::describeCPUs(0, 1) << ".\n";
+        } else if (verbose) {
+            std::cout << MessageType::Verbose << "Pinning kernel threads to CPUs " << Parallel::describeCPUs(0, Parallel::threadCount()) << "\n";
+        }
+    }
     
-    repix.applyScale();
+    CancellationToken cancellation;
+    cancellation.setTimeout(batchSettings.timeout);
+    repix.setCancellationToken(&cancellation);
     
-    repix.saveAs(out_filename);
+    Pipeline pipeline;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    try {
+        repix.restorePixelatedImage();
+        
+        pipeline.plan(repix, options);
+        if (verbose) {
+            std::cout << MessageType::Verbose << "Plan " << pipeline.describe() << "\n";
+        }
+        pipeline.run(repix);
+    } catch (const CancellationToken::Cancelled& e) {
+        std::cout << MessageType::Error << "File '" << in_filename << "' abandoned: " << e.what() << ".\n";
+        record(e.what());
+        Metrics::add("repix_images_total", "status=\"timed_out\"");
+        writeMetrics(metrics_filename);
+        return -2;
+    } catch (const std::exception& e) {
+        std::cout << MessageType::Error << "File '" << in_filename << "' failed: " << e.what() << ".\n";
+        record(e.what());
+        Metrics::add("repix_images_total", "status=\"failed\"");
+        writeMetrics(metrics_filename);
+        return -1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    Metrics::observe("repix_image_seconds", "", elapsed.count());
+    Metrics::add("repix_images_total", "status=\"done\"");
+    record("");
+    
+    if (quality && repix.statistics.hasQuality) printQualityMetrics(pipeline.quality);
+    
+    if (!export_lut_filename.empty()) exportLUT(export_lut_filename, levels, cube, pipeline.options.colorTable);
+    
+    if (!report_filename.empty()) {
+        if (!Report::write(report_filename, Report::toJSON(in_filename, outputFilenames(item), repix.statistics))) {
+            std::cout << MessageType::Warning << "Unable to write report '" << report_filename << "'.\n";
+        }
+    }
+    writeMetrics(metrics_filename);
+    if (profile) printProfile(repix.statistics.timings);
     
     
     return 0;
@@ -24,8 +24,19 @@
 
 #include "rePiX.hpp"
 #include "ImageAdjustments.hpp"
+#include "Kernels.hpp"
+#include "Parallel.hpp"
+#include "Metrics.hpp"
+#include "Allocations.hpp"
 
 #include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <stdexcept>
 
 //MARK: - ColorSpace Type/s
 
@@ -215,60 +226,194 @@ static uint32_t blockColor(const TImage* image, int blockSize, int x, int y) {
     
 }
 
-static uint32_t getPixel(const unsigned x, const unsigned y, const unsigned w, const unsigned h, const uint32_t *pixelData) {
-    if (x >= w || y >= h) return 0;
-    return pixelData[x + y * w];
+// Returns the position of the sample point for each block, matching the stepping used when restoring.
+static std::vector<unsigned> samplePoints(unsigned length, float blockSize) {
+    std::vector<unsigned> points;
+    for (float p = 0; p < length; p += blockSize) {
+        points.push_back(p + blockSize / 2);
+    }
+    return points;
 }
 
-static uint32_t averageColorForSampleSize(unsigned int size, unsigned x, unsigned y, const unsigned w, const unsigned h, const uint32_t *pixelData) {
-    struct {
-        union {
-            uint32_t rgba;
-            struct {
-                uint32_t r:8;
-                uint32_t g:8;
-                uint32_t b:8;
-                uint32_t a:8;
-            } channel;
-        };
-    } color;
+// Returns for each source pixel along an axis the block it falls within, offset by the margin.
+static std::vector<unsigned> blockMap(unsigned length, float blockSize, unsigned blocks, unsigned margin) {
+    std::vector<unsigned> map(length, ImageMetrics::NoBlock);
+    unsigned n = 0;
+    for (float p = 0; p < length && n < blocks; p += blockSize, n++) {
+        for (unsigned i = (unsigned)ceilf(p); i < length && i < p + blockSize; ++i) {
+            map[i] = n + margin;
+        }
+    }
+    return map;
+}
+
+static unsigned uniqueColorCount(const TImage* image, const std::vector<uint32_t>& palette) {
+    if (image->bitWidth == 8) {
+        std::vector<bool> used(256, false);
+        for (long i = 0; i < (long)image->width * image->height; ++i) {
+            used[image->data[i]] = true;
+        }
+        std::vector<uint32_t> colors;
+        for (size_t n = 0; n < palette.size(); ++n) {
+            if (used[n]) colors.push_back(palette[n]);
+        }
+        std::sort(colors.begin(), colors.end());
+        return (unsigned)(std::unique(colors.begin(), colors.end()) - colors.begin());
+    }
     
-    if (size < 1) size = 1;
-    uint32_t r,g,b,a;
+    const uint32_t* pixels = (const uint32_t *)image->data;
+    Allocations::Vector<uint32_t> colors(pixels, pixels + image->width * image->height, Allocations::Allocator<uint32_t>("color count"));
+    std::sort(colors.begin(), colors.end());
+    return (unsigned)(std::unique(colors.begin(), colors.end()) - colors.begin());
+}
+
+/*
+ Records the time spent within a stage into the statistics, and the stage
+ metrics, once it goes out of scope. Allocations made meanwhile are tracked
+ under the stage.
+ */
+class StageTimer {
+public:
+    StageTimer(std::vector<rePiX::StageTiming>& timings, const char* stage) : _timings(timings), _stage(stage), _allocations(stage) {
+        _start = std::chrono::steady_clock::now();
+    }
     
-    r = g = b = a = 0;
+    ~StageTimer() {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - _start;
+        _timings.push_back({_stage, elapsed.count()});
+        Metrics::observe("repix_stage_seconds", std::string("stage=\"") + _stage + "\"", elapsed.count() / 1000);
+    }
+    
+private:
+    std::vector<rePiX::StageTiming>& _timings;
+    const char* _stage;
+    Allocations::Stage _allocations;
+    std::chrono::steady_clock::time_point _start;
+};
+
+//MARK: - Method/s Implimentatin
+
+void rePiX::loadPixelatedImage(std::string& imagefile) {
+    _statistics = {};
+    StageTimer timer(_statistics.timings, "load");
     
-    x -= size / 2;
-    y -= size / 2;
+    reset(_originalImage);
+    _filename = imagefile;
+    _sourceWidth = _sourceHeight = 0;
     
-    for (int i = 0; i < size; ++i) {
-        for (int j = 0; j < size; ++j) {
-            color.rgba = getPixel(x + j, y + i, w, h, pixelData);
-            r += color.channel.r;
-            g += color.channel.g;
-            b += color.channel.b;
-            a += color.channel.a;
-        }
+    /*
+     Only the header is read at this point, the image data is decoded when
+     restoring so that large block sizes can skip the rows that are never
+     sampled.
+     */
+    readPNGGraphicFileSize(_filename, _sourceWidth, _sourceHeight);
+    _statistics.sourceWidth = _sourceWidth;
+    _statistics.sourceHeight = _sourceHeight;
+}
+
+void rePiX::setPixelatedImage(TImage* image, const std::string& name) {
+    _statistics = {};
+    
+    reset(_originalImage);
+    _originalImage = image;
+    _filename = name;
+    _sourceWidth = image->width;
+    _sourceHeight = image->height;
+    _statistics.sourceWidth = _sourceWidth;
+    _statistics.sourceHeight = _sourceHeight;
+}
+
+void rePiX::copySettings(const rePiX& other) {
+    _blockSize = other._blockSize;
+    _scale = other._scale;
+    _scaleFilter = other._scaleFilter;
+    _samplePointSize = other._samplePointSize;
+    width = other.width;
+    height = other.height;
+    margin = other.margin;
+    collectStatistics = other.collectStatistics;
+    _outOfCore = other._outOfCore;
+    _regionOfInterest = other._regionOfInterest;
+}
+
+void rePiX::setCancellationToken(const CancellationToken* token) {
+    _cancellationToken = token;
+}
+
+void rePiX::checkCancelled(void) const {
+    if (_cancellationToken != nullptr) _cancellationToken->check();
+}
+
+void rePiX::setRegionOfInterest(const Region& region) {
+    _regionOfInterest = region;
+}
+
+// Crops the halo from an image made from the restored image at the given scale, or returns nullptr if there is none.
+TImage* rePiX::cropImage(const TImage* image, unsigned factor) const {
+    if (_crop.width == 0 || _crop.height == 0) return nullptr;
+    return cropPixmap(image, _crop.x * factor, _crop.y * factor, _crop.width * factor, _crop.height * factor, _outOfCore);
+}
+
+void rePiX::setOutOfCore(bool enabled) {
+    _outOfCore = enabled;
+}
+
+TImage* rePiX::createImage(int w, int h, int bitWidth) const {
+    TImage* image = _outOfCore ? createMappedPixmap(w, h, bitWidth) : nullptr;
+    return image ? image : createPixmap(w, h, bitWidth);
+}
+
+void rePiX::releasePixelatedImage(void) {
+    reset(_originalImage);
+}
+
+/*
+ The source is held while restoring and processing, along with the restored
+ image and a copy of it while mapping to a palette, or the scaled image for a
+ single scale. The output is encoded in memory, which is taken to be at worst
+ as large as the raw pixels, a filtered scale also holding its scaled image.
+ Out of core only the band of source rows is held, the mapped images being
+ left to the system to page out, and the encoded pixel art is taken to be
+ small enough to leave out.
+ */
+size_t rePiX::estimatePeakMemory(unsigned sourceWidth, unsigned sourceHeight, const std::vector<ScaledOutput>& outputs, bool outOfCore) const {
+    if (outOfCore || _outOfCore) {
+        return (size_t)sourceWidth * 4 * ((_samplePointSize / 2) * 2 + 2);
     }
     
-    unsigned avarage = size * size;
-    color.channel.r = (uint32_t)(r /= avarage);
-    color.channel.g = (uint32_t)(g /= avarage);
-    color.channel.b = (uint32_t)(b /= avarage);
-    color.channel.a = (uint32_t)(a /= avarage);
+    float blockSize = _blockSize;
+    if (width > 0) {
+        blockSize = (float)sourceWidth / (float)width;
+    } else if (height > 0) {
+        blockSize = (float)sourceHeight / (float)height;
+    }
     
+    size_t source = (size_t)sourceWidth * sourceHeight * 4;
+    size_t restored = ((size_t)floor(sourceWidth / blockSize) + margin * 2) * ((size_t)floor(sourceHeight / blockSize) + margin * 2) * 4;
+    size_t processing = source + restored * 2;
+    size_t output = restored;
     
-    return color.rgba;
+    if (outputs.size() > 1) {
+        for (const ScaledOutput& scaled : outputs) {
+            size_t bytes = restored * scaled.scale * scaled.scale;
+            output += scaled.filter == ScaleFilter::Nearest ? bytes : bytes * 2;
+        }
+    } else {
+        size_t scaled = restored * _scale * _scale;
+        // Scale4x holds the 2x image while scaling it again.
+        if (_scaleFilter == ScaleFilter::Scale4x) scaled += restored * 4;
+        processing = std::max(processing, source + restored + scaled);
+        output = scaled * 2;
+    }
+    return std::max(processing, output);
 }
 
-//MARK: - Method/s Implimentatin
-
 void rePiX::setBlockSize(float value) {
     _blockSize = value < 1 ? 1 : value;
 }
 
 void rePiX::autoAdjustBlockSize(void) {
-    float width = static_cast<float>(_originalImage->width);
+    float width = static_cast<float>(_sourceWidth);
     _blockSize = width / floor(width / floor(_blockSize));
     
     float integerPart;
@@ -283,6 +428,12 @@ void rePiX::autoAdjustBlockSize(void) {
 
 void rePiX::setScale(const unsigned int scale) {
     _scale = scale < 1 ? 1 : scale;
+    _scaleFilter = ScaleFilter::Nearest;
+}
+
+void rePiX::setScaleFilter(const ScaleFilter filter) {
+    _scaleFilter = filter;
+    _scale = scaleFilterFactor(filter);
 }
 
 void rePiX::setSamplePointSize(const unsigned size) {
@@ -290,50 +441,496 @@ void rePiX::setSamplePointSize(const unsigned size) {
 }
 
 void rePiX::restorePixelatedImage(void) {
-    uint32_t color;
-    float x, y;
-    int destX, destY;
+    StageTimer timer(_statistics.timings, "restore");
+    
+    restoreBlocks();
     
+    _statistics.blockSize = _blockSize;
+    _statistics.restoredWidth = _newImage->width;
+    _statistics.restoredHeight = _newImage->height;
+    // Counting colors copies every pixel, which out of core is what is to be avoided.
+    if (collectStatistics && !_outOfCore) _statistics.restoredColors = uniqueColorCount(_newImage, _palette);
+}
+
+/*
+ Along one axis, the blocks restored for a region of interest, being those it
+ covers and a block either side for the stages that look at neighbours, and
+ the part of the restored image kept once that halo is cropped. A margin is
+ only added where the blocks reach the edge of the image, so the region comes
+ out as it would be cropped from the whole image.
+ */
+typedef struct {
+    unsigned first, last;   // The blocks restored
+    unsigned before, after; // The margin either side
+    unsigned keep, length;  // The pixels kept of those restored
+} Span;
+
+static Span regionSpan(unsigned blocks, float blockSize, unsigned margin, unsigned start, unsigned length) {
+    if (length == 0) return {0, blocks, margin, margin, 0, blocks + margin * 2};
+    
+    unsigned first = std::min(blocks > 0 ? blocks - 1 : 0, (unsigned)floorf(start / blockSize));
+    unsigned last = std::min(blocks, std::max(first + 1, (unsigned)ceilf((start + length) / blockSize)));
+    Span span;
+    span.first = first > 0 ? first - 1 : 0;
+    span.last = std::min(blocks, last + 1);
+    span.before = span.first == 0 ? margin : 0;
+    span.after = span.last == blocks ? margin : 0;
+    span.keep = first == 0 ? 0 : span.before + first - span.first;
+    span.length = last - first + (first == 0 ? margin : 0) + (last == blocks ? margin : 0);
+    return span;
+}
+
+// The sample points of the blocks restored, including any partial block that lands within the margin.
+static std::vector<unsigned> spanPoints(unsigned length, float blockSize, const Span& span) {
+    std::vector<unsigned> points = samplePoints(length, blockSize);
+    size_t first = std::min<size_t>(span.first, points.size());
+    size_t last = std::min<size_t>(points.size(), span.last + span.after);
+    return std::vector<unsigned>(points.begin() + first, points.begin() + last);
+}
+
+void rePiX::restoreBlocks(void) {
     if (width > 0 || height > 0) {
         if (width > 0) {
-            _blockSize = (float)_originalImage->width / (float)width;
+            _blockSize = (float)_sourceWidth / (float)width;
         } else {
-            _blockSize = (float)_originalImage->height / (float)height;
+            _blockSize = (float)_sourceHeight / (float)height;
         }
     }
     
-    _newImage = createPixmap(floor(_originalImage->width / _blockSize) + margin * 2, floor(_originalImage->height / _blockSize) + margin * 2, 32);
-    for (destY = 0, y = 0; y < _originalImage->height; y += _blockSize, destY++) {
-        for (destX = 0, x = 0; x < _originalImage->width; x += _blockSize, destX++) {
-            color = averageColorForSampleSize(_samplePointSize, x + _blockSize / 2, y + _blockSize / 2, _originalImage->width, _originalImage->height, (uint32_t *)_originalImage->data);
-            setImagePixel(_newImage, destX + margin, destY + margin, color);
+    Span across = regionSpan(floor(_sourceWidth / _blockSize), _blockSize, margin, _regionOfInterest.x, _regionOfInterest.width);
+    Span down = regionSpan(floor(_sourceHeight / _blockSize), _blockSize, margin, _regionOfInterest.y, _regionOfInterest.height);
+    _crop = {0, 0, 0, 0};
+    if (hasRegionOfInterest()) _crop = {across.keep, down.keep, across.length, down.length};
+    
+    reset(_newImage);
+    _palette.clear();
+    _outputScale = 1;
+    _newImage = createImage(across.before + across.last - across.first + across.after, down.before + down.last - down.first + down.after, 32);
+    
+    std::vector<unsigned> columns = spanPoints(_sourceWidth, _blockSize, across);
+    std::vector<unsigned> rows = spanPoints(_sourceHeight, _blockSize, down);
+    
+    /*
+     Once decoded in full there is nothing to be saved by sampling the file. A
+     region is read a band at a time too, the rows past it never being decoded.
+     */
+    if (_originalImage == nullptr && (_outOfCore || hasRegionOfInterest())) {
+        if (restoreBandedPixelatedImage(columns, rows, across.before, down.before)) return;
+    }
+    if (_originalImage == nullptr && _samplePointSize <= 1 && _blockSize >= 8.0f) {
+        if (restoreSampledPixelatedImage(columns, rows, across.before, down.before)) return;
+    }
+    
+    if (_originalImage == nullptr) {
+        _originalImage = loadPNGGraphicFile(_filename);
+    }
+    
+    /*
+     A partial block at the right or bottom edge is still sampled and, with a
+     margin, lands within the margin, anything beyond the image is dropped.
+     */
+    unsigned count = (unsigned)std::min<size_t>(columns.size(), _newImage->width - across.before);
+    SampleKernel kernel = Kernels::sampleKernel(_samplePointSize);
+    uint32_t* pixels = (uint32_t *)_newImage->data;
+    
+    for (unsigned n = 0; n < rows.size() && n + down.before < _newImage->height; ++n) {
+        checkCancelled();
+        kernel((const uint32_t *)_originalImage->data, _originalImage->width, _originalImage->height, columns.data(), count, rows[n], _samplePointSize, pixels + (n + down.before) * _newImage->width + across.before);
+    }
+}
+
+/*
+ With a single pixel sample point only one pixel per block is ever read, so for
+ large block sizes the image is decoded a row at a time and only the sampled
+ pixels are kept, rather than holding the whole image in memory.
+ */
+bool rePiX::restoreSampledPixelatedImage(const std::vector<unsigned>& columns, const std::vector<unsigned>& rows, unsigned left, unsigned top) {
+    TImage* sampledImage = loadPNGGraphicFileSampled(_filename, columns, rows);
+    if (sampledImage == nullptr) return false;
+    
+    for (int y = 0; y < sampledImage->height; ++y) {
+        for (int x = 0; x < sampledImage->width; ++x) {
+            setImagePixel(_newImage, x + left, y + top, getImagePixel(sampledImage, x, y));
         }
     }
+    
+    reset(sampledImage);
+    return true;
+}
+
+/*
+ Out of core the source is decoded a row at a time, keeping only a band of the
+ rows the sample points of the next row of blocks overlap. The band reaches a
+ row beyond the sample area so that the kernel, given the band as the image,
+ takes the same unclipped path it would on the whole image, while at the top
+ and bottom of the image the band is clipped just as the image is.
+ */
+bool rePiX::restoreBandedPixelatedImage(const std::vector<unsigned>& columns, const std::vector<unsigned>& rows, unsigned left, unsigned top) {
+    if (rows.empty()) return true;
+    
+    const unsigned size = _samplePointSize < 1 ? 1 : _samplePointSize;
+    const unsigned half = size / 2;
+    const unsigned height = _sourceHeight;
+    Allocations::Vector<uint32_t> band((size_t)_sourceWidth * (half * 2 + 1), Allocations::Allocator<uint32_t>("band"));
+    unsigned bandTop = 0, bandRows = 0;
+    
+    unsigned count = (unsigned)std::min<size_t>(columns.size(), _newImage->width - left);
+    SampleKernel kernel = Kernels::sampleKernel(_samplePointSize);
+    uint32_t* pixels = (uint32_t *)_newImage->data;
+    size_t n = 0;
+    
+    // Drops the rows above those the sample points of the given row overlap.
+    auto advance = [&](unsigned first) {
+        if (first <= bandTop) return;
+        unsigned drop = std::min(first - bandTop, bandRows);
+        memmove(band.data(), band.data() + (size_t)drop * _sourceWidth, (size_t)(bandRows - drop) * _sourceWidth * 4);
+        bandRows -= drop;
+        bandTop = first;
+    };
+    
+    // Cancelling stops reading, the token then being checked once libpng has been cleaned up.
+    bool read = readPNGGraphicFileRows(_filename, [&](unsigned y, const uint32_t* row, unsigned width) {
+        if (width != _sourceWidth) return false;
+        if (_cancellationToken != nullptr && _cancellationToken->isCancelled()) return false;
+        
+        unsigned first = rows[n] > half ? rows[n] - half : 0;
+        if (y < first) return true;
+        advance(first);
+        if (bandRows == 0) bandTop = y;
+        memcpy(band.data() + (size_t)bandRows++ * _sourceWidth, row, (size_t)_sourceWidth * 4);
+        
+        while (n < rows.size() && std::min(rows[n] + half + 1, height) <= y + 1) {
+            advance(rows[n] > half ? rows[n] - half : 0);
+            if (n + top < _newImage->height) {
+                kernel(band.data(), _sourceWidth, bandRows, columns.data(), count, rows[n] - bandTop, _samplePointSize, pixels + (n + top) * _newImage->width + left);
+            }
+            n++;
+        }
+        return n < rows.size();
+    });
+    checkCancelled();
+    return read;
 }
 
 void rePiX::postorize(const unsigned int levels) {
+    StageTimer timer(_statistics.timings, "postorize");
     if (_newImage == nullptr || _newImage->data == nullptr) return;
+    if (isIndexed()) {
+        // Every pixel shares its palette entry, so only the palette needs posterizing.
+        ImageAdjustments::postorize(_palette.data(), _palette.size(), levels);
+        return;
+    }
     ImageAdjustments::postorize(_newImage->data, _newImage->width * _newImage->height, levels);
 }
 
+void rePiX::applyColorLUT(ColorLUT& lut) {
+    StageTimer timer(_statistics.timings, "color");
+    if (_newImage == nullptr || _newImage->data == nullptr || lut.isEmpty()) return;
+    if (isIndexed()) {
+        lut.apply(_palette.data(), _palette.size());
+        return;
+    }
+    lut.apply((uint32_t *)_newImage->data, _newImage->width * _newImage->height);
+}
+
 void rePiX::normalizeColors(const float threshold) {
-    ImageAdjustments::normalizeColors((const void *)_newImage->data, _newImage->width, _newImage->height, threshold);
+    StageTimer timer(_statistics.timings, "normalize");
+    expandIndexedImage();
+    ImageAdjustments::normalizeColors((const void *)_newImage->data, _newImage->width, _newImage->height, threshold, _cancellationToken);
+    checkCancelled();
 }
 
 void rePiX::saveAs(std::string& filename) {
-    saveImageAsPNGFile(_newImage, filename);
+    StageTimer timer(_statistics.timings, "save");
+    saveOutput(_newImage, _outputScale, filename);
+}
+
+void rePiX::setOutputWriter(const OutputWriter& writer) {
+    _outputWriter = writer;
 }
 
+void rePiX::saveOutput(const TImage* image, int scale, const std::string& filename) {
+    const uint32_t* palette = image->bitWidth == 8 && !_palette.empty() ? _palette.data() : nullptr;
+    if (!_outputWriter) {
+        if (!saveScaledImageAsPNGFile(image, scale, filename, palette, (int)_palette.size(), _cancellationToken)) {
+            checkCancelled();
+            throw std::runtime_error("Failed to save file: " + filename);
+        }
+        return;
+    }
+    
+    std::vector<uint8_t> data;
+    if (!encodeScaledImageAsPNG(image, scale, data, palette, (int)_palette.size(), _cancellationToken)) {
+        checkCancelled();
+        throw std::runtime_error("Failed to encode file: " + filename);
+    }
+    _outputWriter(filename, data);
+}
+
+void rePiX::expandIndexedImage(void) {
+    if (!isIndexed()) return;
+    
+    TImage* image = convertIndexedPixmapToRGBA(_newImage, _palette.data(), _outOfCore);
+    reset(_newImage);
+    _newImage = image;
+    _palette.clear();
+}
+
+// Maps each color of a color table to its first entry, with transparent pixels being the transparency entry.
+static std::unordered_map<uint32_t, unsigned> colorTableIndices(const ColorTable& colorTable) {
+    std::unordered_map<uint32_t, unsigned> indices;
+    for (int n = colorTable.defined - 1; n >= 0; --n) {
+        indices[colorTable.colors[n]] = n;
+    }
+    if (colorTable.transparency >= 0) indices[0] = colorTable.transparency;
+    return indices;
+}
+
+/*
+ Once mapped every pixel is one of the color table entries, so the image is
+ kept as 8-bit indices with the table as its palette. Should any pixel be too
+ far from every entry to be matched it keeps its own color, which an index
+ can't hold, so the image stays 32-bit instead.
+ */
 void rePiX::normalizeColorsToColorTable(const ColorTable& colorTable) {
-    ImageAdjustments::mapColorsToNearestPalette(_newImage->data, _newImage->width, _newImage->height, colorTable.colors.data(), colorTable.defined, colorTable.transparency);
+    StageTimer timer(_statistics.timings, "palette");
+    expandIndexedImage();
+    
+    TImage* indexedImage = createImage(_newImage->width, _newImage->height, 8);
+    if (indexedImage != nullptr && ImageAdjustments::mapColorsToNearestPaletteIndex(_newImage->data, indexedImage->data, _newImage->width, _newImage->height, colorTable.colors.data(), colorTable.defined, _cancellationToken)) {
+        useColorTablePalette(colorTable, indexedImage);
+        checkCancelled();
+        return;
+    }
+    reset(indexedImage);
+    checkCancelled();
+    
+    ImageAdjustments::mapColorsToNearestPalette(_newImage->data, _newImage->width, _newImage->height, colorTable.colors.data(), colorTable.defined, colorTable.transparency, _cancellationToken);
+    checkCancelled();
+    countColorTableHits(colorTable);
+}
+
+void rePiX::normalizeColorsToPaletteLUT(const PaletteLUT& paletteLUT, const ColorTable& colorTable) {
+    StageTimer timer(_statistics.timings, "palette");
+    expandIndexedImage();
+    
+    TImage* indexedImage = createImage(_newImage->width, _newImage->height, 8);
+    if (indexedImage != nullptr && paletteLUT.mapColorsToIndices((const uint32_t *)_newImage->data, indexedImage->data, (long)_newImage->width * _newImage->height)) {
+        useColorTablePalette(colorTable, indexedImage);
+        return;
+    }
+    reset(indexedImage);
+    
+    ImageAdjustments::mapColorsToNearestPalette(_newImage->data, _newImage->width, _newImage->height, colorTable.colors.data(), colorTable.defined, colorTable.transparency, _cancellationToken);
+    checkCancelled();
+    countColorTableHits(colorTable);
+}
+
+void rePiX::indexColorTableColors(const ColorTable& colorTable) {
+    StageTimer timer(_statistics.timings, "index");
+    if (_newImage == nullptr || _newImage->data == nullptr || isIndexed()) return;
+    
+    std::unordered_map<uint32_t, unsigned> indices = colorTableIndices(colorTable);
+    TImage* indexedImage = createImage(_newImage->width, _newImage->height, 8);
+    if (indexedImage == nullptr) return;
+    
+    const uint32_t* pixels = (const uint32_t *)_newImage->data;
+    for (long i = 0; i < (long)_newImage->width * _newImage->height; ++i) {
+        auto it = indices.find(pixels[i]);
+        if (it == indices.end()) {
+            reset(indexedImage);
+            countColorTableHits(colorTable);
+            return;
+        }
+        indexedImage->data[i] = it->second;
+    }
+    useColorTablePalette(colorTable, indexedImage);
+}
+
+void rePiX::useColorTablePalette(const ColorTable& colorTable, TImage* indexedImage) {
+    reset(_newImage);
+    _newImage = indexedImage;
+    
+    int transparency = colorTable.transparency;
+    _palette.assign(colorTable.colors.begin(), colorTable.colors.begin() + colorTable.defined);
+    for (size_t n = 0; n < _palette.size() && transparency >= 0; ++n) {
+        if (_palette[n] == colorTable.colors[transparency]) _palette[n] = 0;
+    }
+    
+    // Entries made transparent share one index, so equal colors always have equal indices.
+    if (transparency >= 0) {
+        uint8_t* indices = _newImage->data;
+        for (long i = 0; i < (long)_newImage->width * _newImage->height; ++i) {
+            if (_palette[indices[i]] == 0) indices[i] = transparency;
+        }
+    }
+    
+    if (collectStatistics) {
+        _statistics.paletteHits.assign(colorTable.defined, 0);
+        for (long i = 0; i < (long)_newImage->width * _newImage->height; ++i) {
+            _statistics.paletteHits[_newImage->data[i]]++;
+        }
+    }
+}
+
+void rePiX::countColorTableHits(const ColorTable& colorTable) {
+    if (!collectStatistics) return;
+    
+    std::unordered_map<uint32_t, unsigned> indices = colorTableIndices(colorTable);
+    _statistics.paletteHits.assign(colorTable.defined, 0);
+    const uint32_t* pixels = (const uint32_t *)_newImage->data;
+    for (long i = 0; i < (long)_newImage->width * _newImage->height; ++i) {
+        auto it = indices.find(pixels[i]);
+        if (it != indices.end() && it->second < _statistics.paletteHits.size()) _statistics.paletteHits[it->second]++;
+    }
+}
+
+std::vector<uint32_t> rePiX::uniqueColors(std::vector<unsigned>& counts) const {
+    std::vector<uint32_t> colors;
+    counts.clear();
+    if (_newImage == nullptr || _newImage->data == nullptr) return colors;
+    
+    const long length = (long)_newImage->width * _newImage->height;
+    Allocations::Vector<uint32_t> pixels(length, Allocations::Allocator<uint32_t>("unique colors"));
+    for (long i = 0; i < length; ++i) {
+        pixels[i] = isIndexed() ? _palette[_newImage->data[i]] : ((const uint32_t *)_newImage->data)[i];
+    }
+    std::sort(pixels.begin(), pixels.end());
+    
+    for (long i = 0; i < length; ++i) {
+        if (i == 0 || pixels[i] != pixels[i - 1]) {
+            colors.push_back(pixels[i]);
+            counts.push_back(0);
+        }
+        counts.back()++;
+    }
+    return colors;
+}
+
+bool rePiX::isOpaque(void) const {
+    if (_newImage == nullptr || _newImage->data == nullptr) return true;
+    if (isIndexed()) {
+        for (uint32_t color : _palette) {
+            if (color >> 24 != 0xFF) return false;
+        }
+        return true;
+    }
+    
+    const uint32_t* pixels = (const uint32_t *)_newImage->data;
+    uint32_t alpha = 0xFF000000;
+    for (long i = 0; i < (long)_newImage->width * _newImage->height; ++i) {
+        alpha &= pixels[i];
+    }
+    return alpha == 0xFF000000;
 }
 
 void rePiX::applyOutline(void) {
-    ImageAdjustments::applyOutline(_newImage->data, _newImage->width, _newImage->height);
+    StageTimer timer(_statistics.timings, "outline");
+    if (isIndexed()) {
+        const uint32_t outlineColor = 0xFF000000;
+        auto it = std::find(_palette.begin(), _palette.end(), outlineColor);
+        if (it == _palette.end() && _palette.size() < 256) {
+            _palette.push_back(outlineColor);
+            it = _palette.end() - 1;
+        }
+        if (it != _palette.end()) {
+            ImageAdjustments::applyOutlineIndexed(_newImage->data, _newImage->width, _newImage->height, _palette.data(), (int)_palette.size(), (uint8_t)(it - _palette.begin()), _cancellationToken);
+            checkCancelled();
+            return;
+        }
+        
+        // A full palette has no room for the outline color.
+        expandIndexedImage();
+    }
+    ImageAdjustments::applyOutline(_newImage->data, _newImage->width, _newImage->height, _cancellationToken);
+    checkCancelled();
 }
 
 void rePiX::applyScale(void) {
-    TImage* scaledImage = scaleImage(_newImage, _scale);
+    StageTimer timer(_statistics.timings, "scale");
+    if (collectStatistics && !_outOfCore) _statistics.finalColors = uniqueColorCount(_newImage, _palette);
+    
+    // Out of core nearest scaling is left to be streamed row by row while saving.
+    if (_outOfCore && _scaleFilter == ScaleFilter::Nearest) {
+        TImage* croppedImage = cropImage(_newImage, 1);
+        if (croppedImage != nullptr) {
+            reset(_newImage);
+            _newImage = croppedImage;
+        }
+        _outputScale = _scale;
+        _statistics.width = _newImage->width * _scale;
+        _statistics.height = _newImage->height * _scale;
+        return;
+    }
+    
+    TImage* scaledImage = _scaleFilter == ScaleFilter::Nearest ? scaleImage(_newImage, _scale) : scaleImageWithFilter(_newImage, _scaleFilter, _outOfCore);
+    unsigned factor = scaledImage->width / _newImage->width;
     reset(_newImage);
     _newImage = scaledImage;
+    
+    TImage* croppedImage = cropImage(_newImage, factor);
+    if (croppedImage != nullptr) {
+        reset(_newImage);
+        _newImage = croppedImage;
+    }
+    
+    _statistics.width = _newImage->width;
+    _statistics.height = _newImage->height;
+}
+
+void rePiX::saveScaledAs(const std::vector<ScaledOutput>& outputs) {
+    StageTimer timer(_statistics.timings, "output");
+    if (_newImage == nullptr || _newImage->data == nullptr) return;
+    if (collectStatistics && !_outOfCore) _statistics.finalColors = uniqueColorCount(_newImage, _palette);
+    
+    // Nearest scaling takes only the pixels kept, upscalers crop once scaled as they look at neighbours.
+    TImage* croppedImage = cropImage(_newImage, 1);
+    const TImage* image = croppedImage != nullptr ? croppedImage : _newImage;
+    
+    Parallel::forRows((int)outputs.size(), 1, [&](int first, int last) {
+        for (int n = first; n < last; ++n) {
+            const ScaledOutput& output = outputs[n];
+            if (output.filter == ScaleFilter::Nearest) {
+                saveOutput(image, output.scale, output.filename);
+                continue;
+            }
+            
+            TImage* scaledImage = scaleImageWithFilter(_newImage, output.filter, _outOfCore);
+            TImage* croppedScaledImage = scaledImage != nullptr ? cropImage(scaledImage, output.scale) : nullptr;
+            if (croppedScaledImage != nullptr) std::swap(scaledImage, croppedScaledImage);
+            if (scaledImage != nullptr) saveOutput(scaledImage, 1, output.filename);
+            reset(scaledImage);
+            reset(croppedScaledImage);
+        }
+    });
+    
+    _statistics.outputSizes.clear();
+    for (const ScaledOutput& output : outputs) {
+        _statistics.outputSizes.push_back({image->width * output.scale, image->height * output.scale});
+    }
+    reset(croppedImage);
+    _statistics.width = _statistics.outputSizes.front().first;
+    _statistics.height = _statistics.outputSizes.front().second;
+}
+
+QualityMetrics rePiX::measureQuality(void) {
+    if (_newImage == nullptr || _newImage->data == nullptr) return QualityMetrics{};
+    
+    StageTimer timer(_statistics.timings, "quality");
+    if (_originalImage == nullptr) {
+        _originalImage = loadPNGGraphicFile(_filename);
+    }
+    
+    std::vector<unsigned> columns = blockMap(_sourceWidth, _blockSize, _newImage->width - margin * 2, margin);
+    std::vector<unsigned> rows = blockMap(_sourceHeight, _blockSize, _newImage->height - margin * 2, margin);
+    
+    if (isIndexed()) {
+        TImage* image = convertIndexedPixmapToRGBA(_newImage, _palette.data());
+        _statistics.quality = ImageMetrics::compare(_originalImage, image, columns, rows);
+        reset(image);
+    } else {
+        _statistics.quality = ImageMetrics::compare(_originalImage, _newImage, columns, rows);
+    }
+    _statistics.hasQuality = true;
+    return _statistics.quality;
 }
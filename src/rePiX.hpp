@@ -27,45 +27,191 @@
 
 #include "image.hpp"
 #include "ColorTable.hpp"
+#include "ImageMetrics.hpp"
+#include "ColorLUT.hpp"
+#include "PaletteLUT.hpp"
+#include "CancellationToken.hpp"
+
+#include <string>
+#include <vector>
+#include <functional>
 
 class rePiX {
 public:
+    typedef struct {
+        std::string stage;
+        double milliseconds;
+    } StageTiming;
+    
+    typedef struct {
+        unsigned scale;
+        ScaleFilter filter;
+        std::string filename;
+    } ScaledOutput;
+    
+    // Receives an encoded output in place of it being saved, outputs may be encoded concurrently.
+    typedef std::function<void(const std::string& filename, std::vector<uint8_t>& data)> OutputWriter;
+    
+    typedef struct {
+        float blockSize;
+        unsigned sourceWidth, sourceHeight;
+        unsigned restoredWidth, restoredHeight;
+        unsigned width, height;
+        std::vector<std::pair<unsigned, unsigned>> outputSizes; // Each output of a multi-scale save
+        unsigned restoredColors;            // Unique colors straight after restoring
+        unsigned finalColors;               // Unique colors after all the color stages, before scaling
+        std::vector<unsigned> paletteHits;  // Pixels mapped to each color table entry
+        bool hasQuality;
+        QualityMetrics quality;
+        std::vector<StageTiming> timings;
+    } Statistics;
+    
+    // A rectangle of the pixelated image, in its pixels.
+    typedef struct {
+        unsigned x, y, width, height;
+    } Region;
+    
     const unsigned int& scale = _scale;
+    const ScaleFilter& scaleFilter = _scaleFilter;
+    const Statistics& statistics = _statistics;
+    const Region& regionOfInterest = _regionOfInterest;
     unsigned width = 0;
     unsigned height = 0;
     unsigned margin = 0;
     
+    /*
+     Color counts and palette hits are gathered from the restored image after
+     a stage has run, only when enabled, so the stages themselves are unchanged.
+     */
+    bool collectStatistics = false;
+    
     ~rePiX() {
         reset(_originalImage);
         reset(_newImage);
     }
     
     bool isPixelatedImageLoaded(void) {
-        return (_originalImage != nullptr && _originalImage->data != nullptr);
+        return (_sourceWidth > 0 && _sourceHeight > 0);
+    }
+    
+    // After mapping to a color table the image is held as 8-bit indices into the palette.
+    bool isIndexed(void) const {
+        return _newImage != nullptr && _newImage->bitWidth == 8;
     }
     
-    void loadPixelatedImage(std::string& imagefile) {
-        _originalImage = loadPNGGraphicFile(imagefile);
+    void loadPixelatedImage(std::string& imagefile);
+    
+    // Takes ownership of an image already decoded, such as by a batch reader, in place of loading it.
+    void setPixelatedImage(TImage* image, const std::string& name);
+    
+    // Copies the restoration settings of another instance, so each image of a batch is restored alike.
+    void copySettings(const rePiX& other);
+    
+    /*
+     Out of core the source is never decoded in full, only a band of rows at a
+     time, and the restored image, and every image made from it, is held in a
+     file mapped into memory that the system can page out.
+     */
+    void setOutOfCore(bool enabled);
+    bool isOutOfCore(void) const {
+        return _outOfCore;
     }
     
+    /*
+     Restores only the blocks the region covers, along with a block either side
+     for the stages that look at neighbours, which is cropped once scaled, so
+     the output is the region as it would be cropped from the whole image.
+     Normalizing merges colors across only the pixels restored, so it can
+     differ. An empty region restores the whole image.
+     */
+    void setRegionOfInterest(const Region& region);
+    bool hasRegionOfInterest(void) const {
+        return _regionOfInterest.width > 0 && _regionOfInterest.height > 0;
+    }
+    
+    /*
+     The stages check the token a row at a time, throwing
+     CancellationToken::Cancelled once it is cancelled or past its deadline.
+     The token must outlive the work.
+     */
+    void setCancellationToken(const CancellationToken* token);
+    void checkCancelled(void) const;
+    
+    // Frees the source image once no stage still to run needs it.
+    void releasePixelatedImage(void);
+    
+    /**
+     @brief    Estimates the most memory restoring an image of the given size would take with the current settings.
+     @param    sourceWidth The width of the pixelated image.
+     @param    sourceHeight The height of the pixelated image.
+     @param    outputs The scales saved, several being saved from the one restored image.
+     @param    outOfCore Estimates restoring out of core, as it also is when already set to be.
+     @return   The peak memory in bytes.
+     */
+    size_t estimatePeakMemory(unsigned sourceWidth, unsigned sourceHeight, const std::vector<ScaledOutput>& outputs, bool outOfCore = false) const;
+    
     void setBlockSize(const float value);
     void autoAdjustBlockSize(void);
     void setScale(const unsigned int scale);
+    void setScaleFilter(const ScaleFilter filter);
     void setSamplePointSize(const unsigned size);
     void restorePixelatedImage(void);
     void postorize(const unsigned int levels);
+    void applyColorLUT(ColorLUT& lut);
     void normalizeColors(const float threshold);
     void normalizeColorsToColorTable(const ColorTable& colorTable);
+    
+    // Turns an image already mapped to the color table, such as by a color LUT, into palette indices.
+    void indexColorTableColors(const ColorTable& colorTable);
+    bool isOpaque(void) const;
+    
+    // The distinct colors of the restored image, along with how many pixels have each.
+    std::vector<uint32_t> uniqueColors(std::vector<unsigned>& counts) const;
+    
+    // Maps to the color table through its compiled lookup table rather than searching the palette.
+    void normalizeColorsToPaletteLUT(const PaletteLUT& paletteLUT, const ColorTable& colorTable);
     void applyOutline(void);
     void saveAs(std::string& filename);
+    
+    // Hands the outputs to the writer, such as for a batch to write many at once, rather than saving each file.
+    void setOutputWriter(const OutputWriter& writer);
     void applyScale(void);
     
+    /*
+     Writes every output from the one restored image, concurrently. Nearest
+     scaling is streamed row by row while encoding, so no scaled copy is held.
+     */
+    void saveScaledAs(const std::vector<ScaledOutput>& outputs);
+    QualityMetrics measureQuality(void);
+    
 private:
     TImage* _originalImage = nullptr;
     TImage* _newImage = nullptr;
+    std::string _filename;
+    uint16_t _sourceWidth = 0;
+    uint16_t _sourceHeight = 0;
     float _blockSize = 1.0;
     unsigned _scale = 1.0;
-    unsigned _samplePointSize;
+    ScaleFilter _scaleFilter = ScaleFilter::Nearest;
+    unsigned _samplePointSize = 1;
+    Statistics _statistics = {};
+    std::vector<uint32_t> _palette;
+    OutputWriter _outputWriter;
+    bool _outOfCore = false;
+    unsigned _outputScale = 1;
+    Region _regionOfInterest = {};
+    Region _crop = {};                  // The part of the restored image kept, if only a region was restored
+    const CancellationToken* _cancellationToken = nullptr;
+    
+    void restoreBlocks(void);
+    void saveOutput(const TImage* image, int scale, const std::string& filename);
+    void expandIndexedImage(void);
+    void useColorTablePalette(const ColorTable& colorTable, TImage* indexedImage);
+    void countColorTableHits(const ColorTable& colorTable);
+    bool restoreSampledPixelatedImage(const std::vector<unsigned>& columns, const std::vector<unsigned>& rows, unsigned left, unsigned top);
+    bool restoreBandedPixelatedImage(const std::vector<unsigned>& columns, const std::vector<unsigned>& rows, unsigned left, unsigned top);
+    TImage* createImage(int w, int h, int bitWidth) const;
+    TImage* cropImage(const TImage* image, unsigned factor) const;
 };
 
 #endif /* rePiX_hpp */